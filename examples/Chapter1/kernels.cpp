@@ -0,0 +1,215 @@
+/**
+ * LLVM equivalent of the sum/min/max/dot family, for every numeric width:
+ *
+ * T sum_T(T a, T b)                    { return a + b; }
+ * T min_T(T a, T b)                    { return a < b ? a : b; }
+ * T max_T(T a, T b)                    { return a > b ? a : b; }
+ * T dot_T(T *a, T *b, int64_t n)       { T acc = 0;
+ *                                        for (int64_t i = 0; i < n; i++)
+ *                                            acc += a[i] * b[i];
+ *                                        return acc; }
+ *
+ * The LLVM type and the opcodes of each kernel are looked up at compile time
+ * in the KernelType table below, so stamping out a new width is one more
+ * table entry and no type is ever dispatched on while the IR is built.
+ */
+
+#include <llvm-c/Core.h>
+#include <llvm-c/Analysis.h>
+#include <llvm-c/BitWriter.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// ======================================================
+// Compile-time type table
+// ======================================================
+
+// How a C++ type is represented in LLVM: the same i32 is used for int32_t
+// and uint32_t, only the opcodes and predicates differ.
+enum class Repr { Int, Float, Double };
+
+template <Repr R> LLVMTypeRef llvm_type(unsigned bits);
+template <> LLVMTypeRef llvm_type<Repr::Int>(unsigned bits) { return LLVMIntType(bits); }
+template <> LLVMTypeRef llvm_type<Repr::Float>(unsigned) { return LLVMFloatType(); }
+template <> LLVMTypeRef llvm_type<Repr::Double>(unsigned) { return LLVMDoubleType(); }
+
+template <typename T> struct KernelType;
+
+#define KERNEL_TYPE(CType, Suffix, Rep, Bits, Add, Mul, Less, Greater) \
+    template <> struct KernelType<CType> {                             \
+        static constexpr const char *suffix = Suffix;                  \
+        static constexpr Repr repr = Rep;                              \
+        static constexpr unsigned bits = Bits;                         \
+        static constexpr LLVMOpcode add = Add;                         \
+        static constexpr LLVMOpcode mul = Mul;                         \
+        static constexpr bool is_float = Rep != Repr::Int;             \
+        static constexpr int less = Less;                              \
+        static constexpr int greater = Greater;                        \
+    };
+
+//          C++ type  suffix  repr          bits add     mul     less           greater
+KERNEL_TYPE(int8_t,   "i8",  Repr::Int,    8,  LLVMAdd,  LLVMMul,  LLVMIntSLT,    LLVMIntSGT)
+KERNEL_TYPE(int16_t,  "i16", Repr::Int,    16, LLVMAdd,  LLVMMul,  LLVMIntSLT,    LLVMIntSGT)
+KERNEL_TYPE(int32_t,  "i32", Repr::Int,    32, LLVMAdd,  LLVMMul,  LLVMIntSLT,    LLVMIntSGT)
+KERNEL_TYPE(int64_t,  "i64", Repr::Int,    64, LLVMAdd,  LLVMMul,  LLVMIntSLT,    LLVMIntSGT)
+KERNEL_TYPE(uint8_t,  "u8",  Repr::Int,    8,  LLVMAdd,  LLVMMul,  LLVMIntULT,    LLVMIntUGT)
+KERNEL_TYPE(uint16_t, "u16", Repr::Int,    16, LLVMAdd,  LLVMMul,  LLVMIntULT,    LLVMIntUGT)
+KERNEL_TYPE(uint32_t, "u32", Repr::Int,    32, LLVMAdd,  LLVMMul,  LLVMIntULT,    LLVMIntUGT)
+KERNEL_TYPE(uint64_t, "u64", Repr::Int,    64, LLVMAdd,  LLVMMul,  LLVMIntULT,    LLVMIntUGT)
+KERNEL_TYPE(float,    "f32", Repr::Float,  32, LLVMFAdd, LLVMFMul, LLVMRealOLT,   LLVMRealOGT)
+KERNEL_TYPE(double,   "f64", Repr::Double, 64, LLVMFAdd, LLVMFMul, LLVMRealOLT,   LLVMRealOGT)
+
+#undef KERNEL_TYPE
+
+template <typename T> LLVMTypeRef type_of() {
+    return llvm_type<KernelType<T>::repr>(KernelType<T>::bits);
+}
+
+// Integer and floating-point comparisons are two different instructions,
+// the table already knows which one applies.
+template <bool IsFloat> struct Compare;
+template <> struct Compare<false> {
+    static LLVMValueRef build(LLVMBuilderRef b, int pred, LLVMValueRef l, LLVMValueRef r) {
+        return LLVMBuildICmp(b, (LLVMIntPredicate) pred, l, r, "cmp");
+    }
+};
+template <> struct Compare<true> {
+    static LLVMValueRef build(LLVMBuilderRef b, int pred, LLVMValueRef l, LLVMValueRef r) {
+        return LLVMBuildFCmp(b, (LLVMRealPredicate) pred, l, r, "cmp");
+    }
+};
+
+template <bool IsFloat> LLVMValueRef zero_of(LLVMTypeRef type);
+template <> LLVMValueRef zero_of<false>(LLVMTypeRef type) { return LLVMConstInt(type, 0, 0); }
+template <> LLVMValueRef zero_of<true>(LLVMTypeRef type) { return LLVMConstReal(type, 0.0); }
+
+// ======================================================
+// Kernel builders
+// ======================================================
+
+static LLVMValueRef add_function(LLVMModuleRef mod, const char *kernel, const char *suffix,
+                                 LLVMTypeRef ret, LLVMTypeRef *params, unsigned count) {
+    char name[32];
+    snprintf(name, sizeof(name), "%s_%s", kernel, suffix);
+    LLVMTypeRef fun_type = LLVMFunctionType(ret, params, count, 0);
+    return LLVMAddFunction(mod, name, fun_type);
+}
+
+template <typename T> void build_sum(LLVMModuleRef mod, LLVMBuilderRef builder) {
+    typedef KernelType<T> K;
+    LLVMTypeRef param_types[] = { type_of<T>(), type_of<T>() };
+    LLVMValueRef fun = add_function(mod, "sum", K::suffix, type_of<T>(), param_types, 2);
+    LLVMPositionBuilderAtEnd(builder, LLVMAppendBasicBlock(fun, "entry"));
+
+    LLVMValueRef tmp = LLVMBuildBinOp(builder, K::add, LLVMGetParam(fun, 0), LLVMGetParam(fun, 1), "tmp");
+    LLVMBuildRet(builder, tmp);
+}
+
+// min and max only differ by the predicate they select with.
+template <typename T> void build_select(LLVMModuleRef mod, LLVMBuilderRef builder,
+                                        const char *kernel, int pred) {
+    typedef KernelType<T> K;
+    LLVMTypeRef param_types[] = { type_of<T>(), type_of<T>() };
+    LLVMValueRef fun = add_function(mod, kernel, K::suffix, type_of<T>(), param_types, 2);
+    LLVMPositionBuilderAtEnd(builder, LLVMAppendBasicBlock(fun, "entry"));
+
+    LLVMValueRef a = LLVMGetParam(fun, 0);
+    LLVMValueRef b = LLVMGetParam(fun, 1);
+    LLVMValueRef cmp = Compare<K::is_float>::build(builder, pred, a, b);
+    LLVMBuildRet(builder, LLVMBuildSelect(builder, cmp, a, b, "tmp"));
+}
+
+template <typename T> void build_dot(LLVMModuleRef mod, LLVMBuilderRef builder) {
+    typedef KernelType<T> K;
+    LLVMTypeRef elem = type_of<T>();
+    LLVMTypeRef index = LLVMInt64Type();
+    LLVMTypeRef param_types[] = { LLVMPointerType(elem, 0), LLVMPointerType(elem, 0), index };
+    LLVMValueRef fun = add_function(mod, "dot", K::suffix, elem, param_types, 3);
+
+    LLVMBasicBlockRef entry = LLVMAppendBasicBlock(fun, "entry");
+    LLVMBasicBlockRef loop = LLVMAppendBasicBlock(fun, "loop");
+    LLVMBasicBlockRef exit = LLVMAppendBasicBlock(fun, "exit");
+    LLVMValueRef a = LLVMGetParam(fun, 0);
+    LLVMValueRef b = LLVMGetParam(fun, 1);
+    LLVMValueRef n = LLVMGetParam(fun, 2);
+    LLVMValueRef zero = zero_of<K::is_float>(elem);
+
+    // entry: skip the loop entirely when n <= 0
+    LLVMPositionBuilderAtEnd(builder, entry);
+    LLVMValueRef empty = LLVMBuildICmp(builder, LLVMIntSLE, n, LLVMConstInt(index, 0, 0), "empty");
+    LLVMBuildCondBr(builder, empty, exit, loop);
+
+    // loop: acc += a[i] * b[i]
+    LLVMPositionBuilderAtEnd(builder, loop);
+    LLVMValueRef i = LLVMBuildPhi(builder, index, "i");
+    LLVMValueRef acc = LLVMBuildPhi(builder, elem, "acc");
+    LLVMValueRef a_ptr = LLVMBuildGEP2(builder, elem, a, &i, 1, "a_ptr");
+    LLVMValueRef b_ptr = LLVMBuildGEP2(builder, elem, b, &i, 1, "b_ptr");
+    LLVMValueRef a_i = LLVMBuildLoad2(builder, elem, a_ptr, "a_i");
+    LLVMValueRef b_i = LLVMBuildLoad2(builder, elem, b_ptr, "b_i");
+    LLVMValueRef prod = LLVMBuildBinOp(builder, K::mul, a_i, b_i, "prod");
+    LLVMValueRef next_acc = LLVMBuildBinOp(builder, K::add, acc, prod, "next_acc");
+    LLVMValueRef next_i = LLVMBuildAdd(builder, i, LLVMConstInt(index, 1, 0), "next_i");
+    LLVMValueRef done = LLVMBuildICmp(builder, LLVMIntEQ, next_i, n, "done");
+    LLVMBuildCondBr(builder, done, exit, loop);
+
+    LLVMValueRef i_values[] = { LLVMConstInt(index, 0, 0), next_i };
+    LLVMValueRef acc_values[] = { zero, next_acc };
+    LLVMBasicBlockRef incoming[] = { entry, loop };
+    LLVMAddIncoming(i, i_values, incoming, 2);
+    LLVMAddIncoming(acc, acc_values, incoming, 2);
+
+    // exit: return the accumulator (or zero for an empty range)
+    LLVMPositionBuilderAtEnd(builder, exit);
+    LLVMValueRef result = LLVMBuildPhi(builder, elem, "result");
+    LLVMValueRef result_values[] = { zero, next_acc };
+    LLVMAddIncoming(result, result_values, incoming, 2);
+    LLVMBuildRet(builder, result);
+}
+
+template <typename T> void build_family(LLVMModuleRef mod, LLVMBuilderRef builder) {
+    build_sum<T>(mod, builder);
+    build_select<T>(mod, builder, "min", KernelType<T>::less);
+    build_select<T>(mod, builder, "max", KernelType<T>::greater);
+    build_dot<T>(mod, builder);
+}
+
+// Expands to one build_family<T> call per listed type.
+template <typename... Ts> void build_all(LLVMModuleRef mod, LLVMBuilderRef builder) {
+    int expand[] = { 0, (build_family<Ts>(mod, builder), 0)... };
+    (void) expand;
+}
+
+int main(int argc, char const *argv[]) {
+    // Module creation
+    LLVMModuleRef mod = LLVMModuleCreateWithName("kernels");
+
+    // Builder creation, shared by every kernel
+    LLVMBuilderRef builder = LLVMCreateBuilder();
+
+    // Every kernel for every width, in one module
+    build_all<int8_t, int16_t, int32_t, int64_t,
+              uint8_t, uint16_t, uint32_t, uint64_t,
+              float, double>(mod, builder);
+
+    //Analysis
+    char *error = NULL;
+    LLVMVerifyModule(mod, LLVMAbortProcessAction, &error);
+    LLVMDisposeMessage(error);
+
+    unsigned count = 0;
+    for (LLVMValueRef fun = LLVMGetFirstFunction(mod); fun; fun = LLVMGetNextFunction(fun)) {
+        count++;
+    }
+    printf("%u kernels generated\n", count);
+
+    // Bitcode writing to file
+    if (LLVMWriteBitcodeToFile(mod, "kernels.bc") != 0) {
+        fprintf(stderr, "error writing bitcode to file, skipping\n");
+    }
+
+    LLVMDisposeBuilder(builder);
+    LLVMDisposeModule(mod);
+}
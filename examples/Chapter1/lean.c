@@ -0,0 +1,140 @@
+/**
+ * What the names of the IR cost.
+ *
+ * The generators name every value and block, "tmp" and "entry" in sum.c.
+ * Each name is allocated, uniqued in the symbol table of its function and
+ * written into the bitcode, although only a human reading the IR uses it.
+ * FUNCTION_COUNT functions like
+ *
+ * int f_i(int a, int b) {
+ *     int v = a + b;
+ *     v = (v * 31) ^ (v >> 3) ... ; // BODY_STEPS times
+ *     return a < b ? v : -v;
+ * }
+ *
+ * are built in three ways: with names, as the debug builds of sum.c do;
+ * with names passed to a context that discards them
+ * (LLVMContextSetDiscardValueNames), for generators that cannot be changed;
+ * and lean, without names at all, as the release builds of sum.c do. The
+ * names of the functions are kept in every case, they are what the module
+ * exports.
+ *
+ * sum.c passes its names through IR_NAME(): names only help reading the
+ * IR, so debug builds keep them, while release builds (-DNDEBUG) do not
+ * pass them and have the context discard the others.
+ *
+ * The report gives the heap used by the module, the bitcode size and the
+ * build and write times, best of ROUNDS.
+ */
+
+#include <llvm-c/Core.h>
+#include <llvm-c/BitWriter.h>
+
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define FUNCTION_COUNT 4000
+#define BODY_STEPS 24
+#define ROUNDS 5
+
+typedef enum {
+    NAMED,      // names passed and kept
+    DISCARDED,  // names passed, dropped by the context
+    LEAN,       // no names passed, dropped by the context
+} NameMode;
+
+static const char *mode_names[] = { "named", "discarded", "lean" };
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static size_t heap_in_use(void) {
+    return mallinfo2().uordblks;
+}
+
+static void build_function(LLVMModuleRef mod, LLVMBuilderRef builder, unsigned i, int named) {
+#define NAME(name) (named ? (name) : "")
+    LLVMContextRef ctx = LLVMGetModuleContext(mod);
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(ctx);
+    LLVMTypeRef param_types[] = { i32, i32 };
+    char name[32];
+    snprintf(name, sizeof(name), "f_%u", i);
+    LLVMValueRef fun = LLVMAddFunction(mod, name, LLVMFunctionType(i32, param_types, 2, 0));
+
+    LLVMPositionBuilderAtEnd(builder, LLVMAppendBasicBlockInContext(ctx, fun, NAME("entry")));
+    LLVMValueRef a = LLVMGetParam(fun, 0);
+    LLVMValueRef b = LLVMGetParam(fun, 1);
+    if (named) {
+        LLVMSetValueName2(a, "a", 1);
+        LLVMSetValueName2(b, "b", 1);
+    }
+    LLVMValueRef v = LLVMBuildAdd(builder, a, b, NAME("tmp"));
+    for (unsigned s = 0; s < BODY_STEPS; s++) {
+        LLVMValueRef scaled = LLVMBuildMul(builder, v, LLVMConstInt(i32, 31 + s, 0), NAME("scaled"));
+        LLVMValueRef shifted = LLVMBuildAShr(builder, v, LLVMConstInt(i32, 3, 0), NAME("shifted"));
+        v = LLVMBuildXor(builder, scaled, shifted, NAME("v"));
+    }
+    LLVMValueRef less = LLVMBuildICmp(builder, LLVMIntSLT, a, b, NAME("less"));
+    LLVMValueRef negated = LLVMBuildNeg(builder, v, NAME("neg"));
+    LLVMBuildRet(builder, LLVMBuildSelect(builder, less, v, negated, NAME("result")));
+#undef NAME
+}
+
+typedef struct {
+    double build;
+    double write;
+    size_t heap;
+    size_t bitcode;
+} Measure;
+
+static void run(NameMode mode, Measure *m) {
+    size_t heap_before = heap_in_use();
+    double start = now();
+    LLVMContextRef ctx = LLVMContextCreate();
+    LLVMContextSetDiscardValueNames(ctx, mode != NAMED);
+    LLVMModuleRef mod = LLVMModuleCreateWithNameInContext(mode == LEAN ? "" : "my_module", ctx);
+    LLVMBuilderRef builder = LLVMCreateBuilderInContext(ctx);
+    for (unsigned i = 0; i < FUNCTION_COUNT; i++) {
+        build_function(mod, builder, i, mode != LEAN);
+    }
+    m->build = now() - start;
+    m->heap = heap_in_use() - heap_before;
+
+    start = now();
+    LLVMMemoryBufferRef bitcode = LLVMWriteBitcodeToMemoryBuffer(mod);
+    m->write = now() - start;
+    m->bitcode = LLVMGetBufferSize(bitcode);
+
+    LLVMDisposeMemoryBuffer(bitcode);
+    LLVMDisposeBuilder(builder);
+    LLVMDisposeModule(mod);
+    LLVMContextDispose(ctx);
+}
+
+int main(int argc, char const *argv[]) {
+    printf("%d functions of %d instructions, best of %d\n", FUNCTION_COUNT, 3 * BODY_STEPS + 5, ROUNDS);
+    Measure named = { 0 };
+    for (int mode = NAMED; mode <= LEAN; mode++) {
+        Measure best = { 0 };
+        for (int r = 0; r < ROUNDS; r++) {
+            Measure m;
+            run(mode, &m);
+            if (r == 0 || m.build + m.write < best.build + best.write) {
+                best = m;
+            }
+        }
+        if (mode == NAMED) {
+            named = best;
+        }
+        printf("%-10s heap %6.2f MB (%5.1f%%), bitcode %7zu bytes (%5.1f%%), build %6.2f ms (%5.1f%%),"
+               " write %6.2f ms (%5.1f%%)\n",
+               mode_names[mode], best.heap / 1048576.0, 100.0 * best.heap / named.heap, best.bitcode,
+               100.0 * best.bitcode / named.bitcode, best.build * 1e3, 100.0 * best.build / named.build,
+               best.write * 1e3, 100.0 * best.write / named.write);
+    }
+}
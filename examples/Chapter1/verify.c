@@ -0,0 +1,170 @@
+/**
+ * Incremental, non-aborting verification of generated functions.
+ *
+ * The generator finishes FUNCTION_COUNT functions like
+ *
+ * int f_i(int a, int b) {
+ *     int v = a + b;
+ *     v = (v * 31) ^ (v >> 3) ... ; // BODY_STEPS times
+ *     return a < b ? v : -v;
+ * }
+ *
+ * and checks each one as soon as it is finished with verify_function(),
+ * which returns the problem to the caller instead of aborting. A function
+ * that does not verify is deleted and reported; the rest of the module is
+ * still used. A trusted generator skips the verification altogether.
+ *
+ * The verifier cost is measured for the three strategies: the whole module
+ * once at the end (what sum.c did), each function as it is finished, and
+ * none (trusted). Every BROKEN_EVERY-th function is then built without its
+ * terminator to exercise the error path.
+ */
+
+#include <llvm-c/Core.h>
+#include <llvm-c/Analysis.h>
+#include <llvm-c/BitWriter.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define FUNCTION_COUNT 4000
+#define BODY_STEPS 24
+#define BROKEN_EVERY 1000
+#define ROUNDS 5
+
+typedef enum {
+    VERIFY_MODULE,      // the whole module, once it is complete
+    VERIFY_FUNCTIONS,   // every function, as soon as it is finished
+    VERIFY_TRUSTED,     // none, the generator is known to be correct
+} VerifyMode;
+
+static const char *mode_names[] = { "whole module", "per function", "trusted" };
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Verifies fun, which was just finished. Returns 0 when it is well formed,
+ * otherwise 1 with *error set to a message to dispose with
+ * LLVMDisposeMessage. The functions finished before must have been
+ * verified too: the message comes from the module verifier, which is only
+ * run on failure.
+ */
+static int verify_function(LLVMValueRef fun, char **error) {
+    if (!LLVMVerifyFunction(fun, LLVMReturnStatusAction)) {
+        return 0;
+    }
+    LLVMVerifyModule(LLVMGetGlobalParent(fun), LLVMReturnStatusAction, error);
+    return 1;
+}
+
+static void build_function(LLVMModuleRef mod, LLVMBuilderRef builder, unsigned i, int broken) {
+    LLVMContextRef ctx = LLVMGetModuleContext(mod);
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(ctx);
+    LLVMTypeRef param_types[] = { i32, i32 };
+    char name[32];
+    snprintf(name, sizeof(name), "f_%u", i);
+    LLVMValueRef fun = LLVMAddFunction(mod, name, LLVMFunctionType(i32, param_types, 2, 0));
+
+    LLVMBasicBlockRef entry = LLVMAppendBasicBlockInContext(ctx, fun, "entry");
+    LLVMPositionBuilderAtEnd(builder, entry);
+    LLVMValueRef a = LLVMGetParam(fun, 0);
+    LLVMValueRef b = LLVMGetParam(fun, 1);
+    LLVMValueRef v = LLVMBuildAdd(builder, a, b, "tmp");
+    for (unsigned s = 0; s < BODY_STEPS; s++) {
+        LLVMValueRef scaled = LLVMBuildMul(builder, v, LLVMConstInt(i32, 31 + s, 0), "scaled");
+        LLVMValueRef shifted = LLVMBuildAShr(builder, v, LLVMConstInt(i32, 3, 0), "shifted");
+        v = LLVMBuildXor(builder, scaled, shifted, "v");
+    }
+    LLVMValueRef less = LLVMBuildICmp(builder, LLVMIntSLT, a, b, "less");
+    LLVMValueRef result = LLVMBuildSelect(builder, less, v, LLVMBuildNeg(builder, v, "neg"), "result");
+    if (!broken) {
+        LLVMBuildRet(builder, result);
+    }
+}
+
+typedef struct {
+    double build;
+    double verify;
+    double write;
+    unsigned rejected;
+} Timings;
+
+static void run(VerifyMode mode, unsigned broken_every, Timings *t) {
+    LLVMContextRef ctx = LLVMContextCreate();
+    LLVMModuleRef mod = LLVMModuleCreateWithNameInContext("my_module", ctx);
+    LLVMBuilderRef builder = LLVMCreateBuilderInContext(ctx);
+
+    for (unsigned i = 0; i < FUNCTION_COUNT; i++) {
+        double start = now();
+        build_function(mod, builder, i, broken_every && i % broken_every == broken_every - 1);
+        double built = now();
+        t->build += built - start;
+
+        if (mode == VERIFY_FUNCTIONS) {
+            LLVMValueRef fun = LLVMGetLastFunction(mod);
+            char *error = NULL;
+            if (verify_function(fun, &error)) {
+                // The caller decides: here the function is dropped
+                if (t->rejected++ == 0) {
+                    printf("  rejected %s: %s", LLVMGetValueName(fun), error);
+                }
+                LLVMDisposeMessage(error);
+                LLVMDeleteFunction(fun);
+            }
+            t->verify += now() - built;
+        }
+    }
+
+    if (mode == VERIFY_MODULE) {
+        double start = now();
+        char *error = NULL;
+        if (LLVMVerifyModule(mod, LLVMReturnStatusAction, &error)) {
+            // Nothing tells which functions to drop, the whole module goes
+            t->rejected += FUNCTION_COUNT;
+        }
+        LLVMDisposeMessage(error);
+        t->verify += now() - start;
+    }
+
+    if (t->rejected < FUNCTION_COUNT) {
+        double start = now();
+        LLVMMemoryBufferRef bitcode = LLVMWriteBitcodeToMemoryBuffer(mod);
+        t->write += now() - start;
+        LLVMDisposeMemoryBuffer(bitcode);
+    }
+
+    LLVMDisposeBuilder(builder);
+    LLVMDisposeModule(mod);
+    LLVMContextDispose(ctx);
+}
+
+int main(int argc, char const *argv[]) {
+    printf("%d functions of %d instructions, best of %d\n", FUNCTION_COUNT, 3 * BODY_STEPS + 5, ROUNDS);
+    for (int mode = VERIFY_MODULE; mode <= VERIFY_TRUSTED; mode++) {
+        Timings best = { 0 };
+        for (int r = 0; r < ROUNDS; r++) {
+            Timings t = { 0 };
+            run(mode, 0, &t);
+            if (r == 0 || t.build + t.verify + t.write < best.build + best.verify + best.write) {
+                best = t;
+            }
+        }
+        double total = best.build + best.verify + best.write;
+        printf("%-13s build %7.2f ms, verify %7.2f ms, bitcode %7.2f ms: verifier %4.1f%% of %.2f ms\n",
+               mode_names[mode], best.build * 1e3, best.verify * 1e3, best.write * 1e3,
+               100.0 * best.verify / total, total * 1e3);
+    }
+
+    // A broken function every BROKEN_EVERY: reported, dropped, the process goes on
+    printf("with a broken function every %d:\n", BROKEN_EVERY);
+    for (int mode = VERIFY_MODULE; mode <= VERIFY_FUNCTIONS; mode++) {
+        Timings t = { 0 };
+        run(mode, BROKEN_EVERY, &t);
+        printf("  %-13s %u of %d functions rejected\n", mode_names[mode], t.rejected, FUNCTION_COUNT);
+    }
+}
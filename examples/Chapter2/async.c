@@ -0,0 +1,174 @@
+/**
+ * Request handler driving the asynchronous compile service.
+ *
+ * JOB_COUNT jobs are submitted at once, each building a variant of sum:
+ *
+ * int sum_k(int a, int b) {
+ *     return a + b + k;             // through HELPER_COUNT chained helpers
+ * }
+ *
+ * Even jobs are linked into the JIT of the service, odd ones are emitted as
+ * x86_64 objects. A few jobs get a deadline that passes while they wait in
+ * the queue, a few are cancelled right after being submitted, and one
+ * builds an invalid module. The handler never blocks: it keeps polling its
+ * futures, counting the slices of other work it gets done meanwhile, while
+ * completion callbacks tally the final statuses.
+ */
+
+#include "compile_service.h"
+
+#include <llvm-c/Core.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define JOB_COUNT 48
+#define HELPER_COUNT 64
+#define WORKER_COUNT 2
+
+typedef struct {
+    int k;
+    char name[32];
+} SumSpec;
+
+static pthread_mutex_t tally_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned tally[COMPILE_EXPIRED + 1];
+
+static LLVMModuleRef build_sum(LLVMContextRef ctx, void *arg) {
+    SumSpec *spec = arg;
+    LLVMModuleRef mod = LLVMModuleCreateWithNameInContext(spec->name, ctx);
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(ctx);
+    LLVMTypeRef param_types[] = { i32, i32 };
+    LLVMTypeRef fun_type = LLVMFunctionType(i32, param_types, 2, 0);
+    LLVMBuilderRef builder = LLVMCreateBuilderInContext(ctx);
+
+    // helper_h(a, b) = helper_{h-1}(a, b) + 1 on top of a + b, internal
+    LLVMValueRef previous = NULL;
+    for (int h = 0; h < HELPER_COUNT; h++) {
+        LLVMValueRef helper = LLVMAddFunction(mod, "helper", fun_type);
+        LLVMSetLinkage(helper, LLVMInternalLinkage);
+        LLVMPositionBuilderAtEnd(builder, LLVMAppendBasicBlockInContext(ctx, helper, "entry"));
+        LLVMValueRef args[] = { LLVMGetParam(helper, 0), LLVMGetParam(helper, 1) };
+        LLVMValueRef base = previous ? LLVMBuildCall2(builder, fun_type, previous, args, 2, "base")
+                                     : LLVMBuildSub(builder, LLVMBuildAdd(builder, args[0], args[1], "tmp"),
+                                                    LLVMConstInt(i32, HELPER_COUNT, 0), "base");
+        LLVMBuildRet(builder, LLVMBuildAdd(builder, base, LLVMConstInt(i32, 1, 0), "tmp"));
+        previous = helper;
+    }
+
+    LLVMValueRef sum = LLVMAddFunction(mod, spec->name, fun_type);
+    LLVMPositionBuilderAtEnd(builder, LLVMAppendBasicBlockInContext(ctx, sum, "entry"));
+    LLVMValueRef args[] = { LLVMGetParam(sum, 0), LLVMGetParam(sum, 1) };
+    LLVMValueRef tmp = LLVMBuildCall2(builder, fun_type, previous, args, 2, "tmp");
+    LLVMBuildRet(builder, LLVMBuildAdd(builder, tmp, LLVMConstInt(i32, spec->k, 0), "tmp"));
+    LLVMDisposeBuilder(builder);
+    return mod;
+}
+
+// A block without terminator, rejected by the verifier
+static LLVMModuleRef build_broken(LLVMContextRef ctx, void *arg) {
+    LLVMModuleRef mod = LLVMModuleCreateWithNameInContext("broken", ctx);
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(ctx);
+    LLVMValueRef fun = LLVMAddFunction(mod, "broken", LLVMFunctionType(i32, NULL, 0, 0));
+    LLVMAppendBasicBlockInContext(ctx, fun, "entry");
+    return mod;
+}
+
+static void on_done(CompileJob *job, void *arg) {
+    pthread_mutex_lock(&tally_lock);
+    tally[compile_status(job)]++;
+    pthread_mutex_unlock(&tally_lock);
+}
+
+// A slice of the other work of the handler
+static void handle_other_request(void) {
+    struct timespec slice = { 0, 100000 };
+    nanosleep(&slice, NULL);
+}
+
+int main(int argc, char const *argv[]) {
+    // The service initializes the native target, the objects are for x86_64
+    LLVMInitializeX86TargetInfo();
+    LLVMInitializeX86Target();
+    LLVMInitializeX86TargetMC();
+    LLVMInitializeX86AsmPrinter();
+
+    CompileService *service = compile_service_create(WORKER_COUNT);
+    static SumSpec specs[JOB_COUNT];
+    CompileJob *jobs[JOB_COUNT];
+
+    double start = compile_now();
+    for (int i = 0; i < JOB_COUNT; i++) {
+        specs[i].k = i;
+        snprintf(specs[i].name, sizeof(specs[i].name), "sum_%d", i);
+        CompileTarget target = { 0 };
+        target.output = i % 2 ? COMPILE_OBJECT : COMPILE_JIT;
+        target.triple = "x86_64";
+        target.level = LLVMCodeGenLevelDefault;
+        target.symbol = specs[i].name;
+
+        // The last jobs only matter for the next 5 ms
+        double deadline = i >= JOB_COUNT - 8 ? start + 0.005 : 0;
+        CompileBuildFn build = i == JOB_COUNT / 2 ? build_broken : build_sum;
+        jobs[i] = compile_submit(service, build, &specs[i], &target, deadline, on_done, NULL);
+    }
+
+    // The client of requests 8 to 11 went away
+    unsigned cancelled = 0;
+    for (int i = 8; i < 12; i++) {
+        cancelled += compile_cancel(jobs[i]);
+    }
+    double submit_ms = (compile_now() - start) * 1e3;
+
+    // Polling the futures between other requests, never waiting on codegen
+    unsigned slices = 0;
+    int pending = JOB_COUNT;
+    while (pending) {
+        handle_other_request();
+        slices++;
+        pending = 0;
+        for (int i = 0; i < JOB_COUNT; i++) {
+            CompileStatus status = compile_status(jobs[i]);
+            pending += status == COMPILE_QUEUED || status == COMPILE_RUNNING;
+        }
+    }
+    double total_ms = (compile_now() - start) * 1e3;
+
+    // Results
+    int wrong = 0;
+    size_t object_bytes = 0;
+    for (int i = 0; i < JOB_COUNT; i++) {
+        CompileStatus status = compile_wait(jobs[i]);
+        if (status == COMPILE_FAILED) {
+            printf("job %d failed: %.60s\n", i, compile_error(jobs[i]));
+        }
+        if (status != COMPILE_DONE) {
+            continue;
+        }
+        if (i % 2) {
+            object_bytes += LLVMGetBufferSize(compile_object(jobs[i]));
+        } else {
+            int32_t (*sum)(int32_t, int32_t) = (int32_t (*)(int32_t, int32_t)) (uintptr_t) compile_symbol(jobs[i]);
+            wrong += sum(2, 3) != 5 + i;
+        }
+    }
+
+    printf("%d jobs submitted in %.3f ms, %u cancelled while queued\n", JOB_COUNT, submit_ms, cancelled);
+    // Every job was waited for, so every callback has returned
+    pthread_mutex_lock(&tally_lock);
+    for (int s = COMPILE_DONE; s <= COMPILE_EXPIRED; s++) {
+        printf("  %-9s %u\n", compile_status_name(s), tally[s]);
+    }
+    pthread_mutex_unlock(&tally_lock);
+    printf("all finished after %.2f ms, %u slices of other work meanwhile\n", total_ms, slices);
+    printf("object bytes: %zu, wrong jitted results: %d\n", object_bytes, wrong);
+
+    for (int i = 0; i < JOB_COUNT; i++) {
+        compile_release(jobs[i]);
+    }
+    compile_service_dispose(service);
+    return wrong != 0;
+}
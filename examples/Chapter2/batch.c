@@ -0,0 +1,360 @@
+/**
+ * Automatic batching of small compile requests into shared modules.
+ *
+ * Compiling a function as small as sum is dominated by what every module
+ * pays: pass pipeline and MC streamer setup, object file headers and
+ * sections, JIT linking. The batcher collects the requests arriving within
+ * window_us microseconds of the first one, up to max_functions of them,
+ * defines them in one module under unique names (b<batch>_<index>), emits
+ * it once and links it into the JIT, then hands every caller the address
+ * of its own function.
+ *
+ * The benchmark has PRODUCER_COUNT threads submitting REQUEST_COUNT
+ * requests for
+ *
+ * int sum_k(int a, int b) {
+ *     return a + b + k;
+ * }
+ *
+ * and reports the throughput for several batch sizes, one being the
+ * unbatched baseline.
+ */
+
+#include "measure.h"
+
+#include <llvm-c/Core.h>
+#include <llvm-c/Analysis.h>
+#include <llvm-c/LLJIT.h>
+#include <llvm-c/Orc.h>
+#include <llvm-c/Target.h>
+#include <llvm-c/TargetMachine.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define REQUEST_COUNT 4096
+#define PRODUCER_COUNT 8
+#define WINDOW_US 500
+
+static void check(LLVMErrorRef err, const char *what) {
+    if (err) {
+        char *msg = LLVMGetErrorMessage(err);
+        fprintf(stderr, "%s: %s\n", what, msg);
+        LLVMDisposeErrorMessage(msg);
+        exit(1);
+    }
+}
+
+// ======================================================
+// Batcher
+// ======================================================
+
+// Adds the function of a request to mod under name, with its body
+typedef LLVMValueRef (*BatchDefineFn)(LLVMModuleRef mod, const char *name, void *arg);
+
+typedef struct BatchRequest {
+    struct BatchRequest *next;
+    BatchDefineFn define;
+    void *arg;
+    double submitted;
+    double finished;
+    uint64_t address;           // 0 until the batch is linked
+} BatchRequest;
+
+typedef struct {
+    unsigned max_functions;
+    double window;
+
+    pthread_mutex_t lock;
+    pthread_cond_t arrived;
+    pthread_cond_t linked;
+    BatchRequest *head;
+    BatchRequest *tail;
+    unsigned pending;
+    double first;               // submission time of the oldest pending request
+    int stopping;
+    pthread_t thread;
+
+    // Owned by the batcher thread
+    LLVMOrcLLJITRef jit;
+    LLVMTargetMachineRef tm;
+    unsigned batches;
+    uint64_t object_bytes;
+} Batcher;
+
+static LLVMTargetMachineRef host_target_machine(void) {
+    char *triple = LLVMGetDefaultTargetTriple();
+    char *cpu = LLVMGetHostCPUName();
+    char *features = LLVMGetHostCPUFeatures();
+    char *error = NULL;
+    LLVMTargetRef targetRef;
+    if (LLVMGetTargetFromTriple(triple, &targetRef, &error) != 0) {
+        fprintf(stderr, "%s\n", error);
+        exit(1);
+    }
+    LLVMTargetMachineRef tm = LLVMCreateTargetMachine(targetRef, triple, cpu, features, LLVMCodeGenLevelDefault,
+                                                      LLVMRelocPIC, LLVMCodeModelDefault);
+    LLVMDisposeMessage(triple);
+    LLVMDisposeMessage(cpu);
+    LLVMDisposeMessage(features);
+    return tm;
+}
+
+// One module, one emission, one object linked for the whole batch
+static void compile_batch(Batcher *batcher, BatchRequest *batch, unsigned count) {
+    unsigned id = batcher->batches++;
+    LLVMOrcThreadSafeContextRef ts_ctx = LLVMOrcCreateNewThreadSafeContext();
+    LLVMContextRef ctx = LLVMOrcThreadSafeContextGetContext(ts_ctx);
+    char name[48];
+    snprintf(name, sizeof(name), "batch_%u", id);
+    LLVMModuleRef mod = LLVMModuleCreateWithNameInContext(name, ctx);
+    char *triple = LLVMGetTargetMachineTriple(batcher->tm);
+    LLVMSetTarget(mod, triple);
+    LLVMDisposeMessage(triple);
+    LLVMTargetDataRef data_layout = LLVMCreateTargetDataLayout(batcher->tm);
+    LLVMSetModuleDataLayout(mod, data_layout);
+    LLVMDisposeTargetData(data_layout);
+
+    unsigned index = 0;
+    for (BatchRequest *request = batch; request; request = request->next) {
+        snprintf(name, sizeof(name), "b%u_%u", id, index++);
+        request->define(mod, name, request->arg);
+    }
+
+    //Analysis
+    char *error = NULL;
+    if (LLVMVerifyModule(mod, LLVMReturnStatusAction, &error)) {
+        fprintf(stderr, "%s\n", error);
+        exit(1);
+    }
+    LLVMDisposeMessage(error);
+
+    LLVMMemoryBufferRef object;
+    if (LLVMTargetMachineEmitToMemoryBuffer(batcher->tm, mod, LLVMObjectFile, &error, &object) != 0) {
+        fprintf(stderr, "%s\n", error);
+        exit(1);
+    }
+    batcher->object_bytes += LLVMGetBufferSize(object);
+    LLVMDisposeModule(mod);
+    LLVMOrcDisposeThreadSafeContext(ts_ctx);
+    check(LLVMOrcLLJITAddObjectFile(batcher->jit, LLVMOrcLLJITGetMainJITDylib(batcher->jit), object), "batch object");
+
+    // The first lookup links the object, the others find it linked
+    index = 0;
+    uint64_t *addresses = malloc(count * sizeof(uint64_t));
+    for (BatchRequest *request = batch; request; request = request->next) {
+        snprintf(name, sizeof(name), "b%u_%u", id, index);
+        LLVMOrcJITTargetAddress address;
+        check(LLVMOrcLLJITLookup(batcher->jit, &address, name), name);
+        addresses[index++] = address;
+    }
+
+    pthread_mutex_lock(&batcher->lock);
+    double finished = now();
+    index = 0;
+    for (BatchRequest *request = batch; request; request = request->next) {
+        request->finished = finished;
+        request->address = addresses[index++];
+    }
+    pthread_cond_broadcast(&batcher->linked);
+    pthread_mutex_unlock(&batcher->lock);
+    free(addresses);
+}
+
+static void *batcher_run(void *arg) {
+    Batcher *batcher = arg;
+    pthread_mutex_lock(&batcher->lock);
+    for (;;) {
+        while (!batcher->pending && !batcher->stopping) {
+            pthread_cond_wait(&batcher->arrived, &batcher->lock);
+        }
+        if (!batcher->pending) {
+            break;
+        }
+
+        // Waiting for the batch to fill, at most window after its first request
+        double close = batcher->first + batcher->window;
+        while (batcher->pending < batcher->max_functions && !batcher->stopping && now() < close) {
+            struct timespec deadline;
+            deadline.tv_sec = (time_t) close;
+            deadline.tv_nsec = (long) ((close - deadline.tv_sec) * 1e9);
+            pthread_cond_timedwait(&batcher->arrived, &batcher->lock, &deadline);
+        }
+
+        // The oldest max_functions requests go, the rest start the next batch
+        BatchRequest *batch = batcher->head;
+        BatchRequest *last = batch;
+        unsigned count = 1;
+        while (count < batcher->max_functions && last->next) {
+            last = last->next;
+            count++;
+        }
+        batcher->head = last->next;
+        if (!batcher->head) {
+            batcher->tail = NULL;
+        } else {
+            batcher->first = batcher->head->submitted;
+        }
+        last->next = NULL;
+        batcher->pending -= count;
+        pthread_mutex_unlock(&batcher->lock);
+
+        compile_batch(batcher, batch, count);
+        pthread_mutex_lock(&batcher->lock);
+    }
+    pthread_mutex_unlock(&batcher->lock);
+    return NULL;
+}
+
+static void batcher_init(Batcher *batcher, unsigned max_functions, unsigned window_us) {
+    memset(batcher, 0, sizeof(*batcher));
+    batcher->max_functions = max_functions;
+    batcher->window = window_us * 1e-6;
+    pthread_mutex_init(&batcher->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&batcher->arrived, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&batcher->linked, NULL);
+    check(LLVMOrcCreateLLJIT(&batcher->jit, NULL), "jit creation");
+    batcher->tm = host_target_machine();
+    pthread_create(&batcher->thread, NULL, batcher_run, batcher);
+}
+
+// Compiles the pending requests, then stops the batcher thread
+static void batcher_dispose(Batcher *batcher) {
+    pthread_mutex_lock(&batcher->lock);
+    batcher->stopping = 1;
+    pthread_cond_signal(&batcher->arrived);
+    pthread_mutex_unlock(&batcher->lock);
+    pthread_join(batcher->thread, NULL);
+    LLVMDisposeTargetMachine(batcher->tm);
+    LLVMOrcDisposeLLJIT(batcher->jit);
+    pthread_cond_destroy(&batcher->linked);
+    pthread_cond_destroy(&batcher->arrived);
+    pthread_mutex_destroy(&batcher->lock);
+}
+
+// request must stay valid until batch_wait() returned
+static void batch_submit(Batcher *batcher, BatchRequest *request, BatchDefineFn define, void *arg) {
+    request->next = NULL;
+    request->define = define;
+    request->arg = arg;
+    request->address = 0;
+    pthread_mutex_lock(&batcher->lock);
+    request->submitted = now();
+    if (batcher->tail) {
+        batcher->tail->next = request;
+    } else {
+        batcher->head = request;
+        batcher->first = request->submitted;
+    }
+    batcher->tail = request;
+    batcher->pending++;
+    if (batcher->pending == 1 || batcher->pending >= batcher->max_functions) {
+        pthread_cond_signal(&batcher->arrived);
+    }
+    pthread_mutex_unlock(&batcher->lock);
+}
+
+static uint64_t batch_wait(Batcher *batcher, BatchRequest *request) {
+    pthread_mutex_lock(&batcher->lock);
+    while (!request->address) {
+        pthread_cond_wait(&batcher->linked, &batcher->lock);
+    }
+    pthread_mutex_unlock(&batcher->lock);
+    return request->address;
+}
+
+// ======================================================
+// Benchmark
+// ======================================================
+
+static LLVMValueRef define_sum(LLVMModuleRef mod, const char *name, void *arg) {
+    int k = (int) (intptr_t) arg;
+    LLVMContextRef ctx = LLVMGetModuleContext(mod);
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(ctx);
+    LLVMTypeRef param_types[] = { i32, i32 };
+    LLVMValueRef sum = LLVMAddFunction(mod, name, LLVMFunctionType(i32, param_types, 2, 0));
+    LLVMBuilderRef builder = LLVMCreateBuilderInContext(ctx);
+    LLVMPositionBuilderAtEnd(builder, LLVMAppendBasicBlockInContext(ctx, sum, "entry"));
+    LLVMValueRef tmp = LLVMBuildAdd(builder, LLVMGetParam(sum, 0), LLVMGetParam(sum, 1), "tmp");
+    LLVMBuildRet(builder, LLVMBuildAdd(builder, tmp, LLVMConstInt(i32, k, 0), "tmp"));
+    LLVMDisposeBuilder(builder);
+    return sum;
+}
+
+typedef struct {
+    Batcher *batcher;
+    unsigned first;
+    BatchRequest requests[REQUEST_COUNT / PRODUCER_COUNT];
+    unsigned wrong;
+} Producer;
+
+// Submits its share of the requests, then collects the functions
+static void *produce(void *arg) {
+    Producer *producer = arg;
+    unsigned count = REQUEST_COUNT / PRODUCER_COUNT;
+    for (unsigned i = 0; i < count; i++) {
+        int k = (int) (producer->first + i);
+        batch_submit(producer->batcher, &producer->requests[i], define_sum, (void *) (intptr_t) k);
+    }
+    for (unsigned i = 0; i < count; i++) {
+        int32_t (*sum)(int32_t, int32_t) = (int32_t (*)(int32_t, int32_t)) (uintptr_t) batch_wait(producer->batcher, &producer->requests[i]);
+        producer->wrong += sum(2, 3) != 5 + (int32_t) (producer->first + i);
+    }
+    return NULL;
+}
+
+static void measure(unsigned max_functions, double *baseline) {
+    static Producer producers[PRODUCER_COUNT];
+    Batcher batcher;
+    batcher_init(&batcher, max_functions, WINDOW_US);
+
+    pthread_t threads[PRODUCER_COUNT];
+    double start = now();
+    for (unsigned p = 0; p < PRODUCER_COUNT; p++) {
+        producers[p].batcher = &batcher;
+        producers[p].first = p * (REQUEST_COUNT / PRODUCER_COUNT);
+        producers[p].wrong = 0;
+        pthread_create(&threads[p], NULL, produce, &producers[p]);
+    }
+    unsigned wrong = 0;
+    for (unsigned p = 0; p < PRODUCER_COUNT; p++) {
+        pthread_join(threads[p], NULL);
+        wrong += producers[p].wrong;
+    }
+    double elapsed = now() - start;
+
+    double latency = 0;
+    for (unsigned p = 0; p < PRODUCER_COUNT; p++) {
+        for (unsigned i = 0; i < REQUEST_COUNT / PRODUCER_COUNT; i++) {
+            latency += producers[p].requests[i].finished - producers[p].requests[i].submitted;
+        }
+    }
+    double throughput = REQUEST_COUNT / elapsed;
+    if (!*baseline) {
+        *baseline = throughput;
+    }
+    printf("batch %4u: %9.0f functions/s (%5.1fx), %5u modules, %6.1f object bytes per function, "
+           "mean latency %8.3f ms%s\n", max_functions, throughput, throughput / *baseline, batcher.batches,
+           (double) batcher.object_bytes / REQUEST_COUNT, latency * 1e3 / REQUEST_COUNT, wrong ? ", WRONG RESULTS" : "");
+    batcher_dispose(&batcher);
+}
+
+int main(int argc, char const *argv[]) {
+    LLVMInitializeNativeTarget();
+    LLVMInitializeNativeAsmPrinter();
+
+    printf("%d requests from %d threads, window %d us\n", REQUEST_COUNT, PRODUCER_COUNT, WINDOW_US);
+    static const unsigned sizes[] = { 1, 4, 16, 64, 256, 1024 };
+    double baseline = 0;
+    for (unsigned i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        measure(sizes[i], &baseline);
+    }
+}
@@ -0,0 +1,424 @@
+#include "compile_service.h"
+
+#include <llvm-c/Analysis.h>
+#include <llvm-c/LLJIT.h>
+#include <llvm-c/Orc.h>
+#include <llvm-c/Target.h>
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct CompileJob {
+    CompileService *service;
+    CompileJob *next;                  // queue link, while COMPILE_QUEUED
+    CompileBuildFn build;
+    void *build_arg;
+    CompileOutput output;
+    char *triple;
+    char *cpu;
+    char *features;
+    char *symbol;
+    LLVMCodeGenOptLevel level;
+    double deadline;
+    CompileDoneFn done;
+    void *done_arg;
+
+    // Guarded by the service lock
+    CompileStatus status;
+    int refs;                          // the caller's and the service's
+    int finished;                      // final status set and callback run
+    pthread_cond_t finished_cond;
+
+    // Results, written before the job is finished
+    LLVMMemoryBufferRef object;
+    uint64_t address;
+    char *error;
+};
+
+struct CompileService {
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    CompileJob *head;
+    CompileJob *tail;
+    int stopping;
+    unsigned live;                     // jobs not released by their caller yet
+    unsigned worker_count;
+    pthread_t *workers;
+
+    // Created by the first COMPILE_JIT job
+    pthread_mutex_t jit_lock;
+    LLVMOrcLLJITRef jit;
+};
+
+double compile_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+const char *compile_status_name(CompileStatus status) {
+    static const char *names[] = { "queued", "running", "done", "failed", "cancelled", "expired" };
+    return names[status];
+}
+
+static char *copy(const char *s) {
+    return s ? strdup(s) : NULL;
+}
+
+// ======================================================
+// Jobs
+// ======================================================
+
+static void release_locked(CompileJob *job) {
+    if (--job->refs > 0) {
+        return;
+    }
+    if (job->object) {
+        LLVMDisposeMemoryBuffer(job->object);
+    }
+    pthread_cond_destroy(&job->finished_cond);
+    free(job->triple);
+    free(job->cpu);
+    free(job->features);
+    free(job->symbol);
+    free(job->error);
+    free(job);
+}
+
+// Sets the final status, runs the callback, then wakes the waiters and
+// drops the reference of the service. Called without the lock.
+static void complete(CompileJob *job, CompileStatus status) {
+    CompileService *service = job->service;
+    pthread_mutex_lock(&service->lock);
+    job->status = status;
+    pthread_mutex_unlock(&service->lock);
+
+    if (job->done) {
+        job->done(job, job->done_arg);
+    }
+
+    pthread_mutex_lock(&service->lock);
+    job->finished = 1;
+    pthread_cond_broadcast(&job->finished_cond);
+    release_locked(job);
+    pthread_mutex_unlock(&service->lock);
+}
+
+static int fail(CompileJob *job, const char *what, const char *message) {
+    size_t length = strlen(what) + (message ? strlen(message) : 0) + 3;
+    job->error = malloc(length);
+    snprintf(job->error, length, "%s: %s", what, message ? message : "");
+    return 0;
+}
+
+static int expired(CompileJob *job) {
+    return job->deadline > 0 && compile_now() > job->deadline;
+}
+
+static LLVMOrcLLJITRef service_jit(CompileService *service, char **error) {
+    pthread_mutex_lock(&service->jit_lock);
+    if (!service->jit) {
+        LLVMErrorRef err = LLVMOrcCreateLLJIT(&service->jit, NULL);
+        if (err) {
+            *error = LLVMGetErrorMessage(err);
+            service->jit = NULL;
+        }
+    }
+    LLVMOrcLLJITRef jit = service->jit;
+    pthread_mutex_unlock(&service->jit_lock);
+    return jit;
+}
+
+// The JIT takes the object and links it when the symbol is looked up
+static int link_job(CompileJob *job, LLVMMemoryBufferRef object) {
+    char *error = NULL;
+    LLVMOrcLLJITRef jit = service_jit(job->service, &error);
+    if (!jit) {
+        fail(job, "jit", error);
+        LLVMDisposeErrorMessage(error);
+        LLVMDisposeMemoryBuffer(object);
+        return 0;
+    }
+    LLVMErrorRef err = LLVMOrcLLJITAddObjectFile(jit, LLVMOrcLLJITGetMainJITDylib(jit), object);
+    if (!err) {
+        LLVMOrcJITTargetAddress address;
+        err = LLVMOrcLLJITLookup(jit, &address, job->symbol);
+        job->address = address;
+    }
+    if (err) {
+        error = LLVMGetErrorMessage(err);
+        fail(job, "jit", error);
+        LLVMDisposeErrorMessage(error);
+        return 0;
+    }
+    return 1;
+}
+
+static int emit_job(CompileJob *job, LLVMModuleRef mod) {
+    // Target machine of the job, target machines are not shared across threads
+    char *triple = job->triple && job->output == COMPILE_OBJECT ? LLVMCreateMessage(job->triple) : LLVMGetDefaultTargetTriple();
+    char *cpu = job->cpu ? LLVMCreateMessage(job->cpu) : LLVMGetHostCPUName();
+    char *features = job->features ? LLVMCreateMessage(job->features) : LLVMGetHostCPUFeatures();
+    char *error = NULL;
+    LLVMTargetRef targetRef;
+    LLVMTargetMachineRef targetMachineRef = NULL;
+    if (LLVMGetTargetFromTriple(triple, &targetRef, &error) != 0) {
+        fail(job, "target", error);
+        LLVMDisposeMessage(error);
+    } else {
+        targetMachineRef = LLVMCreateTargetMachine(targetRef, triple, cpu, features, job->level, LLVMRelocPIC, LLVMCodeModelDefault);
+        LLVMSetTarget(mod, triple);
+    }
+    LLVMDisposeMessage(triple);
+    LLVMDisposeMessage(cpu);
+    LLVMDisposeMessage(features);
+    if (!targetMachineRef) {
+        return 0;
+    }
+
+    LLVMTargetDataRef data_layout = LLVMCreateTargetDataLayout(targetMachineRef);
+    LLVMSetModuleDataLayout(mod, data_layout);
+    LLVMDisposeTargetData(data_layout);
+
+    LLVMMemoryBufferRef object = NULL;
+    int failed = LLVMTargetMachineEmitToMemoryBuffer(targetMachineRef, mod, LLVMObjectFile, &error, &object);
+    LLVMDisposeTargetMachine(targetMachineRef);
+    if (failed) {
+        fail(job, "emit", error);
+        LLVMDisposeMessage(error);
+        return 0;
+    }
+
+    if (job->output == COMPILE_OBJECT) {
+        job->object = object;
+        return 1;
+    }
+    return link_job(job, object);
+}
+
+/**
+ * Builds, verifies and emits the module of the job. Returns 1 on success,
+ * 0 with job->error set on failure, -1 when the deadline passed while the
+ * module was built.
+ */
+static int run_job(CompileJob *job) {
+    LLVMContextRef ctx = LLVMContextCreate();
+    LLVMModuleRef mod = job->build(ctx, job->build_arg);
+    if (!mod) {
+        LLVMContextDispose(ctx);
+        return fail(job, "build", "no module");
+    }
+
+    //Analysis
+    char *error = NULL;
+    int ok;
+    if (LLVMVerifyModule(mod, LLVMReturnStatusAction, &error)) {
+        ok = fail(job, "verify", error);
+    } else if (expired(job)) {
+        // No code generation for a result nobody waits for anymore
+        ok = -1;
+    } else {
+        ok = emit_job(job, mod);
+    }
+    LLVMDisposeMessage(error);
+
+    LLVMDisposeModule(mod);
+    LLVMContextDispose(ctx);
+    return ok;
+}
+
+// ======================================================
+// Workers
+// ======================================================
+
+static void *worker(void *arg) {
+    CompileService *service = arg;
+    pthread_mutex_lock(&service->lock);
+    for (;;) {
+        while (!service->head && !service->stopping) {
+            pthread_cond_wait(&service->wakeup, &service->lock);
+        }
+        CompileJob *job = service->head;
+        if (!job) {
+            break;
+        }
+        service->head = job->next;
+        if (!service->head) {
+            service->tail = NULL;
+        }
+        job->next = NULL;
+
+        // Dropped without building: the caller gave up on it
+        if (expired(job)) {
+            pthread_mutex_unlock(&service->lock);
+            complete(job, COMPILE_EXPIRED);
+            pthread_mutex_lock(&service->lock);
+            continue;
+        }
+        job->status = COMPILE_RUNNING;
+        pthread_mutex_unlock(&service->lock);
+
+        int ok = run_job(job);
+        complete(job, ok > 0 ? COMPILE_DONE : ok < 0 ? COMPILE_EXPIRED : COMPILE_FAILED);
+        pthread_mutex_lock(&service->lock);
+    }
+    pthread_mutex_unlock(&service->lock);
+    return NULL;
+}
+
+CompileService *compile_service_create(unsigned workers) {
+    LLVMInitializeNativeTarget();
+    LLVMInitializeNativeAsmPrinter();
+
+    CompileService *service = calloc(1, sizeof(CompileService));
+    pthread_mutex_init(&service->lock, NULL);
+    pthread_cond_init(&service->wakeup, NULL);
+    pthread_mutex_init(&service->jit_lock, NULL);
+    service->worker_count = workers ? workers : 1;
+    service->workers = calloc(service->worker_count, sizeof(pthread_t));
+    for (unsigned i = 0; i < service->worker_count; i++) {
+        pthread_create(&service->workers[i], NULL, worker, service);
+    }
+    return service;
+}
+
+void compile_service_dispose(CompileService *service) {
+    pthread_mutex_lock(&service->lock);
+    // The jobs point to the service, their lock is the one of the service
+    assert(service->live == 0 && "jobs must be released before the service is disposed");
+    CompileJob *queued = service->head;
+    service->head = service->tail = NULL;
+    service->stopping = 1;
+    pthread_cond_broadcast(&service->wakeup);
+    pthread_mutex_unlock(&service->lock);
+
+    while (queued) {
+        CompileJob *next = queued->next;
+        queued->next = NULL;
+        complete(queued, COMPILE_CANCELLED);
+        queued = next;
+    }
+    for (unsigned i = 0; i < service->worker_count; i++) {
+        pthread_join(service->workers[i], NULL);
+    }
+
+    if (service->jit) {
+        LLVMOrcDisposeLLJIT(service->jit);
+    }
+    pthread_mutex_destroy(&service->jit_lock);
+    pthread_cond_destroy(&service->wakeup);
+    pthread_mutex_destroy(&service->lock);
+    free(service->workers);
+    free(service);
+}
+
+// ======================================================
+// Futures
+// ======================================================
+
+CompileJob *compile_submit(CompileService *service, CompileBuildFn build, void *build_arg,
+                           const CompileTarget *target, double deadline,
+                           CompileDoneFn done, void *done_arg) {
+    CompileJob *job = calloc(1, sizeof(CompileJob));
+    job->service = service;
+    job->build = build;
+    job->build_arg = build_arg;
+    job->output = target->output;
+    job->triple = copy(target->triple);
+    job->cpu = copy(target->cpu);
+    job->features = copy(target->features);
+    job->symbol = copy(target->symbol);
+    job->level = target->level;
+    job->deadline = deadline;
+    job->done = done;
+    job->done_arg = done_arg;
+    job->status = COMPILE_QUEUED;
+    job->refs = 2;
+    pthread_cond_init(&job->finished_cond, NULL);
+
+    pthread_mutex_lock(&service->lock);
+    service->live++;
+    if (service->tail) {
+        service->tail->next = job;
+    } else {
+        service->head = job;
+    }
+    service->tail = job;
+    pthread_cond_signal(&service->wakeup);
+    pthread_mutex_unlock(&service->lock);
+    return job;
+}
+
+int compile_cancel(CompileJob *job) {
+    CompileService *service = job->service;
+    pthread_mutex_lock(&service->lock);
+    if (job->status != COMPILE_QUEUED) {
+        pthread_mutex_unlock(&service->lock);
+        return 0;
+    }
+    CompileJob *previous = NULL;
+    CompileJob *current = service->head;
+    while (current && current != job) {
+        previous = current;
+        current = current->next;
+    }
+    if (!current) {
+        // Taken by a worker that has not marked it running yet
+        pthread_mutex_unlock(&service->lock);
+        return 0;
+    }
+    if (previous) {
+        previous->next = job->next;
+    } else {
+        service->head = job->next;
+    }
+    if (service->tail == job) {
+        service->tail = previous;
+    }
+    job->next = NULL;
+    pthread_mutex_unlock(&service->lock);
+
+    complete(job, COMPILE_CANCELLED);
+    return 1;
+}
+
+CompileStatus compile_status(CompileJob *job) {
+    pthread_mutex_lock(&job->service->lock);
+    CompileStatus status = job->status;
+    pthread_mutex_unlock(&job->service->lock);
+    return status;
+}
+
+CompileStatus compile_wait(CompileJob *job) {
+    pthread_mutex_lock(&job->service->lock);
+    while (!job->finished) {
+        pthread_cond_wait(&job->finished_cond, &job->service->lock);
+    }
+    CompileStatus status = job->status;
+    pthread_mutex_unlock(&job->service->lock);
+    return status;
+}
+
+LLVMMemoryBufferRef compile_object(CompileJob *job) {
+    return job->object;
+}
+
+uint64_t compile_symbol(CompileJob *job) {
+    return job->address;
+}
+
+const char *compile_error(CompileJob *job) {
+    return job->error;
+}
+
+void compile_release(CompileJob *job) {
+    CompileService *service = job->service;
+    pthread_mutex_lock(&service->lock);
+    service->live--;
+    release_locked(job);
+    pthread_mutex_unlock(&service->lock);
+}
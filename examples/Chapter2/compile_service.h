@@ -0,0 +1,97 @@
+/**
+ * Asynchronous compilation of generated modules.
+ *
+ * A caller submits a closure that builds a module, the target options, an
+ * optional deadline and an optional completion callback, and gets back a
+ * CompileJob right away. The job is a future: compile_wait() blocks until it
+ * finishes, compile_status() polls it, and its result is either an object
+ * file in memory or the address of a symbol linked into the JIT of the
+ * service. Queued jobs can be cancelled, and jobs still queued when their
+ * deadline passes are dropped without being built.
+ *
+ * Every job builds its module in its own context, on one of the worker
+ * threads of the service, with its own target machine.
+ */
+
+#ifndef COMPILE_SERVICE_H
+#define COMPILE_SERVICE_H
+
+#include <llvm-c/Core.h>
+#include <llvm-c/TargetMachine.h>
+
+#include <stdint.h>
+
+typedef struct CompileService CompileService;
+typedef struct CompileJob CompileJob;
+
+typedef enum {
+    COMPILE_OBJECT,     // object file in memory
+    COMPILE_JIT,        // object linked into the JIT, symbol looked up
+} CompileOutput;
+
+typedef enum {
+    COMPILE_QUEUED,
+    COMPILE_RUNNING,
+    COMPILE_DONE,
+    COMPILE_FAILED,
+    COMPILE_CANCELLED,
+    COMPILE_EXPIRED,
+} CompileStatus;
+
+typedef struct {
+    CompileOutput output;
+    const char *triple;         // NULL for the host, always the host for COMPILE_JIT
+    const char *cpu;            // NULL for the host CPU
+    const char *features;       // NULL for the host features
+    LLVMCodeGenOptLevel level;
+    const char *symbol;         // COMPILE_JIT: the symbol to look up
+} CompileTarget;
+
+// Builds the module of a job in ctx, which belongs to the job
+typedef LLVMModuleRef (*CompileBuildFn)(LLVMContextRef ctx, void *arg);
+
+// Called once the job is finished, whatever its final status, on the
+// thread that finished it (a worker, or the one cancelling it).
+// compile_status() already returns the final status inside the callback,
+// and compile_wait() only returns after the callback has returned.
+typedef void (*CompileDoneFn)(CompileJob *job, void *arg);
+
+// Seconds on the monotonic clock, the time base of the deadlines
+double compile_now(void);
+
+CompileService *compile_service_create(unsigned workers);
+
+// Cancels the queued jobs, waits for the running ones and joins the workers.
+// Every job must have been released with compile_release() before: a job
+// cannot outlive its service. The symbols returned by COMPILE_JIT jobs are
+// invalid afterwards.
+void compile_service_dispose(CompileService *service);
+
+/**
+ * Queues a job and returns immediately. target is copied. deadline is a
+ * compile_now() time, 0 for none. done may be NULL. The job must be
+ * released with compile_release() by the caller.
+ */
+CompileJob *compile_submit(CompileService *service, CompileBuildFn build, void *build_arg,
+                           const CompileTarget *target, double deadline,
+                           CompileDoneFn done, void *done_arg);
+
+// Returns 1 when the job was still queued and is now cancelled, 0 when it
+// already started or finished.
+int compile_cancel(CompileJob *job);
+
+CompileStatus compile_status(CompileJob *job);
+CompileStatus compile_wait(CompileJob *job);
+
+// Results, valid once the job is COMPILE_DONE and until it is released
+LLVMMemoryBufferRef compile_object(CompileJob *job);
+uint64_t compile_symbol(CompileJob *job);
+
+// Reason of a COMPILE_FAILED job, NULL otherwise
+const char *compile_error(CompileJob *job);
+
+void compile_release(CompileJob *job);
+
+const char *compile_status_name(CompileStatus status);
+
+#endif
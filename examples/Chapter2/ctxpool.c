@@ -0,0 +1,309 @@
+/**
+ * A pool of LLVM contexts that retires a context after a number of modules
+ * or a number of bytes, to bound the memory of a long-lived compiler.
+ *
+ * The types and constants a module creates are interned in its context and
+ * stay there until the context is disposed, even once the module is gone.
+ * A process that builds every module in the same context, as both sum.c
+ * would if they ran in a loop, grows for as long as it runs.
+ *
+ * pool_acquire() hands out the current context and pool_release() is
+ * called once the module built in it is disposed. When the current context
+ * has served max_modules modules, or the heap has grown by max_bytes since
+ * it was created, it is retired: the next acquire creates a fresh one, and
+ * the retired context is disposed as soon as its last module is released.
+ * A module that must outlive its context, like the resident module below,
+ * is moved to the current context with pool_migrate(), through bitcode,
+ * from the on_retire callback: the pool calls it when a context is retired
+ * with modules still live, so a long-lived module never keeps a retired
+ * context, and the memory of everything built in it, alive.
+ *
+ * The heap growth is measured with mallinfo2() every HEAP_CHECK_EVERY
+ * modules released. It is exact for a single compiler thread and an
+ * approximation otherwise.
+ *
+ * The workload builds JOB_COUNT modules with a function of unique constants
+ * and a named struct type each, under three policies: one shared context,
+ * a fresh context per module and the pool. The heap in use and the resident
+ * memory are sampled along the way and reported before and after. With a
+ * context per module the resident module is migrated after every module,
+ * which is what that policy costs a compiler that keeps one; with the pool
+ * it is migrated once per retired context, and the heap stays within about
+ * max_bytes plus the growth of the last HEAP_CHECK_EVERY modules.
+ */
+
+#include "measure.h"
+
+#include <llvm-c/Core.h>
+#include <llvm-c/Analysis.h>
+#include <llvm-c/BitReader.h>
+#include <llvm-c/BitWriter.h>
+
+#include <limits.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define JOB_COUNT 20000
+#define CONSTANTS_PER_JOB 32
+#define SAMPLES 4
+#define HEAP_CHECK_EVERY 16
+
+// ======================================================
+// Memory
+// ======================================================
+
+static size_t heap_in_use(void) {
+    return mallinfo2().uordblks;
+}
+
+// ======================================================
+// Context pool
+// ======================================================
+
+typedef struct PooledContext {
+    LLVMContextRef ctx;
+    unsigned modules;           // served so far
+    unsigned live;              // acquired and not released yet
+    size_t heap_at_start;
+    int retired;
+    struct PooledContext *next; // in the list of retired contexts
+} PooledContext;
+
+typedef struct ContextPool {
+    unsigned max_modules;
+    size_t max_bytes;
+    // Called with a context retired while modules built in it are live
+    void (*on_retire)(struct ContextPool *pool, PooledContext *pc, void *data);
+    void *on_retire_data;
+    PooledContext *current;
+    PooledContext *retired;     // waiting for their modules to be released
+    unsigned created;
+    unsigned disposed;
+    unsigned migrated;
+} ContextPool;
+
+static void pool_init(ContextPool *pool, unsigned max_modules, size_t max_bytes,
+                      void (*on_retire)(ContextPool *pool, PooledContext *pc, void *data), void *on_retire_data) {
+    ContextPool empty = { max_modules, max_bytes, on_retire, on_retire_data };
+    *pool = empty;
+}
+
+static void context_dispose(ContextPool *pool, PooledContext *pc) {
+    size_t heap = heap_in_use();
+    LLVMContextDispose(pc->ctx);
+    free(pc);
+    pool->disposed++;
+
+    // What was freed was not part of the growth of the current context
+    size_t after = heap_in_use();
+    PooledContext *current = pool->current;
+    if (current && after < heap) {
+        size_t freed = heap - after;
+        current->heap_at_start = current->heap_at_start > freed ? current->heap_at_start - freed : 0;
+    }
+}
+
+// The context to build the next module in
+static PooledContext *pool_acquire(ContextPool *pool) {
+    if (!pool->current) {
+        PooledContext *pc = calloc(1, sizeof(PooledContext));
+        pc->heap_at_start = heap_in_use();
+        pc->ctx = LLVMContextCreate();
+        pool->current = pc;
+        pool->created++;
+    }
+    pool->current->modules++;
+    pool->current->live++;
+    return pool->current;
+}
+
+static void pool_retire(ContextPool *pool, PooledContext *pc) {
+    pc->retired = 1;
+    if (pool->current == pc) {
+        pool->current = NULL;
+    }
+    if (pc->live == 0) {
+        context_dispose(pool, pc);
+    } else {
+        pc->next = pool->retired;
+        pool->retired = pc;
+        // Last, the callback may release the modules and so dispose pc
+        if (pool->on_retire) {
+            pool->on_retire(pool, pc, pool->on_retire_data);
+        }
+    }
+}
+
+// Called once the module built in pc has been disposed
+static void pool_release(ContextPool *pool, PooledContext *pc) {
+    pc->live--;
+    if (pc->retired) {
+        if (pc->live == 0) {
+            PooledContext **link = &pool->retired;
+            while (*link != pc) {
+                link = &(*link)->next;
+            }
+            *link = pc->next;
+            context_dispose(pool, pc);
+        }
+        return;
+    }
+    if (pc->modules >= pool->max_modules) {
+        pool_retire(pool, pc);
+    } else if (pool->max_bytes != SIZE_MAX && pc->modules % HEAP_CHECK_EVERY == 0) {
+        // mallinfo2() walks the free lists, it is not free either
+        size_t heap = heap_in_use();
+        if (heap > pc->heap_at_start && heap - pc->heap_at_start >= pool->max_bytes) {
+            pool_retire(pool, pc);
+        }
+    }
+}
+
+/**
+ * Moves mod to the current context if its context *owner was retired, so
+ * that the retired context can be disposed. Returns the module to use from
+ * then on, mod itself when nothing had to be done.
+ */
+static LLVMModuleRef pool_migrate(ContextPool *pool, PooledContext **owner, LLVMModuleRef mod) {
+    if (!(*owner)->retired) {
+        return mod;
+    }
+    LLVMMemoryBufferRef bitcode = LLVMWriteBitcodeToMemoryBuffer(mod);
+    LLVMDisposeModule(mod);
+    pool_release(pool, *owner);
+
+    *owner = pool_acquire(pool);
+    LLVMModuleRef migrated;
+    if (LLVMParseBitcodeInContext2((*owner)->ctx, bitcode, &migrated) != 0) {
+        fprintf(stderr, "migration failed\n");
+        exit(1);
+    }
+    LLVMDisposeMemoryBuffer(bitcode);
+    pool->migrated++;
+    return migrated;
+}
+
+static void pool_dispose(ContextPool *pool) {
+    if (pool->current) {
+        pool_retire(pool, pool->current);
+    }
+    if (pool->retired) {
+        fprintf(stderr, "contexts disposed with live modules\n");
+        exit(1);
+    }
+}
+
+// ======================================================
+// Workload
+// ======================================================
+
+/**
+ * long job_k(long a, long b) adds a, b and constants unique to the job,
+ * and stores the result in a global of type %job_k.state: new constants
+ * and a new type for the context at every module.
+ */
+static LLVMModuleRef build_job(LLVMContextRef ctx, unsigned k) {
+    char name[32];
+    LLVMModuleRef mod = LLVMModuleCreateWithNameInContext("my_module", ctx);
+    LLVMBuilderRef builder = LLVMCreateBuilderInContext(ctx);
+    LLVMTypeRef i64 = LLVMInt64TypeInContext(ctx);
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(ctx);
+
+    snprintf(name, sizeof(name), "job_%u.state", k);
+    LLVMTypeRef state_type = LLVMStructCreateNamed(ctx, name);
+    LLVMTypeRef fields[] = { i64, i32 };
+    LLVMStructSetBody(state_type, fields, 2, 0);
+    LLVMValueRef state = LLVMAddGlobal(mod, state_type, "state");
+    LLVMSetInitializer(state, LLVMConstNull(state_type));
+
+    LLVMTypeRef param_types[] = { i64, i64 };
+    snprintf(name, sizeof(name), "job_%u", k);
+    LLVMValueRef fun = LLVMAddFunction(mod, name, LLVMFunctionType(i64, param_types, 2, 0));
+    LLVMPositionBuilderAtEnd(builder, LLVMAppendBasicBlockInContext(ctx, fun, "entry"));
+    LLVMValueRef v = LLVMBuildAdd(builder, LLVMGetParam(fun, 0), LLVMGetParam(fun, 1), "tmp");
+    for (unsigned c = 0; c < CONSTANTS_PER_JOB; c++) {
+        uint64_t constant = (uint64_t) k * CONSTANTS_PER_JOB + c + 1000003;
+        v = LLVMBuildAdd(builder, v, LLVMConstInt(i64, constant, 0), "tmp");
+    }
+    LLVMBuildStore(builder, v, LLVMBuildStructGEP2(builder, state_type, state, 0, "field"));
+    LLVMBuildRet(builder, v);
+    LLVMDisposeBuilder(builder);
+
+    if (LLVMVerifyFunction(fun, LLVMReturnStatusAction)) {
+        fprintf(stderr, "%s does not verify\n", name);
+        exit(1);
+    }
+    return mod;
+}
+
+typedef struct {
+    const char *name;
+    unsigned max_modules;
+    size_t max_bytes;
+} Policy;
+
+// A module kept for the whole run, e.g. the runtime support of the daemon
+typedef struct {
+    PooledContext *owner;
+    LLVMModuleRef mod;
+} Resident;
+
+static void migrate_resident(ContextPool *pool, PooledContext *pc, void *data) {
+    Resident *resident = data;
+    if (resident->owner == pc) {
+        resident->mod = pool_migrate(pool, &resident->owner, resident->mod);
+    }
+}
+
+static void run(const Policy *policy) {
+    ContextPool pool;
+    Resident resident;
+    pool_init(&pool, policy->max_modules, policy->max_bytes, migrate_resident, &resident);
+    size_t heap_before = heap_in_use();
+    long rss_before = resident_kb();
+    size_t heap_peak = 0;
+
+    resident.owner = pool_acquire(&pool);
+    resident.mod = build_job(resident.owner->ctx, UINT_MAX);
+
+    printf("%s:\n", policy->name);
+    double start = now();
+    for (unsigned k = 0; k < JOB_COUNT; k++) {
+        PooledContext *pc = pool_acquire(&pool);
+        LLVMModuleRef mod = build_job(pc->ctx, k);
+        LLVMDisposeModule(mod);
+        pool_release(&pool, pc);
+        if (k % HEAP_CHECK_EVERY == HEAP_CHECK_EVERY - 1) {
+            size_t heap = heap_in_use();
+            heap_peak = heap > heap_peak ? heap : heap_peak;
+        }
+        if ((k + 1) % (JOB_COUNT / SAMPLES) == 0) {
+            printf("  %6u modules: heap %+9.2f MB, resident %7ld kB, %u contexts created\n", k + 1,
+                   ((double) heap_in_use() - heap_before) / (1 << 20), resident_kb(), pool.created);
+        }
+    }
+    double elapsed = now() - start;
+
+    LLVMDisposeModule(resident.mod);
+    pool_release(&pool, resident.owner);
+    pool_dispose(&pool);
+    malloc_trim(0);
+    printf("  %.2f us per module, heap peak %+.2f MB, after disposal %+.2f MB, resident %ld -> %ld kB,"
+           " %u contexts, %u migrations\n",
+           elapsed * 1e6 / JOB_COUNT, ((double) heap_peak - heap_before) / (1 << 20),
+           ((double) heap_in_use() - heap_before) / (1 << 20), rss_before, resident_kb(), pool.created,
+           pool.migrated);
+}
+
+int main(int argc, char const *argv[]) {
+    Policy policies[] = {
+        { "one shared context", UINT_MAX, SIZE_MAX },
+        { "a context per module", 1, SIZE_MAX },
+        { "pool, retired after 5000 modules or 4 MB", 5000, 4 << 20 },
+    };
+    for (unsigned p = 0; p < sizeof(policies) / sizeof(policies[0]); p++) {
+        run(&policies[p]);
+    }
+}
@@ -0,0 +1,313 @@
+/**
+ * Low-latency code generation profiles for the Chapter 2 emission path.
+ *
+ * Each profile is a code generation level plus the backend options it
+ * forces: the instruction selector (SelectionDAG, FastISel or GlobalISel)
+ * and the register allocator. Backend options are process-wide in LLVM,
+ * so every profile is measured in a forked child that sets its options
+ * once. A child reports:
+ * - the latency of building and emitting sum from the previous chapters:
+ *   the first compile, in a fresh context and target machine, which is
+ *   the cost of a first call to freshly generated code, and the mean of
+ *   the SUM_COMPILES warm compiles that follow,
+ * - the compile time and .text size of a module of loop kernels,
+ * - the runtime of one of those kernels, loaded through LLJIT.
+ *
+ * Note that at LLVMCodeGenLevelNone most targets already pick FastISel
+ * and the fast register allocator unless told otherwise; the fast-isel
+ * profile makes that explicit and also disables the fallback to the
+ * SelectionDAG, global-isel switches to the GlobalISel pipeline.
+ *
+ * No profile disables the optional machine passes (-disable-machine-licm,
+ * -disable-machine-cse, -disable-machine-sink, -disable-block-placement):
+ * TargetPassConfig only adds them above LLVMCodeGenLevelNone. On x86-64
+ * with LLVM 14, -debug-pass=Structure lists 57 passes at None against 176
+ * at Default, and none of machinelicm, machine-cse, machine-sink,
+ * peephole-opt or block-placement is among the 57, so these options would
+ * change nothing in the fast profiles.
+ */
+
+#include "measure.h"
+
+#include <llvm-c/Core.h>
+#include <llvm-c/Analysis.h>
+#include <llvm-c/LLJIT.h>
+#include <llvm-c/Object.h>
+#include <llvm-c/Orc.h>
+#include <llvm-c/Support.h>
+#include <llvm-c/Target.h>
+#include <llvm-c/TargetMachine.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define KERNEL_COUNT 200
+#define SUM_COMPILES 200
+#define ARRAY_LENGTH 4096
+#define KERNEL_RUNS 2000
+
+typedef struct {
+    const char *name;
+    LLVMCodeGenOptLevel level;
+    const char *options[4];
+} Profile;
+
+static const Profile profiles[] = {
+    { "default",     LLVMCodeGenLevelDefault, { NULL } },
+    { "none",        LLVMCodeGenLevelNone,    { NULL } },
+    { "fast-isel",   LLVMCodeGenLevelNone,    { "-fast-isel", "-fast-isel-abort=1", "-regalloc=fast", NULL } },
+    { "global-isel", LLVMCodeGenLevelNone,    { "-global-isel", "-global-isel-abort=2", "-regalloc=fast", NULL } },
+};
+
+typedef struct {
+    double sum_first_us;        // build + emit of sum, first compile
+    double sum_mean_us;         // build + emit of sum, per warm compile
+    double kernels_compile_ms;  // emit of the kernel module
+    uint64_t text_bytes;        // .text of the kernel module
+    double kernel_run_us;       // one kernel_0 call over ARRAY_LENGTH elements
+    int32_t checksum;
+} Result;
+
+// ======================================================
+// Workloads
+// ======================================================
+
+static LLVMModuleRef build_sum(LLVMContextRef ctx) {
+    LLVMModuleRef mod = LLVMModuleCreateWithNameInContext("my_module", ctx);
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(ctx);
+    LLVMTypeRef param_types[] = { i32, i32 };
+    LLVMValueRef sum = LLVMAddFunction(mod, "sum", LLVMFunctionType(i32, param_types, 2, 0));
+    LLVMBuilderRef builder = LLVMCreateBuilderInContext(ctx);
+    LLVMPositionBuilderAtEnd(builder, LLVMAppendBasicBlockInContext(ctx, sum, "entry"));
+    LLVMBuildRet(builder, LLVMBuildAdd(builder, LLVMGetParam(sum, 0), LLVMGetParam(sum, 1), "tmp"));
+    LLVMDisposeBuilder(builder);
+    return mod;
+}
+
+/**
+ * int kernel_k(int *a, int *b, long n) {
+ *     int acc = k;
+ *     for (long i = 0; i < n; i++)
+ *         acc = (acc ^ (a[i] * b[i])) + (a[i] >> 3);
+ *     return acc;
+ * }
+ */
+static LLVMModuleRef build_kernels(LLVMContextRef ctx) {
+    LLVMModuleRef mod = LLVMModuleCreateWithNameInContext("kernels", ctx);
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(ctx);
+    LLVMTypeRef i64 = LLVMInt64TypeInContext(ctx);
+    LLVMTypeRef param_types[] = { LLVMPointerType(i32, 0), LLVMPointerType(i32, 0), i64 };
+    LLVMTypeRef fun_type = LLVMFunctionType(i32, param_types, 3, 0);
+    LLVMBuilderRef builder = LLVMCreateBuilderInContext(ctx);
+
+    for (int k = 0; k < KERNEL_COUNT; k++) {
+        char name[32];
+        snprintf(name, sizeof(name), "kernel_%d", k);
+        LLVMValueRef fun = LLVMAddFunction(mod, name, fun_type);
+        LLVMValueRef a = LLVMGetParam(fun, 0);
+        LLVMValueRef b = LLVMGetParam(fun, 1);
+        LLVMValueRef n = LLVMGetParam(fun, 2);
+        LLVMBasicBlockRef entry = LLVMAppendBasicBlockInContext(ctx, fun, "entry");
+        LLVMBasicBlockRef loop = LLVMAppendBasicBlockInContext(ctx, fun, "loop");
+        LLVMBasicBlockRef exit = LLVMAppendBasicBlockInContext(ctx, fun, "exit");
+
+        LLVMPositionBuilderAtEnd(builder, entry);
+        LLVMValueRef empty = LLVMBuildICmp(builder, LLVMIntSLE, n, LLVMConstInt(i64, 0, 0), "empty");
+        LLVMBuildCondBr(builder, empty, exit, loop);
+
+        LLVMPositionBuilderAtEnd(builder, loop);
+        LLVMValueRef i = LLVMBuildPhi(builder, i64, "i");
+        LLVMValueRef acc = LLVMBuildPhi(builder, i32, "acc");
+        LLVMValueRef a_i = LLVMBuildLoad2(builder, i32, LLVMBuildGEP2(builder, i32, a, &i, 1, "a_ptr"), "a_i");
+        LLVMValueRef b_i = LLVMBuildLoad2(builder, i32, LLVMBuildGEP2(builder, i32, b, &i, 1, "b_ptr"), "b_i");
+        LLVMValueRef prod = LLVMBuildMul(builder, a_i, b_i, "prod");
+        LLVMValueRef mixed = LLVMBuildXor(builder, acc, prod, "mixed");
+        LLVMValueRef shifted = LLVMBuildAShr(builder, a_i, LLVMConstInt(i32, 3, 0), "shifted");
+        LLVMValueRef next_acc = LLVMBuildAdd(builder, mixed, shifted, "next_acc");
+        LLVMValueRef next_i = LLVMBuildAdd(builder, i, LLVMConstInt(i64, 1, 0), "next_i");
+        LLVMValueRef done = LLVMBuildICmp(builder, LLVMIntEQ, next_i, n, "done");
+        LLVMBuildCondBr(builder, done, exit, loop);
+
+        LLVMValueRef i_values[] = { LLVMConstInt(i64, 0, 0), next_i };
+        LLVMValueRef acc_values[] = { LLVMConstInt(i32, k, 0), next_acc };
+        LLVMBasicBlockRef incoming[] = { entry, loop };
+        LLVMAddIncoming(i, i_values, incoming, 2);
+        LLVMAddIncoming(acc, acc_values, incoming, 2);
+
+        LLVMPositionBuilderAtEnd(builder, exit);
+        LLVMValueRef result = LLVMBuildPhi(builder, i32, "result");
+        LLVMValueRef result_values[] = { LLVMConstInt(i32, k, 0), next_acc };
+        LLVMAddIncoming(result, result_values, incoming, 2);
+        LLVMBuildRet(builder, result);
+    }
+    LLVMDisposeBuilder(builder);
+    return mod;
+}
+
+static uint64_t text_size(LLVMMemoryBufferRef object) {
+    char *error = NULL;
+    LLVMBinaryRef binary = LLVMCreateBinary(object, NULL, &error);
+    if (!binary) {
+        fprintf(stderr, "%s\n", error);
+        LLVMDisposeMessage(error);
+        return 0;
+    }
+    uint64_t size = 0;
+    LLVMSectionIteratorRef section = LLVMObjectFileCopySectionIterator(binary);
+    for (; !LLVMObjectFileIsSectionIteratorAtEnd(binary, section); LLVMMoveToNextSection(section)) {
+        const char *name = LLVMGetSectionName(section);
+        if (name && strncmp(name, ".text", 5) == 0) {
+            size += LLVMGetSectionSize(section);
+        }
+    }
+    LLVMDisposeSectionIterator(section);
+    LLVMDisposeBinary(binary);
+    return size;
+}
+
+// ======================================================
+// Profile measurement, in a child process
+// ======================================================
+
+static LLVMMemoryBufferRef emit(LLVMTargetMachineRef tm, LLVMModuleRef mod) {
+    char *error = NULL;
+    LLVMMemoryBufferRef object = NULL;
+    if (LLVMTargetMachineEmitToMemoryBuffer(tm, mod, LLVMObjectFile, &error, &object) != 0) {
+        fprintf(stderr, "%s\n", error);
+        LLVMDisposeMessage(error);
+        exit(1);
+    }
+    return object;
+}
+
+static void measure(const Profile *profile, Result *result) {
+    const char *args[8] = { "fastcompile" };
+    int argc = 1;
+    for (int i = 0; profile->options[i]; i++) {
+        args[argc++] = profile->options[i];
+    }
+    LLVMParseCommandLineOptions(argc, args, NULL);
+
+    char *triple = LLVMGetDefaultTargetTriple();
+    char *error = NULL;
+    LLVMTargetRef targetRef;
+    if (LLVMGetTargetFromTriple(triple, &targetRef, &error) != 0) {
+        fprintf(stderr, "%s\n", error);
+        exit(1);
+    }
+    LLVMTargetMachineRef tm = LLVMCreateTargetMachine(targetRef, triple, "", "", profile->level, LLVMRelocPIC, LLVMCodeModelDefault);
+    LLVMDisposeMessage(triple);
+
+    // Latency: build, verify and emit sum, the first time then warm
+    LLVMContextRef ctx = LLVMContextCreate();
+    double start = now();
+    for (int i = 0; i <= SUM_COMPILES; i++) {
+        LLVMModuleRef mod = build_sum(ctx);
+        LLVMVerifyModule(mod, LLVMAbortProcessAction, NULL);
+        LLVMDisposeMemoryBuffer(emit(tm, mod));
+        LLVMDisposeModule(mod);
+        if (i == 0) {
+            double first = now();
+            result->sum_first_us = (first - start) * 1e6;
+            start = first;
+        }
+    }
+    result->sum_mean_us = (now() - start) * 1e6 / SUM_COMPILES;
+    LLVMContextDispose(ctx);
+
+    // Throughput and code quality on the kernel module
+    ctx = LLVMContextCreate();
+    LLVMModuleRef kernels = build_kernels(ctx);
+    LLVMVerifyModule(kernels, LLVMAbortProcessAction, NULL);
+    start = now();
+    LLVMMemoryBufferRef object = emit(tm, kernels);
+    result->kernels_compile_ms = (now() - start) * 1e3;
+    result->text_bytes = text_size(object);
+    LLVMDisposeModule(kernels);
+    LLVMContextDispose(ctx);
+
+    // Runtime: link the emitted object in-process and call kernel_0
+    LLVMOrcLLJITRef jit;
+    LLVMErrorRef err = LLVMOrcCreateLLJIT(&jit, NULL);
+    if (!err) {
+        err = LLVMOrcLLJITAddObjectFile(jit, LLVMOrcLLJITGetMainJITDylib(jit), object);
+    }
+    LLVMOrcJITTargetAddress addr = 0;
+    if (!err) {
+        err = LLVMOrcLLJITLookup(jit, &addr, "kernel_0");
+    }
+    if (err) {
+        char *msg = LLVMGetErrorMessage(err);
+        fprintf(stderr, "%s: %s\n", profile->name, msg);
+        LLVMDisposeErrorMessage(msg);
+        exit(1);
+    }
+    int32_t (*kernel)(int32_t *, int32_t *, int64_t) = (int32_t (*)(int32_t *, int32_t *, int64_t)) (uintptr_t) addr;
+
+    static int32_t a[ARRAY_LENGTH], b[ARRAY_LENGTH];
+    for (int i = 0; i < ARRAY_LENGTH; i++) {
+        a[i] = i * 7 + 1;
+        b[i] = ARRAY_LENGTH - i;
+    }
+    result->checksum = 0;
+    start = now();
+    for (int r = 0; r < KERNEL_RUNS; r++) {
+        result->checksum ^= kernel(a, b, ARRAY_LENGTH);
+    }
+    result->kernel_run_us = (now() - start) * 1e6 / KERNEL_RUNS;
+
+    LLVMOrcDisposeLLJIT(jit);
+    LLVMDisposeTargetMachine(tm);
+}
+
+int main(int argc, char const *argv[]) {
+    // Initialization of the native target, the code is run in-process
+    LLVMInitializeNativeTarget();
+    LLVMInitializeNativeAsmPrinter();
+
+    size_t count = sizeof(profiles) / sizeof(profiles[0]);
+    Result results[sizeof(profiles) / sizeof(profiles[0])];
+
+    for (size_t p = 0; p < count; p++) {
+        int fds[2];
+        if (pipe(fds) != 0) {
+            perror("pipe");
+            return 1;
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(fds[0]);
+            Result result;
+            measure(&profiles[p], &result);
+            ssize_t written = write(fds[1], &result, sizeof(result));
+            _exit(written == sizeof(result) ? 0 : 1);
+        }
+        close(fds[1]);
+        ssize_t got = read(fds[0], &results[p], sizeof(results[p]));
+        close(fds[0]);
+        int status;
+        waitpid(pid, &status, 0);
+        if (got != sizeof(results[p]) || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "profile %s failed\n", profiles[p].name);
+            return 1;
+        }
+    }
+
+    const Result *base = &results[0];
+    printf("%-12s %14s %14s %16s %12s %14s\n", "profile", "sum first", "sum mean", "kernels compile", ".text",
+           "kernel run");
+    for (size_t p = 0; p < count; p++) {
+        const Result *r = &results[p];
+        printf("%-12s %11.1f us %11.1f us %13.2f ms %8llu B %11.2f us   (compile %.2fx, size %.2fx, run %.2fx)%s\n",
+               profiles[p].name, r->sum_first_us, r->sum_mean_us, r->kernels_compile_ms,
+               (unsigned long long) r->text_bytes, r->kernel_run_us,
+               r->kernels_compile_ms / base->kernels_compile_ms,
+               (double) r->text_bytes / base->text_bytes,
+               r->kernel_run_us / base->kernel_run_us,
+               r->checksum == base->checksum ? "" : " MISMATCH");
+    }
+}
@@ -0,0 +1,320 @@
+/**
+ * Fork server for isolated compiles with pre-initialized LLVM state.
+ *
+ * Every job builds, in its own process, the sum of sum.c with a constant:
+ *
+ * int sum_k(int a, int b) {
+ *     return a + b + k;
+ * }
+ *
+ * Cold start: the job process is executed from scratch, and pays the
+ * LLVMInitializeAll* calls and the target machine creation before it
+ * builds and emits the module.
+ *
+ * Fork server: a server process does that initialization once, then forks
+ * a copy-on-write child per job. The child builds and emits the module,
+ * under resource limits, and writes the object to a pipe; the server
+ * relays it to the client along with the exit status of the child, so that
+ * a crashing build is reported instead of hanging the client.
+ *
+ * The spawn time is measured from the job request to the moment the job
+ * process is ready to build, the total up to the object being received.
+ */
+
+#include "measure.h"
+
+#include <llvm-c/Core.h>
+#include <llvm-c/Analysis.h>
+#include <llvm-c/Target.h>
+#include <llvm-c/TargetMachine.h>
+
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define JOB_COUNT 50
+#define MAX_OBJECT (1 << 20)
+
+static const char triple[] = "x86_64";
+
+// Sent before the object, by the job process then by the server
+typedef struct {
+    int status;         // 0 on success
+    double ready;       // CLOCK_MONOTONIC time the job process could start building
+    double built;       // ... and had emitted the object
+    uint64_t size;
+} JobHeader;
+
+static int read_all(int fd, void *buffer, size_t size) {
+    char *p = buffer;
+    while (size > 0) {
+        ssize_t n = read(fd, p, size);
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static int write_all(int fd, const void *buffer, size_t size) {
+    const char *p = buffer;
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+// ======================================================
+// Job
+// ======================================================
+
+static void initialize(LLVMTargetMachineRef *tm) {
+    LLVMInitializeAllTargets();
+    LLVMInitializeAllTargetMCs();
+    LLVMInitializeAllTargetInfos();
+    LLVMInitializeAllAsmPrinters();
+
+    char *error = NULL;
+    LLVMTargetRef targetRef;
+    if (LLVMGetTargetFromTriple(triple, &targetRef, &error) != 0) {
+        fprintf(stderr, "%s\n", error);
+        exit(1);
+    }
+    *tm = LLVMCreateTargetMachine(targetRef, triple, "", "", LLVMCodeGenLevelDefault, LLVMRelocDefault, LLVMCodeModelDefault);
+}
+
+// Builds and emits sum_k, then writes header and object to fd
+static int run_job(LLVMTargetMachineRef tm, int k, int fd, double ready) {
+    LLVMContextRef ctx = LLVMContextCreate();
+    LLVMModuleRef mod = LLVMModuleCreateWithNameInContext("my_module", ctx);
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(ctx);
+    LLVMTypeRef param_types[] = { i32, i32 };
+    char name[32];
+    snprintf(name, sizeof(name), "sum_%d", k);
+    LLVMValueRef sum = LLVMAddFunction(mod, name, LLVMFunctionType(i32, param_types, 2, 0));
+    LLVMBuilderRef builder = LLVMCreateBuilderInContext(ctx);
+    LLVMPositionBuilderAtEnd(builder, LLVMAppendBasicBlockInContext(ctx, sum, "entry"));
+    LLVMValueRef tmp = LLVMBuildAdd(builder, LLVMGetParam(sum, 0), LLVMGetParam(sum, 1), "tmp");
+    LLVMBuildRet(builder, LLVMBuildAdd(builder, tmp, LLVMConstInt(i32, k, 0), "tmp"));
+    LLVMDisposeBuilder(builder);
+
+    JobHeader header = { 0 };
+    header.ready = ready;
+    char *error = NULL;
+    LLVMMemoryBufferRef object = NULL;
+    if (LLVMVerifyModule(mod, LLVMReturnStatusAction, &error) ||
+        LLVMTargetMachineEmitToMemoryBuffer(tm, mod, LLVMObjectFile, &error, &object) != 0) {
+        fprintf(stderr, "%s\n", error);
+        header.status = 1;
+    } else {
+        header.size = LLVMGetBufferSize(object);
+    }
+    LLVMDisposeMessage(error);
+    header.built = now();
+
+    int failed = write_all(fd, &header, sizeof(header)) ||
+                 (object && write_all(fd, LLVMGetBufferStart(object), header.size));
+    if (object) {
+        LLVMDisposeMemoryBuffer(object);
+    }
+    LLVMDisposeModule(mod);
+    LLVMContextDispose(ctx);
+    return failed || header.status;
+}
+
+// ======================================================
+// Fork server
+// ======================================================
+
+typedef struct {
+    pid_t pid;
+    int requests;       // client -> server, job numbers
+    int results;        // server -> client, headers and objects
+} ForkServer;
+
+// Forks a child per job, relays its output, reports it when it failed
+static void serve(LLVMTargetMachineRef tm, int requests, int results) {
+    static char object[MAX_OBJECT];
+    int k;
+    while (read_all(requests, &k, sizeof(k)) == 0) {
+        int job_pipe[2];
+        if (pipe(job_pipe) != 0) {
+            exit(1);
+        }
+        pid_t child = fork();
+        if (child == 0) {
+            double ready = now();
+            close(job_pipe[0]);
+            close(requests);
+            close(results);
+
+            // Untrusted build: bounded CPU time and memory
+            struct rlimit cpu = { 10, 10 };
+            struct rlimit memory = { 1UL << 30, 1UL << 30 };
+            setrlimit(RLIMIT_CPU, &cpu);
+            setrlimit(RLIMIT_AS, &memory);
+            _exit(run_job(tm, k, job_pipe[1], ready));
+        }
+        close(job_pipe[1]);
+
+        JobHeader header = { 0 };
+        int received = read_all(job_pipe[0], &header, sizeof(header)) == 0 && header.size <= MAX_OBJECT &&
+                       read_all(job_pipe[0], object, header.size) == 0;
+        close(job_pipe[0]);
+        int status;
+        waitpid(child, &status, 0);
+        if (!received || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            memset(&header, 0, sizeof(header));
+            header.status = WIFSIGNALED(status) ? 128 + WTERMSIG(status) : 1;
+        }
+        if (write_all(results, &header, sizeof(header)) || write_all(results, object, header.size)) {
+            break;
+        }
+    }
+    exit(0);
+}
+
+static ForkServer fork_server_start(void) {
+    int requests[2], results[2];
+    if (pipe(requests) != 0 || pipe(results) != 0) {
+        perror("pipe");
+        exit(1);
+    }
+    ForkServer server;
+    server.pid = fork();
+    if (server.pid == 0) {
+        close(requests[1]);
+        close(results[0]);
+        LLVMTargetMachineRef tm;
+        initialize(&tm);
+        serve(tm, requests[0], results[1]);
+    }
+    close(requests[0]);
+    close(results[1]);
+    server.requests = requests[1];
+    server.results = results[0];
+    return server;
+}
+
+static void fork_server_stop(ForkServer *server) {
+    close(server->requests);
+    close(server->results);
+    waitpid(server->pid, NULL, 0);
+}
+
+// ======================================================
+// Benchmark
+// ======================================================
+
+typedef struct {
+    double spawn;
+    double build;
+    double total;
+    uint64_t bytes;
+    unsigned failed;
+} Timings;
+
+static void account(Timings *t, double start, const JobHeader *header) {
+    if (header->status != 0) {
+        t->failed++;
+        return;
+    }
+    t->spawn += header->ready - start;
+    t->build += header->built - header->ready;
+    t->total += now() - start;
+    t->bytes += header->size;
+}
+
+// The job process executed from scratch, reporting on its stdout
+static void cold_job(const char *self, int k, Timings *t) {
+    static char object[MAX_OBJECT];
+    int out[2];
+    if (pipe(out) != 0) {
+        perror("pipe");
+        exit(1);
+    }
+    double start = now();
+    pid_t child = fork();
+    if (child == 0) {
+        dup2(out[1], STDOUT_FILENO);
+        close(out[0]);
+        close(out[1]);
+        char arg[16];
+        snprintf(arg, sizeof(arg), "%d", k);
+        execl(self, self, "--job", arg, (char *) NULL);
+        _exit(127);
+    }
+    close(out[1]);
+    JobHeader header = { 1 };
+    if (read_all(out[0], &header, sizeof(header)) != 0 || header.size > MAX_OBJECT ||
+        read_all(out[0], object, header.size) != 0) {
+        header.status = 1;
+    }
+    close(out[0]);
+    waitpid(child, NULL, 0);
+    account(t, start, &header);
+}
+
+static void server_job(ForkServer *server, int k, Timings *t) {
+    static char object[MAX_OBJECT];
+    double start = now();
+    JobHeader header = { 1 };
+    if (write_all(server->requests, &k, sizeof(k)) != 0 || read_all(server->results, &header, sizeof(header)) != 0 ||
+        header.size > MAX_OBJECT || read_all(server->results, object, header.size) != 0) {
+        fprintf(stderr, "fork server went away\n");
+        exit(1);
+    }
+    account(t, start, &header);
+}
+
+static void report(const char *label, const Timings *t) {
+    unsigned ok = JOB_COUNT - t->failed;
+    printf("%-12s spawn %8.3f ms, build+emit %7.3f ms, total %8.3f ms per job (%u ok, %llu object bytes)\n", label,
+           t->spawn * 1e3 / ok, t->build * 1e3 / ok, t->total * 1e3 / ok, ok, (unsigned long long) t->bytes);
+}
+
+int main(int argc, char const *argv[]) {
+    // Cold job process: initialize, build, emit, report on stdout
+    if (argc == 3 && strcmp(argv[1], "--job") == 0) {
+        LLVMTargetMachineRef tm;
+        initialize(&tm);
+        double ready = now();
+        int status = run_job(tm, atoi(argv[2]), STDOUT_FILENO, ready);
+        LLVMDisposeTargetMachine(tm);
+        return status;
+    }
+    // The job processes are reaped with waitpid, the server may be gone
+    signal(SIGPIPE, SIG_IGN);
+
+    Timings cold = { 0 };
+    for (int k = 0; k < JOB_COUNT; k++) {
+        cold_job("/proc/self/exe", k, &cold);
+    }
+
+    double start = now();
+    ForkServer server = fork_server_start();
+    Timings warm = { 0 };
+    for (int k = 0; k < JOB_COUNT; k++) {
+        server_job(&server, k, &warm);
+    }
+    double server_ms = (now() - start) * 1e3;
+    fork_server_stop(&server);
+
+    printf("%d jobs each\n", JOB_COUNT);
+    report("cold start", &cold);
+    report("fork server", &warm);
+    printf("spawn: %.1fx faster, total: %.1fx faster (%.2f ms with the server start-up)\n",
+           cold.spawn / warm.spawn, cold.total / warm.total, server_ms);
+}
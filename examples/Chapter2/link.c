@@ -0,0 +1,285 @@
+/**
+ * In-memory linking of generated modules, so that calls between them can
+ * be inlined. The three modules below are built separately:
+ *
+ * // helpers
+ * int sum(int a, int b)  { return a + b; }
+ * int square(int a)      { return a * a; }
+ *
+ * // geometry, calls into helpers
+ * int norm2(int x, int y) { return sum(square(x), square(y)); }
+ *
+ * // api, calls into geometry and helpers
+ * int distance2(int x0, int y0, int x1, int y1) {
+ *     return norm2(sum(x1, -x0), sum(y1, -y0));
+ * }
+ *
+ * link_modules() merges them with LLVMLinkModules2, internalizes every
+ * definition except the exported roots, optimizes the result as a unit and
+ * reports which calls were inlined, kept, or went away with a caller that
+ * was removed, along with the instruction counts before and after. The
+ * linked module is then emitted like sum.c does.
+ */
+
+#include <llvm-c/Core.h>
+#include <llvm-c/Analysis.h>
+#include <llvm-c/Linker.h>
+#include <llvm-c/Target.h>
+#include <llvm-c/TargetMachine.h>
+#include <llvm-c/Transforms/PassBuilder.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_CALLS 256
+
+typedef enum { CallKept, CallInlined, CallRemoved } CallOutcome;
+
+typedef struct {
+    char caller[64];
+    char callee[64];
+    CallOutcome outcome;
+} CallSite;
+
+typedef struct {
+    unsigned instructions_before;
+    unsigned instructions_after;
+    unsigned call_count;
+    CallSite calls[MAX_CALLS];
+} LinkReport;
+
+// ======================================================
+// Module builders
+// ======================================================
+
+static LLVMValueRef declare(LLVMModuleRef mod, const char *name, unsigned arity) {
+    LLVMValueRef fun = LLVMGetNamedFunction(mod, name);
+    if (fun) {
+        return fun;
+    }
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(LLVMGetModuleContext(mod));
+    LLVMTypeRef param_types[] = { i32, i32, i32, i32 };
+    return LLVMAddFunction(mod, name, LLVMFunctionType(i32, param_types, arity, 0));
+}
+
+static LLVMValueRef call(LLVMBuilderRef builder, LLVMValueRef fun, LLVMValueRef *args, unsigned count) {
+    return LLVMBuildCall2(builder, LLVMGlobalGetValueType(fun), fun, args, count, "call");
+}
+
+static LLVMModuleRef build_helpers(LLVMContextRef ctx, LLVMBuilderRef builder) {
+    LLVMModuleRef mod = LLVMModuleCreateWithNameInContext("helpers", ctx);
+
+    LLVMValueRef sum = declare(mod, "sum", 2);
+    LLVMPositionBuilderAtEnd(builder, LLVMAppendBasicBlockInContext(ctx, sum, "entry"));
+    LLVMBuildRet(builder, LLVMBuildAdd(builder, LLVMGetParam(sum, 0), LLVMGetParam(sum, 1), "tmp"));
+
+    LLVMValueRef square = declare(mod, "square", 1);
+    LLVMPositionBuilderAtEnd(builder, LLVMAppendBasicBlockInContext(ctx, square, "entry"));
+    LLVMBuildRet(builder, LLVMBuildMul(builder, LLVMGetParam(square, 0), LLVMGetParam(square, 0), "tmp"));
+    return mod;
+}
+
+static LLVMModuleRef build_geometry(LLVMContextRef ctx, LLVMBuilderRef builder) {
+    LLVMModuleRef mod = LLVMModuleCreateWithNameInContext("geometry", ctx);
+    LLVMValueRef sum = declare(mod, "sum", 2);
+    LLVMValueRef square = declare(mod, "square", 1);
+
+    LLVMValueRef norm2 = declare(mod, "norm2", 2);
+    LLVMPositionBuilderAtEnd(builder, LLVMAppendBasicBlockInContext(ctx, norm2, "entry"));
+    LLVMValueRef x2 = call(builder, square, (LLVMValueRef[]) { LLVMGetParam(norm2, 0) }, 1);
+    LLVMValueRef y2 = call(builder, square, (LLVMValueRef[]) { LLVMGetParam(norm2, 1) }, 1);
+    LLVMBuildRet(builder, call(builder, sum, (LLVMValueRef[]) { x2, y2 }, 2));
+    return mod;
+}
+
+static LLVMModuleRef build_api(LLVMContextRef ctx, LLVMBuilderRef builder) {
+    LLVMModuleRef mod = LLVMModuleCreateWithNameInContext("api", ctx);
+    LLVMValueRef sum = declare(mod, "sum", 2);
+    LLVMValueRef norm2 = declare(mod, "norm2", 2);
+
+    LLVMValueRef distance2 = declare(mod, "distance2", 4);
+    LLVMPositionBuilderAtEnd(builder, LLVMAppendBasicBlockInContext(ctx, distance2, "entry"));
+    LLVMValueRef neg_x0 = LLVMBuildNeg(builder, LLVMGetParam(distance2, 0), "neg_x0");
+    LLVMValueRef neg_y0 = LLVMBuildNeg(builder, LLVMGetParam(distance2, 1), "neg_y0");
+    LLVMValueRef dx = call(builder, sum, (LLVMValueRef[]) { LLVMGetParam(distance2, 2), neg_x0 }, 2);
+    LLVMValueRef dy = call(builder, sum, (LLVMValueRef[]) { LLVMGetParam(distance2, 3), neg_y0 }, 2);
+    LLVMBuildRet(builder, call(builder, norm2, (LLVMValueRef[]) { dx, dy }, 2));
+    return mod;
+}
+
+// ======================================================
+// Linking
+// ======================================================
+
+static unsigned count_instructions(LLVMModuleRef mod) {
+    unsigned count = 0;
+    for (LLVMValueRef fun = LLVMGetFirstFunction(mod); fun; fun = LLVMGetNextFunction(fun)) {
+        for (LLVMBasicBlockRef bb = LLVMGetFirstBasicBlock(fun); bb; bb = LLVMGetNextBasicBlock(bb)) {
+            for (LLVMValueRef inst = LLVMGetFirstInstruction(bb); inst; inst = LLVMGetNextInstruction(inst)) {
+                count++;
+            }
+        }
+    }
+    return count;
+}
+
+static const char *direct_callee(LLVMValueRef inst) {
+    if (!LLVMIsACallInst(inst)) {
+        return NULL;
+    }
+    LLVMValueRef callee = LLVMGetCalledValue(inst);
+    if (!LLVMIsAFunction(callee) || LLVMIsDeclaration(callee)) {
+        return NULL;
+    }
+    return LLVMGetValueName(callee);
+}
+
+static int is_called_from(LLVMValueRef fun, const char *callee) {
+    for (LLVMBasicBlockRef bb = LLVMGetFirstBasicBlock(fun); bb; bb = LLVMGetNextBasicBlock(bb)) {
+        for (LLVMValueRef inst = LLVMGetFirstInstruction(bb); inst; inst = LLVMGetNextInstruction(inst)) {
+            const char *name = direct_callee(inst);
+            if (name && strcmp(name, callee) == 0) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Links modules[1..count-1] into modules[0], which is returned. The other
+ * modules are consumed by the linker. Only the functions named in roots
+ * stay externally visible. Returns NULL and sets *error when linking
+ * fails; modules[0] is then left in an unspecified state.
+ */
+static LLVMModuleRef link_modules(LLVMModuleRef *modules, unsigned count, const char **roots,
+                                  unsigned root_count, LLVMTargetMachineRef target_machine,
+                                  LinkReport *report, char **error) {
+    LLVMModuleRef dest = modules[0];
+    for (unsigned i = 1; i < count; i++) {
+        if (LLVMLinkModules2(dest, modules[i])) {
+            *error = strdup("module linking failed");
+            return NULL;
+        }
+    }
+
+    // Internalize: the roots are the only entry points callers can see
+    for (LLVMValueRef fun = LLVMGetFirstFunction(dest); fun; fun = LLVMGetNextFunction(fun)) {
+        if (LLVMIsDeclaration(fun)) {
+            continue;
+        }
+        int exported = 0;
+        for (unsigned r = 0; r < root_count; r++) {
+            exported |= strcmp(LLVMGetValueName(fun), roots[r]) == 0;
+        }
+        if (!exported) {
+            LLVMSetLinkage(fun, LLVMInternalLinkage);
+        }
+    }
+
+    if (LLVMVerifyModule(dest, LLVMReturnStatusAction, error)) {
+        return NULL;
+    }
+    LLVMDisposeMessage(*error);
+    *error = NULL;
+
+    // Record the calls that cross into other definitions
+    memset(report, 0, sizeof(*report));
+    report->instructions_before = count_instructions(dest);
+    for (LLVMValueRef fun = LLVMGetFirstFunction(dest); fun; fun = LLVMGetNextFunction(fun)) {
+        for (LLVMBasicBlockRef bb = LLVMGetFirstBasicBlock(fun); bb; bb = LLVMGetNextBasicBlock(bb)) {
+            for (LLVMValueRef inst = LLVMGetFirstInstruction(bb); inst; inst = LLVMGetNextInstruction(inst)) {
+                const char *callee = direct_callee(inst);
+                if (callee && report->call_count < MAX_CALLS) {
+                    CallSite *site = &report->calls[report->call_count++];
+                    snprintf(site->caller, sizeof(site->caller), "%s", LLVMGetValueName(fun));
+                    snprintf(site->callee, sizeof(site->callee), "%s", callee);
+                }
+            }
+        }
+    }
+
+    // Whole-unit optimization
+    LLVMPassBuilderOptionsRef options = LLVMCreatePassBuilderOptions();
+    LLVMErrorRef err = LLVMRunPasses(dest, "default<O2>", target_machine, options);
+    LLVMDisposePassBuilderOptions(options);
+    if (err) {
+        *error = LLVMGetErrorMessage(err);
+        return NULL;
+    }
+
+    // A call is inlined when its caller is still there and no longer makes
+    // it. When the caller is gone, it was inlined everywhere or dead, and
+    // what became of its calls is not visible from the result.
+    report->instructions_after = count_instructions(dest);
+    for (unsigned i = 0; i < report->call_count; i++) {
+        CallSite *site = &report->calls[i];
+        LLVMValueRef caller = LLVMGetNamedFunction(dest, site->caller);
+        if (!caller) {
+            site->outcome = CallRemoved;
+        } else {
+            site->outcome = is_called_from(caller, site->callee) ? CallKept : CallInlined;
+        }
+    }
+    return dest;
+}
+
+int main(int argc, char const *argv[]) {
+    // Module creation, one per generator
+    LLVMContextRef ctx = LLVMContextCreate();
+    LLVMBuilderRef builder = LLVMCreateBuilderInContext(ctx);
+    LLVMModuleRef modules[] = {
+        build_api(ctx, builder),
+        build_geometry(ctx, builder),
+        build_helpers(ctx, builder),
+    };
+    LLVMDisposeBuilder(builder);
+
+    // Initialization of the targets
+    LLVMInitializeAllTargets();
+    LLVMInitializeAllTargetMCs();
+    LLVMInitializeAllTargetInfos();
+    LLVMInitializeAllAsmPrinters();
+
+    // Generating the target machine
+    char triple[] = "x86_64";
+    char cpu[] = "";
+    char *error = NULL;
+    LLVMTargetRef targetRef;
+    if (LLVMGetTargetFromTriple(triple, &targetRef, &error) != 0) {
+        printf("%s\n", error);
+        return 1;
+    }
+    LLVMTargetMachineRef targetMachineRef = LLVMCreateTargetMachine(targetRef, triple, cpu, "", LLVMCodeGenLevelDefault, LLVMRelocDefault, LLVMCodeModelDefault);
+
+    // Linking and optimization as a unit
+    const char *roots[] = { "distance2" };
+    LinkReport report;
+    LLVMModuleRef mod = link_modules(modules, 3, roots, 1, targetMachineRef, &report, &error);
+    if (!mod) {
+        printf("%s\n", error);
+        return 1;
+    }
+
+    static const char *outcomes[] = { "kept", "inlined", "caller removed" };
+    printf("instructions: %u before, %u after\n", report.instructions_before, report.instructions_after);
+    for (unsigned i = 0; i < report.call_count; i++) {
+        printf("  %s -> %s: %s\n", report.calls[i].caller, report.calls[i].callee,
+               outcomes[report.calls[i].outcome]);
+    }
+
+    // Bitcode writing to file
+    if (LLVMTargetMachineEmitToFile(targetMachineRef, mod, "link_llvm.o", LLVMObjectFile, &error) != 0) {
+        printf("%s\n", error);
+        LLVMDisposeMessage(error);
+    }
+    if (LLVMTargetMachineEmitToFile(targetMachineRef, mod, "link_llvm.asm", LLVMAssemblyFile, &error) != 0) {
+        printf("%s\n", error);
+        LLVMDisposeMessage(error);
+    }
+
+    LLVMDisposeModule(mod);
+    LLVMDisposeTargetMachine(targetMachineRef);
+    LLVMContextDispose(ctx);
+}
@@ -0,0 +1,159 @@
+/**
+ * Move-only owners for the LLVM-C handles used by the examples.
+ *
+ * Each owner holds one reference and disposes it when it goes out of
+ * scope; it converts implicitly to the C reference, so it is passed to the
+ * LLVM-C functions as is. Nothing is virtual and an owner allocates
+ * nothing: it is the size of the reference and, once inlined, compiles
+ * down to the same calls.
+ *
+ * Destruction runs in reverse declaration order, so a Context must be
+ * declared before the Module, Builder and MemoryBuffer that use it. An
+ * API that takes ownership (LLVMLinkModules2 for its source module,
+ * LLVMOrcCreateNewThreadSafeModule, ...) gets the result of release().
+ *
+ * Types interns the types of a context, including function types, so
+ * that a generator asks LLVM for each of them once. Unlike the owners it
+ * allocates: the function types are kept in a std::vector, one entry per
+ * signature asked for. A Builder is meant to be reused for every function
+ * of its context, repositioned with LLVMPositionBuilderAtEnd.
+ *
+ * Header only, no exceptions: -std=c++14 -fno-exceptions is enough.
+ */
+
+#ifndef LLVM_HANDLES_HPP
+#define LLVM_HANDLES_HPP
+
+#include <llvm-c/Core.h>
+#include <llvm-c/TargetMachine.h>
+
+#include <vector>
+
+namespace llvm_handles {
+
+template <typename Ref, void (*Dispose)(Ref)>
+class Owner {
+public:
+    Owner() noexcept : ref(nullptr) {}
+    explicit Owner(Ref ref) noexcept : ref(ref) {}
+    Owner(Owner &&other) noexcept : ref(other.release()) {}
+    Owner(const Owner &) = delete;
+    ~Owner() { reset(); }
+
+    Owner &operator=(Owner &&other) noexcept {
+        reset(other.release());
+        return *this;
+    }
+    Owner &operator=(const Owner &) = delete;
+
+    Ref get() const noexcept { return ref; }
+    operator Ref() const noexcept { return ref; }
+    explicit operator bool() const noexcept { return ref != nullptr; }
+
+    // Gives up ownership, for the APIs that take it
+    Ref release() noexcept {
+        Ref released = ref;
+        ref = nullptr;
+        return released;
+    }
+
+    void reset(Ref replacement = nullptr) noexcept {
+        if (ref) {
+            Dispose(ref);
+        }
+        ref = replacement;
+    }
+
+    // For out parameters, e.g. the char ** of the error messages
+    Ref *out() noexcept {
+        reset();
+        return &ref;
+    }
+
+private:
+    Ref ref;
+};
+
+using Context = Owner<LLVMContextRef, LLVMContextDispose>;
+using Module = Owner<LLVMModuleRef, LLVMDisposeModule>;
+using Builder = Owner<LLVMBuilderRef, LLVMDisposeBuilder>;
+using TargetMachine = Owner<LLVMTargetMachineRef, LLVMDisposeTargetMachine>;
+using TargetData = Owner<LLVMTargetDataRef, LLVMDisposeTargetData>;
+using MemoryBuffer = Owner<LLVMMemoryBufferRef, LLVMDisposeMemoryBuffer>;
+using Message = Owner<char *, LLVMDisposeMessage>;
+
+inline Context make_context() {
+    return Context(LLVMContextCreate());
+}
+
+inline Module make_module(const char *name, LLVMContextRef ctx) {
+    return Module(LLVMModuleCreateWithNameInContext(name, ctx));
+}
+
+inline Builder make_builder(LLVMContextRef ctx) {
+    return Builder(LLVMCreateBuilderInContext(ctx));
+}
+
+// Interned types of one context, which must outlive it
+class Types {
+public:
+    explicit Types(LLVMContextRef ctx)
+        : ctx(ctx), i1_type(LLVMInt1TypeInContext(ctx)),
+          i8_type(LLVMInt8TypeInContext(ctx)), i32_type(LLVMInt32TypeInContext(ctx)),
+          i64_type(LLVMInt64TypeInContext(ctx)), double_type(LLVMDoubleTypeInContext(ctx)) {}
+
+    LLVMContextRef context() const { return ctx; }
+    LLVMTypeRef i1() const { return i1_type; }
+    LLVMTypeRef i8() const { return i8_type; }
+    LLVMTypeRef i32() const { return i32_type; }
+    LLVMTypeRef i64() const { return i64_type; }
+    LLVMTypeRef f64() const { return double_type; }
+
+    // Function type, looked up among the ones already asked for first
+    LLVMTypeRef function(LLVMTypeRef ret, LLVMTypeRef *params, unsigned count, bool vararg = false) {
+        for (const Signature &signature : signatures) {
+            if (signature.matches(ret, params, count, vararg)) {
+                return signature.type;
+            }
+        }
+        Signature signature;
+        signature.ret = ret;
+        signature.params.assign(params, params + count);
+        signature.vararg = vararg;
+        signature.type = LLVMFunctionType(ret, params, count, vararg);
+        signatures.push_back(signature);
+        return signature.type;
+    }
+
+private:
+    struct Signature {
+        LLVMTypeRef ret;
+        std::vector<LLVMTypeRef> params;
+        bool vararg;
+        LLVMTypeRef type;
+
+        bool matches(LLVMTypeRef r, LLVMTypeRef *p, unsigned count, bool v) const {
+            if (r != ret || v != vararg || count != params.size()) {
+                return false;
+            }
+            for (unsigned i = 0; i < count; i++) {
+                if (p[i] != params[i]) {
+                    return false;
+                }
+            }
+            return true;
+        }
+    };
+
+    LLVMContextRef ctx;
+    LLVMTypeRef i1_type;
+    LLVMTypeRef i8_type;
+    LLVMTypeRef i32_type;
+    LLVMTypeRef i64_type;
+    LLVMTypeRef double_type;
+    std::vector<Signature> signatures;
+};
+
+} // namespace llvm_handles
+
+#endif
@@ -0,0 +1,22 @@
+/**
+ * Clock and memory readings shared by the Chapter 2 benchmarks.
+ */
+
+#ifndef MEASURE_H
+#define MEASURE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Seconds on the monotonic clock, from an unspecified origin
+double now(void);
+
+// Resident set of the process, from /proc/self/statm; 0 if unreadable
+long resident_kb(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,243 @@
+/**
+ * Per-job memory accounting of the compile pipeline.
+ *
+ * malloc and friends are interposed by memhook.c for the whole process,
+ * libLLVM included. While a thread runs a phase of a job, its allocations
+ * and frees are counted against that phase: number of allocations, bytes
+ * allocated, and the high-water mark of the bytes live since the phase
+ * began. The peak RSS delta (ru_maxrss) of the phase is recorded as well;
+ * it only moves when the process reaches a new peak.
+ *
+ * Each job goes through the phases of sum.c: build, verify, optimize
+ * (default<O2>) and emit (object in memory). The jobs build sum itself and
+ * modules of 100 and 1000 functions like it; every one runs twice, the
+ * first run of the process also paying for LLVM's one-time initialization.
+ * The records are printed and exported with the timings to memacct.csv.
+ */
+
+#include "measure.h"
+#include "memhook.h"
+
+#include <llvm-c/Core.h>
+#include <llvm-c/Analysis.h>
+#include <llvm-c/Target.h>
+#include <llvm-c/TargetMachine.h>
+#include <llvm-c/Transforms/PassBuilder.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+// ======================================================
+// Allocation accounting
+// ======================================================
+
+typedef struct {
+    unsigned long allocs;
+    unsigned long frees;
+    long long bytes;            // allocated
+    long long live;             // allocated minus freed, since the phase began
+    long long peak;             // high-water mark of live
+} MemCounters;
+
+// Counters of the phase running on this thread, NULL outside phases
+static __thread MemCounters *counting;
+
+void count_alloc(void *ptr, size_t size) {
+    (void) ptr;
+    MemCounters *c = counting;
+    if (c) {
+        c->allocs++;
+        c->bytes += size;
+        c->live += size;
+        if (c->live > c->peak) {
+            c->peak = c->live;
+        }
+    }
+}
+
+void count_free(void *ptr, size_t size) {
+    (void) ptr;
+    MemCounters *c = counting;
+    if (c) {
+        c->frees++;
+        c->live -= size;
+    }
+}
+
+// ======================================================
+// Jobs and phases
+// ======================================================
+
+typedef enum { PHASE_BUILD, PHASE_VERIFY, PHASE_OPTIMIZE, PHASE_EMIT, PHASE_COUNT } Phase;
+
+static const char *phase_names[] = { "build", "verify", "optimize", "emit" };
+
+typedef struct {
+    double ms;
+    MemCounters mem;
+    long rss_delta_kb;
+} PhaseRecord;
+
+typedef struct {
+    unsigned id;
+    const char *name;
+    unsigned functions;
+    PhaseRecord phases[PHASE_COUNT];
+    long long retained;         // still live at the end of the job, before disposal
+} JobRecord;
+
+typedef struct {
+    PhaseRecord *record;
+    double start;
+    long maxrss_kb;
+} PhaseScope;
+
+static long maxrss_kb(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static void phase_begin(PhaseScope *scope, JobRecord *job, Phase phase) {
+    scope->record = &job->phases[phase];
+    memset(scope->record, 0, sizeof(*scope->record));
+    scope->maxrss_kb = maxrss_kb();
+    scope->start = now();
+    counting = &scope->record->mem;
+}
+
+static void phase_end(PhaseScope *scope) {
+    counting = NULL;
+    scope->record->ms = (now() - scope->start) * 1e3;
+    scope->record->rss_delta_kb = maxrss_kb() - scope->maxrss_kb;
+}
+
+static LLVMModuleRef build_module(LLVMContextRef ctx, unsigned functions) {
+    LLVMModuleRef mod = LLVMModuleCreateWithNameInContext("my_module", ctx);
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(ctx);
+    LLVMTypeRef param_types[] = { i32, i32 };
+    LLVMTypeRef fun_type = LLVMFunctionType(i32, param_types, 2, 0);
+    LLVMBuilderRef builder = LLVMCreateBuilderInContext(ctx);
+
+    // sum, then sum_i(a, b) = sum(a, b) * i + sum_{i-1}(b, a)
+    LLVMValueRef sum = LLVMAddFunction(mod, "sum", fun_type);
+    LLVMPositionBuilderAtEnd(builder, LLVMAppendBasicBlockInContext(ctx, sum, "entry"));
+    LLVMBuildRet(builder, LLVMBuildAdd(builder, LLVMGetParam(sum, 0), LLVMGetParam(sum, 1), "tmp"));
+
+    LLVMValueRef previous = sum;
+    for (unsigned i = 1; i < functions; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "sum_%u", i);
+        LLVMValueRef fun = LLVMAddFunction(mod, name, fun_type);
+        LLVMPositionBuilderAtEnd(builder, LLVMAppendBasicBlockInContext(ctx, fun, "entry"));
+        LLVMValueRef a = LLVMGetParam(fun, 0);
+        LLVMValueRef b = LLVMGetParam(fun, 1);
+        LLVMValueRef direct = LLVMBuildCall2(builder, fun_type, sum, (LLVMValueRef[]) { a, b }, 2, "direct");
+        LLVMValueRef scaled = LLVMBuildMul(builder, direct, LLVMConstInt(i32, i, 0), "scaled");
+        LLVMValueRef chained = LLVMBuildCall2(builder, fun_type, previous, (LLVMValueRef[]) { b, a }, 2, "chained");
+        LLVMBuildRet(builder, LLVMBuildAdd(builder, scaled, chained, "tmp"));
+        previous = fun;
+    }
+    LLVMDisposeBuilder(builder);
+    return mod;
+}
+
+static void run_job(JobRecord *job, LLVMTargetMachineRef tm) {
+    PhaseScope scope;
+    LLVMContextRef ctx = LLVMContextCreate();
+
+    phase_begin(&scope, job, PHASE_BUILD);
+    LLVMModuleRef mod = build_module(ctx, job->functions);
+    phase_end(&scope);
+
+    phase_begin(&scope, job, PHASE_VERIFY);
+    char *error = NULL;
+    int broken = LLVMVerifyModule(mod, LLVMReturnStatusAction, &error);
+    phase_end(&scope);
+    if (broken) {
+        fprintf(stderr, "%s\n", error);
+        exit(1);
+    }
+    LLVMDisposeMessage(error);
+
+    phase_begin(&scope, job, PHASE_OPTIMIZE);
+    LLVMPassBuilderOptionsRef options = LLVMCreatePassBuilderOptions();
+    LLVMErrorRef err = LLVMRunPasses(mod, "default<O2>", tm, options);
+    LLVMDisposePassBuilderOptions(options);
+    phase_end(&scope);
+    if (err) {
+        char *msg = LLVMGetErrorMessage(err);
+        fprintf(stderr, "%s\n", msg);
+        exit(1);
+    }
+
+    phase_begin(&scope, job, PHASE_EMIT);
+    LLVMMemoryBufferRef object;
+    int failed = LLVMTargetMachineEmitToMemoryBuffer(tm, mod, LLVMObjectFile, &error, &object);
+    phase_end(&scope);
+    if (failed) {
+        fprintf(stderr, "%s\n", error);
+        exit(1);
+    }
+
+    job->retained = 0;
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        job->retained += job->phases[p].mem.live;
+    }
+    LLVMDisposeMemoryBuffer(object);
+    LLVMDisposeModule(mod);
+    LLVMContextDispose(ctx);
+}
+
+int main(int argc, char const *argv[]) {
+    // Initialization of the targets
+    LLVMInitializeAllTargets();
+    LLVMInitializeAllTargetMCs();
+    LLVMInitializeAllTargetInfos();
+    LLVMInitializeAllAsmPrinters();
+
+    char triple[] = "x86_64";
+    char *error = NULL;
+    LLVMTargetRef targetRef;
+    if (LLVMGetTargetFromTriple(triple, &targetRef, &error) != 0) {
+        printf("%s\n", error);
+        return 1;
+    }
+    LLVMTargetMachineRef tm = LLVMCreateTargetMachine(targetRef, triple, "", "", LLVMCodeGenLevelDefault, LLVMRelocDefault, LLVMCodeModelDefault);
+
+    JobRecord jobs[] = {
+        { 1, "sum", 1 }, { 2, "sum", 1 },
+        { 3, "sum x100", 100 }, { 4, "sum x100", 100 },
+        { 5, "sum x1000", 1000 }, { 6, "sum x1000", 1000 },
+    };
+    unsigned job_count = sizeof(jobs) / sizeof(jobs[0]);
+    for (unsigned j = 0; j < job_count; j++) {
+        run_job(&jobs[j], tm);
+    }
+    LLVMDisposeTargetMachine(tm);
+
+    FILE *csv = fopen("memacct.csv", "w");
+    if (csv) {
+        fprintf(csv, "job,name,phase,ms,allocs,frees,bytes,peak_live_bytes,peak_rss_delta_kb\n");
+    }
+    printf("%-4s %-10s %-9s %9s %9s %12s %12s %8s\n", "job", "module", "phase", "ms", "allocs", "bytes",
+           "peak live", "rss kB");
+    for (unsigned j = 0; j < job_count; j++) {
+        JobRecord *job = &jobs[j];
+        for (int p = 0; p < PHASE_COUNT; p++) {
+            PhaseRecord *r = &job->phases[p];
+            printf("%-4u %-10s %-9s %9.3f %9lu %12lld %12lld %8ld\n", job->id, job->name, phase_names[p], r->ms,
+                   r->mem.allocs, r->mem.bytes, r->mem.peak, r->rss_delta_kb);
+            if (csv) {
+                fprintf(csv, "%u,%s,%s,%.3f,%lu,%lu,%lld,%lld,%ld\n", job->id, job->name, phase_names[p], r->ms,
+                        r->mem.allocs, r->mem.frees, r->mem.bytes, r->mem.peak, r->rss_delta_kb);
+            }
+        }
+        printf("%-4u %-10s retained by the module and object: %lld bytes\n", job->id, job->name, job->retained);
+    }
+    if (csv) {
+        fclose(csv);
+    }
+}
@@ -0,0 +1,66 @@
+#include "memhook.h"
+
+#include <errno.h>
+#include <malloc.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+static void allocated(void *ptr) {
+    if (ptr) {
+        count_alloc(ptr, malloc_usable_size(ptr));
+    }
+}
+
+static void freed(void *ptr) {
+    if (ptr) {
+        count_free(ptr, malloc_usable_size(ptr));
+    }
+}
+
+void *malloc(size_t size) {
+    void *ptr = __libc_malloc(size);
+    allocated(ptr);
+    return ptr;
+}
+
+void *calloc(size_t count, size_t size) {
+    void *ptr = __libc_calloc(count, size);
+    allocated(ptr);
+    return ptr;
+}
+
+void *realloc(void *ptr, size_t size) {
+    freed(ptr);
+    void *moved = __libc_realloc(ptr, size);
+    allocated(moved ? moved : (size ? ptr : NULL));
+    return moved;
+}
+
+void free(void *ptr) {
+    freed(ptr);
+    __libc_free(ptr);
+}
+
+// Aligned operator new goes through these
+void *memalign(size_t alignment, size_t size) {
+    void *ptr = __libc_memalign(alignment, size);
+    allocated(ptr);
+    return ptr;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+int posix_memalign(void **out, size_t alignment, size_t size) {
+    void *ptr = memalign(alignment, size);
+    if (!ptr) {
+        return ENOMEM;
+    }
+    *out = ptr;
+    return 0;
+}
@@ -0,0 +1,22 @@
+/**
+ * Interposition of the C allocator, for the programs counting allocations.
+ *
+ * memhook.c defines malloc, calloc, realloc, free, memalign, aligned_alloc
+ * and posix_memalign. Linked into a program, these take precedence over
+ * the C library for the whole process, libLLVM included, and forward to
+ * glibc's __libc_* entry points. Every block allocated or freed is reported
+ * to the two hooks below, which the program defines.
+ */
+
+#ifndef MEMHOOK_H
+#define MEMHOOK_H
+
+#include <stddef.h>
+
+// ptr is never NULL, size is its malloc_usable_size(). A realloc() is
+// reported as the free of the old block and the allocation of the new one.
+// The hooks run inside the allocator: they must not allocate.
+void count_alloc(void *ptr, size_t size);
+void count_free(void *ptr, size_t size);
+
+#endif
@@ -0,0 +1,161 @@
+/**
+ * The sum of sum.c compiled over and over, with the raw LLVM-C calls and
+ * with the owners of llvm_handles.hpp:
+ *
+ * int sum(int a, int b) {
+ *     return a + b;
+ * }
+ *
+ * Every iteration creates its context, module and builder, looks up the
+ * types that Types looks up, builds and verifies sum and, in the emit
+ * rounds, generates the object in memory with a target machine shared by
+ * all iterations. The only work the owners add is the function type kept
+ * by Types, one small allocation per context. The report gives the time
+ * per iteration of both versions, which should be the same, and the
+ * resident memory after each round, which should not grow. Built with
+ * -O2, as the owners are only free once inlined.
+ */
+
+#include "llvm_handles.hpp"
+#include "measure.h"
+
+#include <llvm-c/Core.h>
+#include <llvm-c/Analysis.h>
+#include <llvm-c/Target.h>
+#include <llvm-c/TargetMachine.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace llvm_handles;
+
+// ======================================================
+// Raw LLVM-C
+// ======================================================
+
+static size_t compile_raw(LLVMTargetMachineRef tm) {
+    LLVMContextRef ctx = LLVMContextCreate();
+    LLVMModuleRef mod = LLVMModuleCreateWithNameInContext("my_module", ctx);
+    LLVMBuilderRef builder = LLVMCreateBuilderInContext(ctx);
+
+    // The lookups of Types, so that both versions do the same work
+    LLVMTypeRef i1 = LLVMInt1TypeInContext(ctx);
+    LLVMTypeRef i8 = LLVMInt8TypeInContext(ctx);
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(ctx);
+    LLVMTypeRef i64 = LLVMInt64TypeInContext(ctx);
+    LLVMTypeRef f64 = LLVMDoubleTypeInContext(ctx);
+    (void) i1, (void) i8, (void) i64, (void) f64;
+    LLVMTypeRef param_types[] = { i32, i32 };
+    LLVMValueRef sum = LLVMAddFunction(mod, "sum", LLVMFunctionType(i32, param_types, 2, 0));
+    LLVMPositionBuilderAtEnd(builder, LLVMAppendBasicBlockInContext(ctx, sum, "entry"));
+    LLVMBuildRet(builder, LLVMBuildAdd(builder, LLVMGetParam(sum, 0), LLVMGetParam(sum, 1), "tmp"));
+
+    size_t size = 0;
+    if (LLVMVerifyFunction(sum, LLVMReturnStatusAction)) {
+        fprintf(stderr, "sum does not verify\n");
+        exit(1);
+    }
+    if (tm) {
+        char *error = NULL;
+        LLVMMemoryBufferRef object;
+        if (LLVMTargetMachineEmitToMemoryBuffer(tm, mod, LLVMObjectFile, &error, &object) != 0) {
+            fprintf(stderr, "%s\n", error);
+            exit(1);
+        }
+        size = LLVMGetBufferSize(object);
+        LLVMDisposeMemoryBuffer(object);
+    }
+
+    LLVMDisposeBuilder(builder);
+    LLVMDisposeModule(mod);
+    LLVMContextDispose(ctx);
+    return size;
+}
+
+// ======================================================
+// Owners
+// ======================================================
+
+static size_t compile_owned(LLVMTargetMachineRef tm) {
+    Context ctx = make_context();
+    Module mod = make_module("my_module", ctx);
+    Builder builder = make_builder(ctx);
+    Types types(ctx);
+
+    LLVMTypeRef param_types[] = { types.i32(), types.i32() };
+    LLVMValueRef sum = LLVMAddFunction(mod, "sum", types.function(types.i32(), param_types, 2));
+    LLVMPositionBuilderAtEnd(builder, LLVMAppendBasicBlockInContext(ctx, sum, "entry"));
+    LLVMBuildRet(builder, LLVMBuildAdd(builder, LLVMGetParam(sum, 0), LLVMGetParam(sum, 1), "tmp"));
+
+    if (LLVMVerifyFunction(sum, LLVMReturnStatusAction)) {
+        fprintf(stderr, "sum does not verify\n");
+        exit(1);
+    }
+    if (!tm) {
+        return 0;
+    }
+    Message error;
+    MemoryBuffer object;
+    if (LLVMTargetMachineEmitToMemoryBuffer(tm, mod, LLVMObjectFile, error.out(), object.out()) != 0) {
+        fprintf(stderr, "%s\n", error.get());
+        exit(1);
+    }
+    return LLVMGetBufferSize(object);
+}
+
+// ======================================================
+// Benchmark
+// ======================================================
+
+typedef size_t (*CompileFn)(LLVMTargetMachineRef tm);
+
+static double round_ns(CompileFn compile, LLVMTargetMachineRef tm, long iterations) {
+    size_t bytes = 0;
+    double start = now();
+    for (long i = 0; i < iterations; i++) {
+        bytes += compile(tm);
+    }
+    double elapsed = now() - start;
+    if (tm && bytes == 0) {
+        fprintf(stderr, "no object emitted\n");
+        exit(1);
+    }
+    return elapsed * 1e9 / iterations;
+}
+
+static void compare(const char *label, LLVMTargetMachineRef tm, long iterations) {
+    // Alternated rounds, best of each
+    double raw = 0, owned = 0;
+    for (int r = 0; r < 3; r++) {
+        double t = round_ns(compile_raw, tm, iterations);
+        raw = r == 0 || t < raw ? t : raw;
+        long raw_kb = resident_kb();
+        t = round_ns(compile_owned, tm, iterations);
+        owned = r == 0 || t < owned ? t : owned;
+        printf("  %s round %d: resident %ld kB after raw, %ld kB after owners\n", label, r, raw_kb, resident_kb());
+    }
+    printf("%-12s %ld iterations: raw %9.0f ns, owners %9.0f ns (%+.1f%%)\n", label, iterations, raw, owned,
+           100.0 * (owned - raw) / raw);
+}
+
+int main(int argc, char const *argv[]) {
+    long iterations = argc > 1 ? atol(argv[1]) : 20000;
+
+    LLVMInitializeAllTargets();
+    LLVMInitializeAllTargetMCs();
+    LLVMInitializeAllTargetInfos();
+    LLVMInitializeAllAsmPrinters();
+
+    char triple[] = "x86_64";
+    Message error;
+    LLVMTargetRef targetRef;
+    if (LLVMGetTargetFromTriple(triple, &targetRef, error.out()) != 0) {
+        printf("%s\n", error.get());
+        return 1;
+    }
+    TargetMachine tm(LLVMCreateTargetMachine(targetRef, triple, "", "", LLVMCodeGenLevelNone, LLVMRelocDefault, LLVMCodeModelDefault));
+
+    printf("resident at start: %ld kB\n", resident_kb());
+    compare("build", NULL, iterations * 10);
+    compare("build+emit", tm, iterations);
+}
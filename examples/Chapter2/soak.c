@@ -0,0 +1,193 @@
+/**
+ * Soak test of the sequence of sum.c, repeated until leaks and slowdowns
+ * show up:
+ *
+ * int sum(int a, int b) {
+ *     return a + b;
+ * }
+ *
+ * Every iteration does what sum.c does once: context, module and builder,
+ * sum, verification, target lookup and target machine, object emitted in
+ * memory, and everything disposed. The iterations are grouped in windows;
+ * at the end of each window the resident memory, the heap in use and the
+ * allocations made (malloc is interposed and counted) are sampled, and the
+ * latency percentiles of the window computed.
+ *
+ * The first window is warm-up and the second is the baseline. The run
+ * fails, exit status 1, as soon as a later window drifts past the
+ * thresholds: resident memory or live heap above the baseline by more than
+ * RSS_DRIFT_KB or HEAP_DRIFT_BYTES, allocations per iteration off by more
+ * than ALLOC_DRIFT, or a median latency LATENCY_DRIFT times the baseline
+ * in two windows in a row.
+ *
+ * usage: soak [iterations [window]], 2000000 iterations of 10000 by default
+ */
+
+#include "measure.h"
+#include "memhook.h"
+
+#include <llvm-c/Core.h>
+#include <llvm-c/Analysis.h>
+#include <llvm-c/Target.h>
+#include <llvm-c/TargetMachine.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define RSS_DRIFT_KB 8192
+#define HEAP_DRIFT_BYTES (256 * 1024)
+#define ALLOC_DRIFT 0.01
+#define LATENCY_DRIFT 1.5
+
+// ======================================================
+// Allocation counting
+// ======================================================
+
+static unsigned long allocations;
+static long long live_bytes;
+
+void count_alloc(void *ptr, size_t size) {
+    (void) ptr;
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&live_bytes, size, __ATOMIC_RELAXED);
+}
+
+void count_free(void *ptr, size_t size) {
+    (void) ptr;
+    __atomic_fetch_sub(&live_bytes, size, __ATOMIC_RELAXED);
+}
+
+// ======================================================
+// One iteration
+// ======================================================
+
+static void compile_sum(void) {
+    LLVMContextRef ctx = LLVMContextCreate();
+    LLVMModuleRef mod = LLVMModuleCreateWithNameInContext("my_module", ctx);
+    LLVMBuilderRef builder = LLVMCreateBuilderInContext(ctx);
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(ctx);
+    LLVMTypeRef param_types[] = { i32, i32 };
+    LLVMValueRef sum = LLVMAddFunction(mod, "sum", LLVMFunctionType(i32, param_types, 2, 0));
+    LLVMPositionBuilderAtEnd(builder, LLVMAppendBasicBlockInContext(ctx, sum, "entry"));
+    LLVMBuildRet(builder, LLVMBuildAdd(builder, LLVMGetParam(sum, 0), LLVMGetParam(sum, 1), "tmp"));
+    LLVMDisposeBuilder(builder);
+
+    if (LLVMVerifyFunction(sum, LLVMReturnStatusAction)) {
+        fprintf(stderr, "sum does not verify\n");
+        exit(1);
+    }
+
+    char triple[] = "x86_64";
+    char *error = NULL;
+    LLVMTargetRef targetRef;
+    if (LLVMGetTargetFromTriple(triple, &targetRef, &error) != 0) {
+        fprintf(stderr, "%s\n", error);
+        exit(1);
+    }
+    LLVMTargetMachineRef tm = LLVMCreateTargetMachine(targetRef, triple, "", "", LLVMCodeGenLevelNone, LLVMRelocDefault, LLVMCodeModelDefault);
+    LLVMMemoryBufferRef object;
+    if (LLVMTargetMachineEmitToMemoryBuffer(tm, mod, LLVMObjectFile, &error, &object) != 0) {
+        fprintf(stderr, "%s\n", error);
+        exit(1);
+    }
+
+    LLVMDisposeMemoryBuffer(object);
+    LLVMDisposeTargetMachine(tm);
+    LLVMDisposeModule(mod);
+    LLVMContextDispose(ctx);
+}
+
+// ======================================================
+// Windows and drift
+// ======================================================
+
+typedef struct {
+    long rss_kb;
+    long long heap;
+    double allocs_per_iteration;
+    double p50_us;
+    double p99_us;
+    double max_us;
+} Sample;
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+static void sample_window(double *latencies, long count, unsigned long allocs, Sample *s) {
+    qsort(latencies, count, sizeof(double), compare_doubles);
+    s->rss_kb = resident_kb();
+    s->heap = __atomic_load_n(&live_bytes, __ATOMIC_RELAXED);
+    s->allocs_per_iteration = (double) allocs / count;
+    s->p50_us = latencies[count / 2] * 1e6;
+    s->p99_us = latencies[count * 99 / 100] * 1e6;
+    s->max_us = latencies[count - 1] * 1e6;
+}
+
+// Returns the reason s drifted from the baseline, NULL when it did not
+static const char *drift(const Sample *base, const Sample *previous, const Sample *s) {
+    if (s->rss_kb - base->rss_kb > RSS_DRIFT_KB) {
+        return "resident memory";
+    }
+    if (s->heap - base->heap > HEAP_DRIFT_BYTES) {
+        return "live heap";
+    }
+    double allocs = s->allocs_per_iteration - base->allocs_per_iteration;
+    if (allocs > ALLOC_DRIFT * base->allocs_per_iteration || -allocs > ALLOC_DRIFT * base->allocs_per_iteration) {
+        return "allocations per iteration";
+    }
+    // A single slow window is the machine, not the compiler
+    if (s->p50_us > LATENCY_DRIFT * base->p50_us && previous->p50_us > LATENCY_DRIFT * base->p50_us) {
+        return "median latency";
+    }
+    return NULL;
+}
+
+int main(int argc, char const *argv[]) {
+    long iterations = argc > 1 ? atol(argv[1]) : 2000000;
+    long window = argc > 2 ? atol(argv[2]) : 10000;
+    if (window < 100 || iterations < 3 * window) {
+        fprintf(stderr, "usage: soak [iterations [window]], window >= 100, at least 3 windows\n");
+        return 2;
+    }
+
+    LLVMInitializeAllTargets();
+    LLVMInitializeAllTargetMCs();
+    LLVMInitializeAllTargetInfos();
+    LLVMInitializeAllAsmPrinters();
+
+    double *latencies = malloc(window * sizeof(double));
+    Sample base = { 0 }, previous = { 0 };
+    long windows = iterations / window;
+    printf("%ld windows of %ld iterations\n", windows, window);
+    printf("%8s %10s %12s %10s %9s %9s %9s\n", "window", "rss kB", "heap", "allocs/it", "p50 us", "p99 us", "max us");
+
+    for (long w = 0; w < windows; w++) {
+        unsigned long allocs_before = __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+        for (long i = 0; i < window; i++) {
+            double start = now();
+            compile_sum();
+            latencies[i] = now() - start;
+        }
+        Sample s;
+        sample_window(latencies, window, __atomic_load_n(&allocations, __ATOMIC_RELAXED) - allocs_before, &s);
+        printf("%8ld %10ld %12lld %10.1f %9.1f %9.1f %9.1f\n", w, s.rss_kb, s.heap, s.allocs_per_iteration,
+               s.p50_us, s.p99_us, s.max_us);
+        fflush(stdout);
+
+        if (w == 1) {
+            base = s;
+        } else if (w > 1) {
+            const char *reason = drift(&base, &previous, &s);
+            if (reason) {
+                fprintf(stderr, "FAIL: %s drifted in window %ld (%ld iterations)\n", reason, w, (w + 1) * window);
+                return 1;
+            }
+        }
+        previous = s;
+    }
+    free(latencies);
+    printf("PASS: %ld iterations without drift\n", windows * window);
+    return 0;
+}
@@ -0,0 +1,251 @@
+/**
+ * Split-module parallel code generation of a very large module.
+ *
+ * LLVMTargetMachineEmitToFile, as used by sum.c, compiles a module on a
+ * single core. The module built here holds FUNCTION_COUNT functions in the
+ * style of sum:
+ *
+ * static int f_i(int a, int b) {   // every other function is internal
+ *     int v = a + b;
+ *     v = (v * 31) ^ (v >> 3) ... ; // BODY_STEPS times
+ *     return v + f_{i-1}(v, b) + f_{hash(i) % i}(b, v);
+ * }
+ *
+ * emit_split() hands it to llvm::splitCodeGen, which partitions it with
+ * SplitModule into K pieces, giving the internal functions referenced from
+ * another piece hidden external names so that cross-partition references
+ * still resolve, and runs the code generation of the pieces on K threads.
+ * The K objects are then linked into the single relocatable object
+ * split_llvm.o with ld -r. The report compares K partitions with one.
+ */
+
+#include "measure.h"
+
+#include <llvm-c/Core.h>
+#include <llvm-c/Analysis.h>
+#include <llvm-c/Object.h>
+#include <llvm-c/Target.h>
+
+#include <llvm/CodeGen/ParallelCG.h>
+#include <llvm/IR/Module.h>
+#include <llvm/MC/TargetRegistry.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/Target/TargetOptions.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+
+#define BODY_STEPS 16
+
+extern char **environ;
+
+static const char triple[] = "x86_64";
+
+// ======================================================
+// Module generation
+// ======================================================
+
+static LLVMModuleRef build_module(LLVMContextRef ctx, unsigned count) {
+    LLVMModuleRef mod = LLVMModuleCreateWithNameInContext("my_module", ctx);
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(ctx);
+    LLVMTypeRef param_types[] = { i32, i32 };
+    LLVMTypeRef fun_type = LLVMFunctionType(i32, param_types, 2, 0);
+    LLVMBuilderRef builder = LLVMCreateBuilderInContext(ctx);
+
+    std::vector<LLVMValueRef> funs(count);
+    for (unsigned i = 0; i < count; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "f_%u", i);
+        funs[i] = LLVMAddFunction(mod, name, fun_type);
+        if (i % 2) {
+            LLVMSetLinkage(funs[i], LLVMInternalLinkage);
+        }
+    }
+
+    for (unsigned i = 0; i < count; i++) {
+        LLVMValueRef fun = funs[i];
+        LLVMPositionBuilderAtEnd(builder, LLVMAppendBasicBlockInContext(ctx, fun, "entry"));
+        LLVMValueRef a = LLVMGetParam(fun, 0);
+        LLVMValueRef b = LLVMGetParam(fun, 1);
+        LLVMValueRef v = LLVMBuildAdd(builder, a, b, "tmp");
+        for (unsigned s = 0; s < BODY_STEPS; s++) {
+            LLVMValueRef scaled = LLVMBuildMul(builder, v, LLVMConstInt(i32, 31 + i + s, 0), "scaled");
+            LLVMValueRef shifted = LLVMBuildAShr(builder, v, LLVMConstInt(i32, 3, 0), "shifted");
+            v = LLVMBuildXor(builder, scaled, shifted, "v");
+        }
+        if (i > 0) {
+            LLVMValueRef previous[] = { v, b };
+            LLVMValueRef far[] = { b, v };
+            LLVMValueRef p = LLVMBuildCall2(builder, fun_type, funs[i - 1], previous, 2, "previous");
+            LLVMValueRef f = LLVMBuildCall2(builder, fun_type, funs[((i * 2654435761u) >> 7) % i], far, 2, "far");
+            v = LLVMBuildAdd(builder, v, LLVMBuildAdd(builder, p, f, "calls"), "v");
+        }
+        LLVMBuildRet(builder, v);
+    }
+    LLVMDisposeBuilder(builder);
+    return mod;
+}
+
+// ======================================================
+// Split code generation
+// ======================================================
+
+static std::unique_ptr<llvm::TargetMachine> create_target_machine(void) {
+    std::string error;
+    const llvm::Target *target = llvm::TargetRegistry::lookupTarget(triple, error);
+    if (!target) {
+        fprintf(stderr, "%s\n", error.c_str());
+        exit(1);
+    }
+    return std::unique_ptr<llvm::TargetMachine>(target->createTargetMachine(
+        triple, "", "", llvm::TargetOptions(), llvm::Reloc::PIC_, llvm::None, llvm::CodeGenOpt::Default));
+}
+
+static int run(const char *const *args) {
+    pid_t pid;
+    if (posix_spawnp(&pid, args[0], NULL, NULL, (char *const *) args, environ) != 0) {
+        perror(args[0]);
+        return -1;
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+struct SplitTimes {
+    double codegen_ms;
+    double link_ms;
+};
+
+/**
+ * Emits mod as the relocatable object output, generating code for
+ * partitions pieces in parallel. mod is modified by the split (internal
+ * symbols referenced across pieces are externalized). Returns 0 on success.
+ */
+static int emit_split(LLVMModuleRef mod, unsigned partitions, const char *output, SplitTimes *times) {
+    std::vector<std::string> names;
+    std::vector<std::unique_ptr<llvm::raw_fd_ostream>> files;
+    std::vector<llvm::raw_pwrite_stream *> streams;
+    for (unsigned k = 0; k < partitions; k++) {
+        names.push_back(partitions == 1 ? std::string(output) : "split_" + std::to_string(k) + ".o");
+        std::error_code ec;
+        files.push_back(std::make_unique<llvm::raw_fd_ostream>(names.back(), ec));
+        if (ec) {
+            fprintf(stderr, "%s: %s\n", names.back().c_str(), ec.message().c_str());
+            return 1;
+        }
+        streams.push_back(files.back().get());
+    }
+
+    double start = now();
+    llvm::splitCodeGen(*llvm::unwrap(mod), streams, {}, create_target_machine, llvm::CGFT_ObjectFile);
+    files.clear();
+    times->codegen_ms = (now() - start) * 1e3;
+
+    // One partition is already the final object
+    times->link_ms = 0;
+    if (partitions == 1) {
+        return 0;
+    }
+    std::vector<const char *> args = { "ld", "-r", "-o", output };
+    for (const std::string &name : names) {
+        args.push_back(name.c_str());
+    }
+    args.push_back(NULL);
+    start = now();
+    int status = run(args.data());
+    times->link_ms = (now() - start) * 1e3;
+    for (const std::string &name : names) {
+        remove(name.c_str());
+    }
+    return status;
+}
+
+// Defined f_i symbols of the object, every function must be there once
+static unsigned count_functions(const char *filename) {
+    char *error = NULL;
+    LLVMMemoryBufferRef buffer;
+    if (LLVMCreateMemoryBufferWithContentsOfFile(filename, &buffer, &error)) {
+        fprintf(stderr, "%s\n", error);
+        LLVMDisposeMessage(error);
+        return 0;
+    }
+    LLVMBinaryRef binary = LLVMCreateBinary(buffer, NULL, &error);
+    if (!binary) {
+        fprintf(stderr, "%s\n", error);
+        LLVMDisposeMessage(error);
+        LLVMDisposeMemoryBuffer(buffer);
+        return 0;
+    }
+    unsigned count = 0;
+    LLVMSymbolIteratorRef symbol = LLVMObjectFileCopySymbolIterator(binary);
+    for (; !LLVMObjectFileIsSymbolIteratorAtEnd(binary, symbol); LLVMMoveToNextSymbol(symbol)) {
+        const char *name = LLVMGetSymbolName(symbol);
+        count += name && strncmp(name, "f_", 2) == 0 && LLVMGetSymbolSize(symbol) > 0;
+    }
+    LLVMDisposeSymbolIterator(symbol);
+    LLVMDisposeBinary(binary);
+    LLVMDisposeMemoryBuffer(buffer);
+    return count;
+}
+
+static SplitTimes measure(unsigned count, unsigned partitions) {
+    LLVMContextRef ctx = LLVMContextCreate();
+    LLVMModuleRef mod = build_module(ctx, count);
+    LLVMSetTarget(mod, triple);
+
+    //Analysis
+    char *error = NULL;
+    if (LLVMVerifyModule(mod, LLVMReturnStatusAction, &error)) {
+        fprintf(stderr, "%s\n", error);
+        exit(1);
+    }
+    LLVMDisposeMessage(error);
+
+    SplitTimes times;
+    if (emit_split(mod, partitions, "split_llvm.o", &times) != 0) {
+        fprintf(stderr, "could not emit split_llvm.o\n");
+        exit(1);
+    }
+    unsigned found = count_functions("split_llvm.o");
+    if (found != count) {
+        fprintf(stderr, "split_llvm.o defines %u functions out of %u\n", found, count);
+        exit(1);
+    }
+    LLVMDisposeModule(mod);
+    LLVMContextDispose(ctx);
+    return times;
+}
+
+int main(int argc, char const *argv[]) {
+    unsigned count = argc > 1 ? (unsigned) atoi(argv[1]) : 5000;
+    unsigned partitions = argc > 2 ? (unsigned) atoi(argv[2]) : std::max(2u, std::thread::hardware_concurrency());
+    if (partitions == 0) {
+        fprintf(stderr, "usage: splitcg [functions [partitions]], at least 1 partition\n");
+        return 1;
+    }
+
+    // Initialization of the targets
+    LLVMInitializeAllTargets();
+    LLVMInitializeAllTargetMCs();
+    LLVMInitializeAllTargetInfos();
+    LLVMInitializeAllAsmPrinters();
+
+    printf("%u functions, %u hardware threads\n", count, std::thread::hardware_concurrency());
+    SplitTimes single = measure(count, 1);
+    printf("1 partition:   codegen %9.2f ms\n", single.codegen_ms);
+    SplitTimes split = measure(count, partitions);
+    double total = split.codegen_ms + split.link_ms;
+    printf("%u partitions: codegen %9.2f ms, ld -r %.2f ms\n", partitions, split.codegen_ms, split.link_ms);
+    printf("speedup: %.2fx (%.2fx without the link)\n", single.codegen_ms / total, single.codegen_ms / split.codegen_ms);
+}
@@ -14,25 +14,52 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+// IR names in debug builds only, see Chapter1/lean.c
+#ifdef NDEBUG
+#define IR_NAME(name) ""
+#else
+#define IR_NAME(name) name
+#endif
 
 int main(int argc, char const *argv[]) {
+#ifdef NDEBUG
+    LLVMContextSetDiscardValueNames(LLVMGetGlobalContext(), 1);
+#endif
+
     // Module creation
-    LLVMModuleRef mod = LLVMModuleCreateWithName("my_module");
+    LLVMModuleRef mod = LLVMModuleCreateWithName(IR_NAME("my_module"));
 
     // Function prototype creation
     LLVMTypeRef param_types[] = { LLVMInt32Type(), LLVMInt32Type() };
     LLVMTypeRef ret_type = LLVMFunctionType(LLVMInt32Type(), param_types, 2, 0);
     LLVMValueRef sum = LLVMAddFunction(mod, "sum", ret_type);
-    LLVMBasicBlockRef entry = LLVMAppendBasicBlock(sum, "entry");
+    LLVMBasicBlockRef entry = LLVMAppendBasicBlock(sum, IR_NAME("entry"));
 
     // Builder creation
     LLVMBuilderRef builder = LLVMCreateBuilder();
     LLVMPositionBuilderAtEnd(builder, entry);
 
     // Instruction added to the builder
-    LLVMValueRef tmp = LLVMBuildAdd(builder, LLVMGetParam(sum, 0), LLVMGetParam(sum, 1), "tmp");
+    LLVMValueRef tmp = LLVMBuildAdd(builder, LLVMGetParam(sum, 0), LLVMGetParam(sum, 1), IR_NAME("tmp"));
     LLVMBuildRet(builder, tmp);
 
+    //Analysis, of the finished function only. A broken function is reported
+    //instead of aborting the process; --trusted skips the verification for a
+    //generator known to be correct.
+    int trusted = argc > 1 && strcmp(argv[1], "--trusted") == 0;
+    if (!trusted && LLVMVerifyFunction(sum, LLVMReturnStatusAction)) {
+        // Only the module verifier describes the problem
+        char *error = NULL;
+        LLVMVerifyModule(mod, LLVMReturnStatusAction, &error);
+        fprintf(stderr, "sum: %s\n", error);
+        LLVMDisposeMessage(error);
+        LLVMDisposeBuilder(builder);
+        LLVMDisposeModule(mod);
+        return 1;
+    }
+
     // Choosing the triple
     char triple[] = "x86_64";
     // char* triple = LLVMGetDefaultTargetTriple(); // Using the triple of your machine
@@ -55,11 +82,15 @@ int main(int argc, char const *argv[]) {
     // ======================================================
 
     // Generating the target machine
-    char** errPtrTriple;
-    LLVMBool resTriple = LLVMGetTargetFromTriple(triple, &targetRef, errPtrTriple);
+    char *error = NULL;
+    LLVMBool resTriple = LLVMGetTargetFromTriple(triple, &targetRef, &error);
     if (resTriple != 0)
     {
-        printf("%s\n",*errPtrTriple);
+        printf("%s\n",error);
+        LLVMDisposeMessage(error);
+        LLVMDisposeBuilder(builder);
+        LLVMDisposeModule(mod);
+        return 1;
     }
 
     // LLVMCreateTargetMachine() signature
@@ -77,29 +108,25 @@ int main(int argc, char const *argv[]) {
     // Bitcode writing to file
     // LLVMTargetMachineEmitToFile() signature
     // LLVMTargetMachineEmitToFile(LLVMTargetMachineRef T, LLVMModuleRef M, char* filename, LLVMCodeGenFileType codegen, char** ErrorMessage)
-    char** errPtrFileObj;
-    LLVMBool resFileObj = LLVMTargetMachineEmitToFile(targetMachineRef, mod, "sum_llvm.o", LLVMObjectFile, errPtrFileObj);
+    LLVMBool resFileObj = LLVMTargetMachineEmitToFile(targetMachineRef, mod, "sum_llvm.o", LLVMObjectFile, &error);
     if (resFileObj != 0)
     {
-        printf("%s\n",*errPtrFileObj);
+        printf("%s\n",error);
+        LLVMDisposeMessage(error);
     }
 
-    char** errPtrFileAsm;
-    LLVMBool resFileAsm = LLVMTargetMachineEmitToFile(targetMachineRef, mod, "sum_llvm.asm", LLVMAssemblyFile, errPtrFileAsm);
+    LLVMBool resFileAsm = LLVMTargetMachineEmitToFile(targetMachineRef, mod, "sum_llvm.asm", LLVMAssemblyFile, &error);
     if (resFileAsm != 0)
     {
-        printf("%s\n",*errPtrFileAsm);
+        printf("%s\n",error);
+        LLVMDisposeMessage(error);
     }
 
     // // Bitcode writing to memory buffer
     // // LLVMTargetMachineEmitToMemoryBuffer(LLVMTargetMachineRef T, LLVMModuleRef M, LLVMCodeGenFileType codegen, char** ErrorMessage, LLVMMemoryBufferRef OutMemBuf)
-    // char** errPtrMem;
-    // LLVMTargetMachineEmitToMemoryBuffer(targetMachineRef, mod, LLVMObjectFile, errPtrMem, &mem);
-
-    //Analysis
-    char *error = NULL;
-    LLVMVerifyModule(mod, LLVMAbortProcessAction, &error);
-    LLVMDisposeMessage(error);
+    // LLVMTargetMachineEmitToMemoryBuffer(targetMachineRef, mod, LLVMObjectFile, &error, &mem);
 
+    LLVMDisposeTargetMachine(targetMachineRef);
     LLVMDisposeBuilder(builder);
+    LLVMDisposeModule(mod);
 }
@@ -0,0 +1,266 @@
+/**
+ * ThinLTO over independently generated modules. Each unit_i module is
+ * built the way Chapter 1 builds sum, in its own context:
+ *
+ * int scale_i(int a)  { return a * (i + 2) + 1; }
+ * int entry_i(int a)  { return sum(scale_i(a), scale_{i+1}(a)); }
+ * int sum(int a, int b) (local copy, linkonce_odr)
+ *
+ * so every entry point calls a helper that lives in the next module. The
+ * modules are written as bitcode carrying a summary index and a module
+ * hash. The import decisions are computed from the combined summaries
+ * only, the backends (import, optimize, codegen) run in parallel per
+ * module, and the objects are cached by module hash: rebuilding after one
+ * module changed only recompiles that module and its importers.
+ */
+
+#include "measure.h"
+
+#include <llvm-c/Core.h>
+#include <llvm-c/Analysis.h>
+#include <llvm-c/Support.h>
+#include <llvm-c/Target.h>
+#include <llvm-c/TargetMachine.h>
+
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Analysis/ModuleSummaryAnalysis.h>
+#include <llvm/Analysis/ProfileSummaryInfo.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/ModuleSummaryIndex.h>
+#include <llvm/LTO/legacy/ThinLTOCodeGenerator.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Transforms/IPO/FunctionImport.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static const char triple[] = "x86_64";
+static const char cache_dir[] = "thinlto.cache";
+
+// ======================================================
+// Module generation
+// ======================================================
+
+static LLVMValueRef declare(LLVMModuleRef mod, const char *name, unsigned arity) {
+    LLVMValueRef fun = LLVMGetNamedFunction(mod, name);
+    if (fun) {
+        return fun;
+    }
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(LLVMGetModuleContext(mod));
+    LLVMTypeRef param_types[] = { i32, i32 };
+    return LLVMAddFunction(mod, name, LLVMFunctionType(i32, param_types, arity, 0));
+}
+
+static LLVMModuleRef build_unit(LLVMContextRef ctx, LLVMTargetMachineRef tm, int index, int count, int salt) {
+    char name[32], scale_name[32], next_scale_name[32], entry_name[32];
+    snprintf(name, sizeof(name), "unit_%d", index);
+    snprintf(scale_name, sizeof(scale_name), "scale_%d", index);
+    snprintf(next_scale_name, sizeof(next_scale_name), "scale_%d", (index + 1) % count);
+    snprintf(entry_name, sizeof(entry_name), "entry_%d", index);
+
+    LLVMModuleRef mod = LLVMModuleCreateWithNameInContext(name, ctx);
+    LLVMSetTarget(mod, triple);
+    LLVMTargetDataRef data_layout = LLVMCreateTargetDataLayout(tm);
+    LLVMSetModuleDataLayout(mod, data_layout);
+    LLVMDisposeTargetData(data_layout);
+
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(ctx);
+    LLVMBuilderRef builder = LLVMCreateBuilderInContext(ctx);
+
+    // Shared helper, every module carries its own copy
+    LLVMValueRef sum = declare(mod, "sum", 2);
+    LLVMSetLinkage(sum, LLVMLinkOnceODRLinkage);
+    LLVMPositionBuilderAtEnd(builder, LLVMAppendBasicBlockInContext(ctx, sum, "entry"));
+    LLVMBuildRet(builder, LLVMBuildAdd(builder, LLVMGetParam(sum, 0), LLVMGetParam(sum, 1), "tmp"));
+
+    LLVMValueRef scale = declare(mod, scale_name, 1);
+    LLVMPositionBuilderAtEnd(builder, LLVMAppendBasicBlockInContext(ctx, scale, "entry"));
+    LLVMValueRef scaled = LLVMBuildMul(builder, LLVMGetParam(scale, 0), LLVMConstInt(i32, index + 2 + salt, 0), "scaled");
+    LLVMBuildRet(builder, LLVMBuildAdd(builder, scaled, LLVMConstInt(i32, 1, 0), "tmp"));
+
+    LLVMValueRef next_scale = declare(mod, next_scale_name, 1);
+    LLVMValueRef entry = declare(mod, entry_name, 1);
+    LLVMPositionBuilderAtEnd(builder, LLVMAppendBasicBlockInContext(ctx, entry, "entry"));
+    LLVMValueRef arg = LLVMGetParam(entry, 0);
+    LLVMValueRef local = LLVMBuildCall2(builder, LLVMGlobalGetValueType(scale), scale, &arg, 1, "local");
+    LLVMValueRef remote = LLVMBuildCall2(builder, LLVMGlobalGetValueType(next_scale), next_scale, &arg, 1, "remote");
+    LLVMValueRef sum_args[] = { local, remote };
+    LLVMBuildRet(builder, LLVMBuildCall2(builder, LLVMGlobalGetValueType(sum), sum, sum_args, 2, "tmp"));
+
+    LLVMDisposeBuilder(builder);
+    return mod;
+}
+
+// Bitcode with the per-module summary and the module hash the cache keys on
+static std::string write_summary_bitcode(LLVMModuleRef mod) {
+    llvm::Module *module = llvm::unwrap(mod);
+    llvm::ProfileSummaryInfo profile(*module);
+    llvm::ModuleSummaryIndex index = llvm::buildModuleSummaryIndex(*module, nullptr, &profile);
+    std::string buffer;
+    llvm::raw_string_ostream os(buffer);
+    llvm::WriteBitcodeToFile(*module, os, false, &index, true);
+    os.flush();
+    return buffer;
+}
+
+// ======================================================
+// ThinLTO driver
+// ======================================================
+
+struct Unit {
+    std::string name;
+    std::string bitcode;
+};
+
+static void add_units(llvm::ThinLTOCodeGenerator &codegen, const std::vector<Unit> &units) {
+    for (const Unit &unit : units) {
+        codegen.addModule(unit.name, unit.bitcode);
+    }
+    for (size_t i = 0; i < units.size(); i++) {
+        codegen.preserveSymbol("entry_" + std::to_string(i));
+    }
+}
+
+// Import decisions, computed from the combined summary index alone
+static void report_imports(const std::vector<Unit> &units, const std::map<uint64_t, std::string> &names) {
+    llvm::ThinLTOCodeGenerator codegen;
+    add_units(codegen, units);
+    std::unique_ptr<llvm::ModuleSummaryIndex> index = codegen.linkCombinedIndex();
+    if (!index) {
+        fprintf(stderr, "could not link the combined summary index\n");
+        exit(1);
+    }
+
+    llvm::StringMap<llvm::GVSummaryMapTy> defined;
+    index->collectDefinedGVSummariesPerModule(defined);
+    llvm::StringMap<llvm::FunctionImporter::ImportMapTy> imports;
+    llvm::StringMap<llvm::FunctionImporter::ExportSetTy> exports;
+    llvm::ComputeCrossModuleImport(*index, defined, imports, exports);
+
+    for (const Unit &unit : units) {
+        printf("  %s imports:", unit.name.c_str());
+        for (const auto &from : imports[unit.name]) {
+            for (uint64_t guid : from.second) {
+                auto name = names.find(guid);
+                printf(" %s (from %s)", name == names.end() ? "?" : name->second.c_str(), from.first().str().c_str());
+            }
+        }
+        printf("\n");
+    }
+}
+
+static double run_backends(const std::vector<Unit> &units, size_t *object_bytes) {
+    llvm::ThinLTOCodeGenerator codegen;
+    codegen.setCacheDir(cache_dir);
+    codegen.setOptLevel(2);
+    codegen.setCodeGenOptLevel(llvm::CodeGenOpt::Default);
+    add_units(codegen, units);
+
+    double start = now();
+    codegen.run();
+    double elapsed = now() - start;
+
+    *object_bytes = 0;
+    std::vector<std::unique_ptr<llvm::MemoryBuffer>> &objects = codegen.getProducedBinaries();
+    for (size_t i = 0; i < objects.size(); i++) {
+        if (!objects[i]) {
+            fprintf(stderr, "no object produced for %s\n", units[i].name.c_str());
+            exit(1);
+        }
+        *object_bytes += objects[i]->getBufferSize();
+
+        char filename[64];
+        snprintf(filename, sizeof(filename), "thinlto_%zu.o", i);
+        std::error_code ec;
+        llvm::raw_fd_ostream out(filename, ec);
+        if (ec) {
+            fprintf(stderr, "%s: %s\n", filename, ec.message().c_str());
+            continue;
+        }
+        out << objects[i]->getBuffer();
+    }
+    return elapsed;
+}
+
+int main(int argc, char const *argv[]) {
+    int count = argc > 1 ? atoi(argv[1]) : 16;
+    const char *threads = argc > 2 ? argv[2] : NULL;
+    if (count < 1) {
+        fprintf(stderr, "usage: thinlto [units [threads]], at least 1 unit\n");
+        return 1;
+    }
+
+    // Initialization of the targets
+    LLVMInitializeAllTargets();
+    LLVMInitializeAllTargetMCs();
+    LLVMInitializeAllTargetInfos();
+    LLVMInitializeAllAsmPrinters();
+
+    // Backend parallelism, all hardware threads unless given
+    if (threads) {
+        std::string option = std::string("-threads=") + threads;
+        const char *args[] = { "thinlto", option.c_str() };
+        LLVMParseCommandLineOptions(2, args, NULL);
+    }
+
+    // Generating the target machine, for the data layout of the modules
+    char *error = NULL;
+    LLVMTargetRef targetRef;
+    if (LLVMGetTargetFromTriple(triple, &targetRef, &error) != 0) {
+        printf("%s\n", error);
+        return 1;
+    }
+    LLVMTargetMachineRef targetMachineRef = LLVMCreateTargetMachine(targetRef, triple, "", "", LLVMCodeGenLevelDefault, LLVMRelocPIC, LLVMCodeModelDefault);
+
+    // Each module is built and serialized on its own, like separate requests
+    std::vector<Unit> units;
+    std::map<uint64_t, std::string> names;
+    for (int i = 0; i < count; i++) {
+        LLVMContextRef ctx = LLVMContextCreate();
+        LLVMModuleRef mod = build_unit(ctx, targetMachineRef, i, count, 0);
+        if (LLVMVerifyModule(mod, LLVMReturnStatusAction, &error)) {
+            printf("%s\n", error);
+            return 1;
+        }
+        LLVMDisposeMessage(error);
+        for (LLVMValueRef fun = LLVMGetFirstFunction(mod); fun; fun = LLVMGetNextFunction(fun)) {
+            names[llvm::GlobalValue::getGUID(LLVMGetValueName(fun))] = LLVMGetValueName(fun);
+        }
+        size_t length;
+        const char *identifier = LLVMGetModuleIdentifier(mod, &length);
+        units.push_back({ std::string(identifier, length), write_summary_bitcode(mod) });
+        LLVMDisposeModule(mod);
+        LLVMContextDispose(ctx);
+    }
+
+    printf("import decisions:\n");
+    report_imports(units, names);
+
+    // Start from an empty cache so that the first run compiles everything
+    llvm::sys::fs::remove_directories(cache_dir);
+    llvm::sys::fs::create_directories(cache_dir);
+
+    size_t bytes;
+    double cold = run_backends(units, &bytes);
+    printf("cold build:    %.2f ms, %zu object bytes\n", cold * 1e3, bytes);
+    double warm = run_backends(units, &bytes);
+    printf("cached build:  %.2f ms (%.1fx)\n", warm * 1e3, cold / warm);
+
+    // Change unit_0 only: it and unit_{count-1}, which imports scale_0, rebuild
+    LLVMContextRef ctx = LLVMContextCreate();
+    LLVMModuleRef changed = build_unit(ctx, targetMachineRef, 0, count, 1);
+    units[0].bitcode = write_summary_bitcode(changed);
+    LLVMDisposeModule(changed);
+    LLVMContextDispose(ctx);
+    double partial = run_backends(units, &bytes);
+    printf("one module changed: %.2f ms (%.1fx)\n", partial * 1e3, cold / partial);
+
+    LLVMDisposeTargetMachine(targetMachineRef);
+}
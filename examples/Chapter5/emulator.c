@@ -0,0 +1,291 @@
+#include "emulator.h"
+
+#include <llvm-c/Analysis.h>
+#include <llvm-c/Object.h>
+#include <llvm-c/Target.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define PAGE_SIZE 4096
+
+// ======================================================
+// Generated code
+// ======================================================
+
+LLVMModuleRef build_sum(LLVMContextRef ctx) {
+    LLVMModuleRef mod = LLVMModuleCreateWithNameInContext("my_module", ctx);
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(ctx);
+    LLVMTypeRef param_types[] = { i32, i32 };
+    LLVMValueRef sum = LLVMAddFunction(mod, "sum", LLVMFunctionType(i32, param_types, 2, 0));
+    LLVMBuilderRef builder = LLVMCreateBuilderInContext(ctx);
+    LLVMPositionBuilderAtEnd(builder, LLVMAppendBasicBlockInContext(ctx, sum, "entry"));
+    LLVMBuildRet(builder, LLVMBuildAdd(builder, LLVMGetParam(sum, 0), LLVMGetParam(sum, 1), "tmp"));
+    LLVMDisposeBuilder(builder);
+    return mod;
+}
+
+LLVMMemoryBufferRef emit_x86_64(LLVMModuleRef mod, LLVMCodeGenOptLevel level, char **error) {
+    static int initialized;
+    if (!initialized) {
+        LLVMInitializeX86TargetInfo();
+        LLVMInitializeX86Target();
+        LLVMInitializeX86TargetMC();
+        LLVMInitializeX86AsmPrinter();
+        initialized = 1;
+    }
+    if (LLVMVerifyModule(mod, LLVMReturnStatusAction, error)) {
+        return NULL;
+    }
+    LLVMDisposeMessage(*error);
+    *error = NULL;
+
+    char triple[] = "x86_64";
+    LLVMTargetRef targetRef;
+    if (LLVMGetTargetFromTriple(triple, &targetRef, error) != 0) {
+        return NULL;
+    }
+    LLVMTargetMachineRef tm = LLVMCreateTargetMachine(targetRef, triple, "", "", level, LLVMRelocDefault, LLVMCodeModelDefault);
+    LLVMMemoryBufferRef object = NULL;
+    if (LLVMTargetMachineEmitToMemoryBuffer(tm, mod, LLVMObjectFile, error, &object) != 0) {
+        object = NULL;
+    }
+    LLVMDisposeTargetMachine(tm);
+    return object;
+}
+
+static int compare_symbols(const void *a, const void *b) {
+    const CodeSymbol *x = a, *y = b;
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+static int is_text(LLVMSectionIteratorRef section) {
+    const char *name = LLVMGetSectionName(section);
+    return name && strcmp(name, ".text") == 0;
+}
+
+int emitted_code_load(LLVMMemoryBufferRef object, EmittedCode *code, char **error) {
+    memset(code, 0, sizeof(*code));
+    LLVMBinaryRef binary = LLVMCreateBinary(object, NULL, error);
+    if (!binary) {
+        return 1;
+    }
+
+    int failed = 0;
+    LLVMSectionIteratorRef section = LLVMObjectFileCopySectionIterator(binary);
+    for (; !LLVMObjectFileIsSectionIteratorAtEnd(binary, section); LLVMMoveToNextSection(section)) {
+        if (!is_text(section)) {
+            continue;
+        }
+        LLVMRelocationIteratorRef relocation = LLVMGetRelocations(section);
+        if (!LLVMIsRelocationIteratorAtEnd(section, relocation)) {
+            *error = LLVMCreateMessage(".text has relocations, the code cannot be mapped as is");
+            failed = 1;
+        }
+        LLVMDisposeRelocationIterator(relocation);
+        code->size = LLVMGetSectionSize(section);
+        code->text = malloc(code->size ? code->size : 1);
+        memcpy(code->text, LLVMGetSectionContents(section), code->size);
+    }
+    LLVMDisposeSectionIterator(section);
+    if (!failed && !code->text) {
+        *error = LLVMCreateMessage("no .text section");
+        failed = 1;
+    }
+
+    // The functions, the defined symbols of .text
+    unsigned capacity = 8;
+    code->symbols = malloc(capacity * sizeof(CodeSymbol));
+    LLVMSymbolIteratorRef symbol = LLVMObjectFileCopySymbolIterator(binary);
+    LLVMSectionIteratorRef containing = LLVMObjectFileCopySectionIterator(binary);
+    for (; !failed && !LLVMObjectFileIsSymbolIteratorAtEnd(binary, symbol); LLVMMoveToNextSymbol(symbol)) {
+        const char *name = LLVMGetSymbolName(symbol);
+        if (!name || name[0] == '\0' || name[0] == '.' || LLVMGetSymbolSize(symbol) == 0) {
+            continue;
+        }
+        LLVMMoveToContainingSection(containing, symbol);
+        if (LLVMObjectFileIsSectionIteratorAtEnd(binary, containing) || !is_text(containing)) {
+            continue;
+        }
+        if (code->symbol_count == capacity) {
+            capacity *= 2;
+            code->symbols = realloc(code->symbols, capacity * sizeof(CodeSymbol));
+        }
+        CodeSymbol *s = &code->symbols[code->symbol_count++];
+        s->name = strdup(name);
+        s->offset = LLVMGetSymbolAddress(symbol);
+        s->size = LLVMGetSymbolSize(symbol);
+    }
+    LLVMDisposeSectionIterator(containing);
+    LLVMDisposeSymbolIterator(symbol);
+    LLVMDisposeBinary(binary);
+
+    if (failed) {
+        emitted_code_dispose(code);
+        return 1;
+    }
+    qsort(code->symbols, code->symbol_count, sizeof(CodeSymbol), compare_symbols);
+    return 0;
+}
+
+const CodeSymbol *emitted_code_find(const EmittedCode *code, const char *name) {
+    for (unsigned i = 0; i < code->symbol_count; i++) {
+        if (strcmp(code->symbols[i].name, name) == 0) {
+            return &code->symbols[i];
+        }
+    }
+    return NULL;
+}
+
+const CodeSymbol *emitted_code_symbol_at(const EmittedCode *code, uint64_t offset) {
+    unsigned low = 0, high = code->symbol_count;
+    while (low < high) {
+        unsigned middle = (low + high) / 2;
+        const CodeSymbol *s = &code->symbols[middle];
+        if (offset < s->offset) {
+            high = middle;
+        } else if (offset >= s->offset + s->size) {
+            low = middle + 1;
+        } else {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+void emitted_code_dispose(EmittedCode *code) {
+    for (unsigned i = 0; i < code->symbol_count; i++) {
+        free(code->symbols[i].name);
+    }
+    free(code->symbols);
+    free(code->text);
+    memset(code, 0, sizeof(*code));
+}
+
+// ======================================================
+// Emulator
+// ======================================================
+
+uc_err emulator_create(const EmittedCode *code, uc_engine **uc) {
+    uc_err err = uc_open(UC_ARCH_X86, UC_MODE_64, uc);
+    if (err != UC_ERR_OK) {
+        return err;
+    }
+    size_t mapped = (code->size + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+    mapped = mapped ? mapped : PAGE_SIZE;
+    err = uc_mem_map(*uc, CODE_ADDRESS, mapped, UC_PROT_READ | UC_PROT_EXEC);
+    if (err == UC_ERR_OK) {
+        err = uc_mem_write(*uc, CODE_ADDRESS, code->text, code->size);
+    }
+    if (err == UC_ERR_OK) {
+        err = uc_mem_map(*uc, STACK_ADDRESS, STACK_SIZE, UC_PROT_READ | UC_PROT_WRITE);
+    }
+    if (err != UC_ERR_OK) {
+        uc_close(*uc);
+        *uc = NULL;
+    }
+    return err;
+}
+
+uc_err emulator_reset_stack(uc_engine *uc) {
+    // At the entry of a function, rsp + 8 is 16-byte aligned
+    uint64_t rsp = STACK_ADDRESS + STACK_SIZE - 16 - 8;
+    uint64_t return_address = RETURN_ADDRESS;
+    uc_err err = uc_mem_write(uc, rsp, &return_address, sizeof(return_address));
+    if (err != UC_ERR_OK) {
+        return err;
+    }
+    return uc_reg_write(uc, UC_X86_REG_RSP, &rsp);
+}
+
+uc_err emulator_set_args(uc_engine *uc, const int64_t *args, unsigned count) {
+    static const int registers[MAX_ARGS] = {
+        UC_X86_REG_RDI, UC_X86_REG_RSI, UC_X86_REG_RDX, UC_X86_REG_RCX, UC_X86_REG_R8, UC_X86_REG_R9,
+    };
+    if (count > MAX_ARGS) {
+        return UC_ERR_ARG;
+    }
+    for (unsigned i = 0; i < count; i++) {
+        uc_err err = uc_reg_write(uc, registers[i], &args[i]);
+        if (err != UC_ERR_OK) {
+            return err;
+        }
+    }
+    return UC_ERR_OK;
+}
+
+uc_err emulator_run(uc_engine *uc, uint64_t entry, int64_t *result) {
+    uc_err err = uc_emu_start(uc, entry, RETURN_ADDRESS, 0, 0);
+    if (err != UC_ERR_OK) {
+        return err;
+    }
+    uint64_t rip;
+    err = uc_reg_read(uc, UC_X86_REG_RIP, &rip);
+    if (err == UC_ERR_OK && rip != RETURN_ADDRESS) {
+        // Stopped before returning
+        return UC_ERR_EXCEPTION;
+    }
+    return uc_reg_read(uc, UC_X86_REG_RAX, result);
+}
+
+uc_err emulator_call(uc_engine *uc, uint64_t entry, const int64_t *args, unsigned count, int64_t *result) {
+    uc_err err = emulator_reset_stack(uc);
+    if (err == UC_ERR_OK) {
+        err = emulator_set_args(uc, args, count);
+    }
+    if (err == UC_ERR_OK) {
+        err = emulator_run(uc, entry, result);
+    }
+    return err;
+}
+
+// ======================================================
+// Runners
+// ======================================================
+
+void load_code(LLVMModuleRef (*build)(LLVMContextRef ctx), LLVMCodeGenOptLevel level, EmittedCode *code) {
+    LLVMContextRef ctx = LLVMContextCreate();
+    LLVMModuleRef mod = build(ctx);
+    char *error = NULL;
+    LLVMMemoryBufferRef object = emit_x86_64(mod, level, &error);
+    if (!object || emitted_code_load(object, code, &error) != 0) {
+        fprintf(stderr, "%s\n", error);
+        exit(1);
+    }
+    LLVMDisposeMemoryBuffer(object);
+    LLVMDisposeModule(mod);
+    LLVMContextDispose(ctx);
+}
+
+void load_sum(EmittedCode *code, uint64_t *entry) {
+    load_code(build_sum, LLVMCodeGenLevelNone, code);
+    const CodeSymbol *sum = emitted_code_find(code, "sum");
+    if (!sum) {
+        fprintf(stderr, "no sum in the object\n");
+        exit(1);
+    }
+    *entry = CODE_ADDRESS + sum->offset;
+}
+
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void check_uc(uc_err err, const char *what) {
+    if (err != UC_ERR_OK) {
+        fprintf(stderr, "%s: %s\n", what, uc_strerror(err));
+        exit(1);
+    }
+}
+
+uint64_t xorshift(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
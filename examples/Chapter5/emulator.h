@@ -0,0 +1,89 @@
+/**
+ * Running the machine code generated by LLVM inside Unicorn.
+ *
+ * emitted_code_load() takes an x86-64 ELF object in memory, as emitted by
+ * LLVMTargetMachineEmitToMemoryBuffer(), and extracts its .text section
+ * and the functions defined in it. The code is mapped as is, nothing is
+ * linked: an object whose .text has relocations (calls to external or
+ * preemptible functions, constant pools) is refused, and the callees of a
+ * generated function must have internal linkage.
+ *
+ * emulator_create() maps the code at CODE_ADDRESS, read and execute, and a
+ * stack of STACK_SIZE bytes at STACK_ADDRESS, read and write.
+ * emulator_call() calls a function with the System V calling convention:
+ * integer arguments in rdi, rsi, rdx, rcx, r8 and r9, RETURN_ADDRESS, which
+ * is never mapped, pushed as the return address, and the emulation stopped
+ * when the function returns to it. The result is read from rax.
+ *
+ * The calls are split in three for the runners that reset the engine
+ * themselves: emulator_reset_stack(), emulator_set_args() and
+ * emulator_run().
+ *
+ * The runners share load_code() and load_sum(), which exit on failure as
+ * check_uc() does, their clock, and the xorshift generator of their test
+ * vectors, so that every runner sees the same vectors.
+ */
+
+#ifndef EMULATOR_H
+#define EMULATOR_H
+
+#include <llvm-c/Core.h>
+#include <llvm-c/TargetMachine.h>
+
+#include <unicorn/unicorn.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CODE_ADDRESS 0x1000000
+#define STACK_ADDRESS 0x2000000
+#define STACK_SIZE (64 * 1024)
+#define RETURN_ADDRESS 0x3000000
+#define MAX_ARGS 6
+#define XORSHIFT_SEED 88172645463325252ULL
+
+typedef struct {
+    char *name;
+    uint64_t offset;            // in .text
+    uint64_t size;
+} CodeSymbol;
+
+typedef struct {
+    uint8_t *text;
+    size_t size;
+    CodeSymbol *symbols;        // the functions, by increasing offset
+    unsigned symbol_count;
+} EmittedCode;
+
+// sum, as built in Chapter 2: int sum(int a, int b) { return a + b; }
+LLVMModuleRef build_sum(LLVMContextRef ctx);
+
+// Emits mod for x86_64, NULL with *error set (LLVMDisposeMessage) on failure
+LLVMMemoryBufferRef emit_x86_64(LLVMModuleRef mod, LLVMCodeGenOptLevel level, char **error);
+
+// Returns 0 on success, otherwise 1 with *error set (LLVMDisposeMessage)
+int emitted_code_load(LLVMMemoryBufferRef object, EmittedCode *code, char **error);
+const CodeSymbol *emitted_code_find(const EmittedCode *code, const char *name);
+// The function containing offset, NULL when there is none
+const CodeSymbol *emitted_code_symbol_at(const EmittedCode *code, uint64_t offset);
+void emitted_code_dispose(EmittedCode *code);
+
+uc_err emulator_create(const EmittedCode *code, uc_engine **uc);
+uc_err emulator_reset_stack(uc_engine *uc);
+uc_err emulator_set_args(uc_engine *uc, const int64_t *args, unsigned count);
+uc_err emulator_run(uc_engine *uc, uint64_t entry, int64_t *result);
+uc_err emulator_call(uc_engine *uc, uint64_t entry, const int64_t *args, unsigned count, int64_t *result);
+
+// Builds a module with build, emits it at level and loads its code
+void load_code(LLVMModuleRef (*build)(LLVMContextRef ctx), LLVMCodeGenOptLevel level, EmittedCode *code);
+// sum emitted without optimization, *entry its address in the engine
+void load_sum(EmittedCode *code, uint64_t *entry);
+
+// Seconds on the monotonic clock
+double now(void);
+// Exits with the message of err unless it is UC_ERR_OK
+void check_uc(uc_err err, const char *what);
+// Next value of the sequence, to start from XORSHIFT_SEED
+uint64_t xorshift(uint64_t *state);
+
+#endif
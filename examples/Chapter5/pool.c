@@ -0,0 +1,194 @@
+/**
+ * A pool of Unicorn engines running the test vectors of sum in parallel.
+ *
+ * An engine emulates on the thread that runs it, so the pool has one
+ * engine per worker thread, each with its own copy of the code mapped and
+ * its own baseline CPU context, restored before every vector as in
+ * snapshot.c. The vectors are cut into chunks of CHUNK_SIZE; the queue of
+ * chunks is an atomic index that the workers advance with a fetch-and-add,
+ * so taking work never blocks. Every worker writes the results of its
+ * chunks into the shared result array, at the index of the vector, and
+ * marks the vector executed; both arrays are reset before every run. Once
+ * the workers are joined the results are merged: every vector must have
+ * been executed exactly once, and the results are checked against the C
+ * addition and summed into a checksum that must not depend on the number
+ * of workers.
+ *
+ * The scaling curve runs the same vectors with 1, 2, 4, ... workers up to
+ * the number of processors, and reports the vectors per second, the
+ * speedup and the parallel efficiency. The engines are created before the
+ * clock starts.
+ *
+ * usage: pool [vectors [max workers]], 2000000 vectors by default
+ */
+
+#include "emulator.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CHUNK_SIZE 4096
+
+// ======================================================
+// Pool
+// ======================================================
+
+typedef struct {
+    const int32_t (*vectors)[2];
+    int32_t *results;
+    uint8_t *executed;          // per vector, cleared before every run
+    long count;
+    uint64_t entry;
+    unsigned long next_chunk;   // the queue, taken with a fetch-and-add
+    pthread_barrier_t ready;    // engines created, the clock can start
+} Work;
+
+typedef struct {
+    Work *work;
+    const EmittedCode *code;
+    pthread_t thread;
+    long executed;
+} Worker;
+
+static void *worker_main(void *arg) {
+    Worker *worker = arg;
+    Work *work = worker->work;
+    uc_engine *uc;
+    uc_context *baseline;
+    check_uc(emulator_create(worker->code, &uc), "engine");
+    check_uc(emulator_reset_stack(uc), "stack");
+    check_uc(uc_context_alloc(uc, &baseline), "context");
+    check_uc(uc_context_save(uc, baseline), "save");
+    pthread_barrier_wait(&work->ready);
+
+    for (;;) {
+        long first = (long) __atomic_fetch_add(&work->next_chunk, 1, __ATOMIC_RELAXED) * CHUNK_SIZE;
+        if (first >= work->count) {
+            break;
+        }
+        long last = first + CHUNK_SIZE < work->count ? first + CHUNK_SIZE : work->count;
+        for (long v = first; v < last; v++) {
+            int64_t args[] = { work->vectors[v][0], work->vectors[v][1] };
+            int64_t rax;
+            check_uc(uc_context_restore(uc, baseline), "restore");
+            check_uc(emulator_set_args(uc, args, 2), "arguments");
+            check_uc(emulator_run(uc, work->entry, &rax), "sum");
+            work->results[v] = (int32_t) rax;
+            work->executed[v] = 1;
+        }
+        worker->executed += last - first;
+    }
+
+    uc_context_free(baseline);
+    uc_close(uc);
+    return NULL;
+}
+
+typedef struct {
+    double seconds;
+    uint64_t checksum;
+    long min_executed;
+    long max_executed;
+} PoolRun;
+
+static PoolRun run_pool(const EmittedCode *code, uint64_t entry, const int32_t (*vectors)[2], int32_t *results,
+                        uint8_t *executed, long count, unsigned workers) {
+    // Nothing left by the previous run can pass for a result of this one
+    memset(results, 0xff, count * sizeof(int32_t));
+    memset(executed, 0, count);
+    Work work = { vectors, results, executed, count, entry, 0 };
+    pthread_barrier_init(&work.ready, NULL, workers + 1);
+    Worker *pool = calloc(workers, sizeof(Worker));
+    for (unsigned w = 0; w < workers; w++) {
+        pool[w].work = &work;
+        pool[w].code = code;
+        pthread_create(&pool[w].thread, NULL, worker_main, &pool[w]);
+    }
+    pthread_barrier_wait(&work.ready);
+    double start = now();
+    for (unsigned w = 0; w < workers; w++) {
+        pthread_join(pool[w].thread, NULL);
+    }
+    PoolRun run = { now() - start, 0, count, 0 };
+
+    // Merge
+    for (long v = 0; v < count; v++) {
+        if (!executed[v]) {
+            fprintf(stderr, "vector %ld not run with %u workers\n", v, workers);
+            exit(1);
+        }
+        int32_t expected = (int32_t) ((uint32_t) vectors[v][0] + (uint32_t) vectors[v][1]);
+        if (results[v] != expected) {
+            fprintf(stderr, "sum(%d, %d) = %d instead of %d\n", vectors[v][0], vectors[v][1], results[v], expected);
+            exit(1);
+        }
+        run.checksum = run.checksum * 31 + (uint32_t) results[v];
+    }
+    long total = 0;
+    for (unsigned w = 0; w < workers; w++) {
+        run.min_executed = pool[w].executed < run.min_executed ? pool[w].executed : run.min_executed;
+        run.max_executed = pool[w].executed > run.max_executed ? pool[w].executed : run.max_executed;
+        total += pool[w].executed;
+    }
+    if (total != count) {
+        fprintf(stderr, "%ld vectors run by %u workers instead of %ld\n", total, workers, count);
+        exit(1);
+    }
+    free(pool);
+    pthread_barrier_destroy(&work.ready);
+    return run;
+}
+
+int main(int argc, char const *argv[]) {
+    long count = argc > 1 ? atol(argv[1]) : 2000000;
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned max_workers = argc > 2 ? (unsigned) atoi(argv[2]) : (unsigned) processors;
+    max_workers = max_workers > 0 ? max_workers : 1;
+
+    EmittedCode code;
+    uint64_t entry;
+    load_sum(&code, &entry);
+
+    int32_t (*vectors)[2] = malloc(count * sizeof(*vectors));
+    int32_t *results = malloc(count * sizeof(int32_t));
+    uint8_t *executed = malloc(count);
+    uint64_t state = XORSHIFT_SEED;
+    for (long v = 0; v < count; v++) {
+        uint64_t r = xorshift(&state);
+        vectors[v][0] = (int32_t) r;
+        vectors[v][1] = (int32_t) (r >> 32);
+    }
+
+    printf("%ld vectors in chunks of %d, up to %u workers\n", count, CHUNK_SIZE, max_workers);
+    printf("%8s %14s %8s %11s %22s %18s\n", "workers", "vectors/s", "speedup", "efficiency", "vectors per worker",
+           "checksum");
+    double single = 0;
+    uint64_t checksum = 0;
+    for (unsigned workers = 1;; workers = workers * 2 < max_workers ? workers * 2 : max_workers) {
+        PoolRun run = run_pool(&code, entry, (const int32_t (*)[2]) vectors, results, executed, count,
+                               workers);
+        double rate = count / run.seconds;
+        if (workers == 1) {
+            single = rate;
+            checksum = run.checksum;
+        } else if (run.checksum != checksum) {
+            fprintf(stderr, "checksum %016llx with %u workers instead of %016llx\n",
+                    (unsigned long long) run.checksum, workers, (unsigned long long) checksum);
+            return 1;
+        }
+        printf("%8u %14.0f %7.2fx %10.1f%% %10ld - %-10ld %016llx\n", workers, rate, rate / single,
+               100.0 * rate / single / workers, run.min_executed, run.max_executed,
+               (unsigned long long) run.checksum);
+        if (workers == max_workers) {
+            break;
+        }
+    }
+
+    free(executed);
+    free(results);
+    free(vectors);
+    emitted_code_dispose(&code);
+}
@@ -0,0 +1,335 @@
+/**
+ * Instruction counts and coverage of the generated code, under emulation.
+ *
+ * The time of a call to sum is a few nanoseconds of noise on any machine.
+ * What the emulator can count instead does not depend on the machine: the
+ * instructions executed, the basic blocks entered and the memory accesses
+ * of every call. The module profiled here is sum, with a second function
+ * calling an internal one:
+ *
+ * static int abs_diff(int a, int b) {
+ *     return a > b ? a - b : b - a;
+ * }
+ *
+ * int distance(int a, int b, int c) {
+ *     return abs_diff(a, b) + abs_diff(b, c);
+ * }
+ *
+ * The basic blocks are found statically, by disassembling .text with the
+ * LLVM disassembler: a block starts at a function, at the target of a jump
+ * or a call, and after a jump, a call or a return. A code hook counts the
+ * executions of every instruction, a memory hook the reads and writes made
+ * by the instruction executing. A block is entered when its first
+ * instruction executes. The translation blocks of Unicorn (UC_HOOK_BLOCK)
+ * are not used for this: one can run through the start of a block reached
+ * by falling through.
+ *
+ * The counters are kept per offset in .text and summed per function with
+ * emitted_code_symbol_at() at the end. The report gives, for each entry
+ * point and each code generation level, the instructions, blocks and
+ * memory accesses per call (min, mean and max over the vectors), then per
+ * function the calls, the totals and the block and instruction coverage,
+ * with the offsets of the blocks never entered.
+ *
+ * usage: profile [vectors], 1000 by default
+ */
+
+#include "emulator.h"
+
+#include <llvm-c/Disassembler.h>
+#include <llvm-c/Target.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// ======================================================
+// Module
+// ======================================================
+
+static LLVMModuleRef build_distance(LLVMContextRef ctx) {
+    LLVMModuleRef mod = build_sum(ctx);
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(ctx);
+    LLVMBuilderRef builder = LLVMCreateBuilderInContext(ctx);
+
+    LLVMTypeRef abs_diff_params[] = { i32, i32 };
+    LLVMTypeRef abs_diff_type = LLVMFunctionType(i32, abs_diff_params, 2, 0);
+    LLVMValueRef abs_diff = LLVMAddFunction(mod, "abs_diff", abs_diff_type);
+    LLVMSetLinkage(abs_diff, LLVMInternalLinkage);
+    LLVMValueRef a = LLVMGetParam(abs_diff, 0), b = LLVMGetParam(abs_diff, 1);
+    LLVMBasicBlockRef entry = LLVMAppendBasicBlockInContext(ctx, abs_diff, "entry");
+    LLVMBasicBlockRef greater = LLVMAppendBasicBlockInContext(ctx, abs_diff, "greater");
+    LLVMBasicBlockRef less = LLVMAppendBasicBlockInContext(ctx, abs_diff, "less");
+    LLVMPositionBuilderAtEnd(builder, entry);
+    LLVMBuildCondBr(builder, LLVMBuildICmp(builder, LLVMIntSGT, a, b, "gt"), greater, less);
+    LLVMPositionBuilderAtEnd(builder, greater);
+    LLVMBuildRet(builder, LLVMBuildSub(builder, a, b, "diff"));
+    LLVMPositionBuilderAtEnd(builder, less);
+    LLVMBuildRet(builder, LLVMBuildSub(builder, b, a, "diff"));
+
+    LLVMTypeRef distance_params[] = { i32, i32, i32 };
+    LLVMValueRef distance = LLVMAddFunction(mod, "distance", LLVMFunctionType(i32, distance_params, 3, 0));
+    LLVMPositionBuilderAtEnd(builder, LLVMAppendBasicBlockInContext(ctx, distance, "entry"));
+    LLVMValueRef first_args[] = { LLVMGetParam(distance, 0), LLVMGetParam(distance, 1) };
+    LLVMValueRef second_args[] = { LLVMGetParam(distance, 1), LLVMGetParam(distance, 2) };
+    LLVMValueRef first = LLVMBuildCall2(builder, abs_diff_type, abs_diff, first_args, 2, "first");
+    LLVMValueRef second = LLVMBuildCall2(builder, abs_diff_type, abs_diff, second_args, 2, "second");
+    LLVMBuildRet(builder, LLVMBuildAdd(builder, first, second, "tmp"));
+
+    LLVMDisposeBuilder(builder);
+    return mod;
+}
+
+// ======================================================
+// Basic blocks
+// ======================================================
+
+typedef struct {
+    const EmittedCode *code;
+    uint8_t *instruction;       // per offset: an instruction starts here
+    uint8_t *leader;            // per offset: a basic block starts here
+    uint64_t *executed;         // per offset: executions of the instruction
+    uint64_t *reads;            // per offset: reads made by the instruction
+    uint64_t *writes;           // per offset: writes made by the instruction
+    uint64_t current;           // offset of the instruction executing
+    uint64_t instructions;      // totals, to take the cost of a call
+    uint64_t blocks;
+    uint64_t accesses;
+} Profile;
+
+static void mark_leader(Profile *profile, int64_t offset) {
+    if (offset >= 0 && (uint64_t) offset < profile->code->size) {
+        profile->leader[offset] = 1;
+    }
+}
+
+// Returns 0 on success, otherwise 1 with the offset that did not disassemble
+static int find_blocks(Profile *profile, uint64_t *bad_offset) {
+    const EmittedCode *code = profile->code;
+    LLVMDisasmContextRef disasm = LLVMCreateDisasm("x86_64", NULL, 0, NULL, NULL);
+    for (unsigned s = 0; s < code->symbol_count; s++) {
+        const CodeSymbol *symbol = &code->symbols[s];
+        mark_leader(profile, symbol->offset);
+        for (uint64_t offset = symbol->offset; offset < symbol->offset + symbol->size;) {
+            char text[128];
+            size_t length = LLVMDisasmInstruction(disasm, code->text + offset, symbol->offset + symbol->size - offset,
+                                                  offset, text, sizeof(text));
+            if (length == 0) {
+                LLVMDisasmDispose(disasm);
+                *bad_offset = offset;
+                return 1;
+            }
+            profile->instruction[offset] = 1;
+            const char *mnemonic = text + strspn(text, " \t");
+            int jump = mnemonic[0] == 'j', call = strncmp(mnemonic, "call", 4) == 0;
+            int ret = strncmp(mnemonic, "ret", 3) == 0;
+            const char *operand = mnemonic + strcspn(mnemonic, " \t");
+            operand += strspn(operand, " \t");
+            if ((jump || call) && operand[0] != '*') {
+                // Direct: the displacement ends the instruction, 1 byte in the
+                // 2 byte forms, 4 bytes otherwise
+                int64_t displacement;
+                if (length == 2) {
+                    displacement = (int8_t) code->text[offset + 1];
+                } else {
+                    int32_t rel32;
+                    memcpy(&rel32, code->text + offset + length - 4, 4);
+                    displacement = rel32;
+                }
+                mark_leader(profile, (int64_t) (offset + length) + displacement);
+            }
+            offset += length;
+            if (jump || call || ret) {
+                mark_leader(profile, offset);
+            }
+        }
+    }
+    LLVMDisasmDispose(disasm);
+    return 0;
+}
+
+// ======================================================
+// Hooks
+// ======================================================
+
+static void on_instruction(uc_engine *uc, uint64_t address, uint32_t size, void *user_data) {
+    (void) uc;
+    (void) size;
+    Profile *profile = user_data;
+    uint64_t offset = address - CODE_ADDRESS;
+    profile->current = offset;
+    profile->executed[offset]++;
+    profile->instructions++;
+    profile->blocks += profile->leader[offset];
+}
+
+static void on_memory(uc_engine *uc, uc_mem_type type, uint64_t address, int size, int64_t value, void *user_data) {
+    (void) uc;
+    (void) address;
+    (void) size;
+    (void) value;
+    Profile *profile = user_data;
+    if (type == UC_MEM_WRITE) {
+        profile->writes[profile->current]++;
+    } else {
+        profile->reads[profile->current]++;
+    }
+    profile->accesses++;
+}
+
+// ======================================================
+// Report
+// ======================================================
+
+typedef struct {
+    uint64_t min;
+    uint64_t max;
+    uint64_t total;
+} PerCall;
+
+static void per_call_add(PerCall *cost, uint64_t value, long call) {
+    cost->min = call == 0 || value < cost->min ? value : cost->min;
+    cost->max = call == 0 || value > cost->max ? value : cost->max;
+    cost->total += value;
+}
+
+static void per_call_print(const char *what, const PerCall *cost, long calls) {
+    printf("    %-14s min %4llu  mean %8.2f  max %4llu\n", what, (unsigned long long) cost->min,
+           (double) cost->total / calls, (unsigned long long) cost->max);
+}
+
+static void report_functions(const Profile *profile) {
+    const EmittedCode *code = profile->code;
+    printf("    %-10s %8s %10s %8s %8s %8s %14s %14s\n", "function", "calls", "instrs", "blocks", "reads", "writes",
+           "block cov.", "instr cov.");
+    for (unsigned s = 0; s < code->symbol_count; s++) {
+        const CodeSymbol *symbol = &code->symbols[s];
+        uint64_t instructions = 0, blocks = 0, reads = 0, writes = 0;
+        unsigned static_blocks = 0, covered_blocks = 0, static_instructions = 0, covered_instructions = 0;
+        for (uint64_t offset = symbol->offset; offset < symbol->offset + symbol->size; offset++) {
+            if (emitted_code_symbol_at(code, offset) != symbol || !profile->instruction[offset]) {
+                continue;
+            }
+            instructions += profile->executed[offset];
+            reads += profile->reads[offset];
+            writes += profile->writes[offset];
+            static_instructions++;
+            covered_instructions += profile->executed[offset] != 0;
+            if (profile->leader[offset]) {
+                blocks += profile->executed[offset];
+                static_blocks++;
+                covered_blocks += profile->executed[offset] != 0;
+            }
+        }
+        char block_coverage[32], instruction_coverage[32];
+        snprintf(block_coverage, sizeof(block_coverage), "%u/%u", covered_blocks, static_blocks);
+        snprintf(instruction_coverage, sizeof(instruction_coverage), "%u/%u", covered_instructions,
+                 static_instructions);
+        printf("    %-10s %8llu %10llu %8llu %8llu %8llu %14s %14s\n", symbol->name,
+               (unsigned long long) profile->executed[symbol->offset], (unsigned long long) instructions,
+               (unsigned long long) blocks, (unsigned long long) reads, (unsigned long long) writes, block_coverage,
+               instruction_coverage);
+        for (uint64_t offset = symbol->offset; offset < symbol->offset + symbol->size; offset++) {
+            if (profile->leader[offset] && profile->instruction[offset] && !profile->executed[offset]) {
+                printf("    %-10s never entered: block at offset %llu\n", "", (unsigned long long) offset);
+            }
+        }
+    }
+}
+
+// ======================================================
+// Profiling
+// ======================================================
+
+static void profile_entry(uc_engine *uc, Profile *profile, const CodeSymbol *symbol, unsigned arity, long calls) {
+    uc_context *baseline;
+    check_uc(emulator_reset_stack(uc), "stack");
+    check_uc(uc_context_alloc(uc, &baseline), "context");
+    check_uc(uc_context_save(uc, baseline), "save");
+
+    PerCall instructions = { 0 }, blocks = { 0 }, accesses = { 0 };
+    uint64_t state = XORSHIFT_SEED;
+    for (long call = 0; call < calls; call++) {
+        int64_t args[MAX_ARGS];
+        for (unsigned a = 0; a < arity; a++) {
+            args[a] = (int32_t) xorshift(&state);
+        }
+        uint64_t instructions_before = profile->instructions, blocks_before = profile->blocks;
+        uint64_t accesses_before = profile->accesses;
+        int64_t rax;
+        check_uc(uc_context_restore(uc, baseline), "restore");
+        check_uc(emulator_set_args(uc, args, arity), "arguments");
+        check_uc(emulator_run(uc, CODE_ADDRESS + symbol->offset, &rax), symbol->name);
+        per_call_add(&instructions, profile->instructions - instructions_before, call);
+        per_call_add(&blocks, profile->blocks - blocks_before, call);
+        per_call_add(&accesses, profile->accesses - accesses_before, call);
+    }
+    uc_context_free(baseline);
+
+    printf("  %s, %ld calls, per call:\n", symbol->name, calls);
+    per_call_print("instructions", &instructions, calls);
+    per_call_print("blocks", &blocks, calls);
+    per_call_print("memory", &accesses, calls);
+}
+
+static void profile_level(LLVMCodeGenOptLevel level, const char *level_name, long calls) {
+    EmittedCode code;
+    load_code(build_distance, level, &code);
+
+    Profile profile = { &code };
+    profile.instruction = calloc(code.size, 1);
+    profile.leader = calloc(code.size, 1);
+    profile.executed = calloc(code.size, sizeof(uint64_t));
+    profile.reads = calloc(code.size, sizeof(uint64_t));
+    profile.writes = calloc(code.size, sizeof(uint64_t));
+    uint64_t bad_offset;
+    if (find_blocks(&profile, &bad_offset) != 0) {
+        fprintf(stderr, "cannot disassemble the instruction at offset %llu\n", (unsigned long long) bad_offset);
+        exit(1);
+    }
+    printf("%s: %zu bytes of code, %u functions\n", level_name, code.size, code.symbol_count);
+
+    uc_engine *uc;
+    uc_hook code_hook, memory_hook;
+    check_uc(emulator_create(&code, &uc), "engine");
+    check_uc(uc_hook_add(uc, &code_hook, UC_HOOK_CODE, on_instruction, &profile, CODE_ADDRESS,
+                         CODE_ADDRESS + code.size - 1),
+             "code hook");
+    // The stack accesses of the generated code; begin > end for every address
+    check_uc(uc_hook_add(uc, &memory_hook, UC_HOOK_MEM_READ | UC_HOOK_MEM_WRITE, on_memory, &profile, 1, 0),
+             "memory hook");
+
+    static const struct {
+        const char *name;
+        unsigned arity;
+    } entries[] = { { "sum", 2 }, { "distance", 3 } };
+    for (unsigned e = 0; e < sizeof(entries) / sizeof(entries[0]); e++) {
+        const CodeSymbol *symbol = emitted_code_find(&code, entries[e].name);
+        if (!symbol) {
+            fprintf(stderr, "no %s in the object\n", entries[e].name);
+            exit(1);
+        }
+        profile_entry(uc, &profile, symbol, entries[e].arity, calls);
+    }
+    report_functions(&profile);
+    printf("\n");
+
+    uc_hook_del(uc, memory_hook);
+    uc_hook_del(uc, code_hook);
+    uc_close(uc);
+    free(profile.writes);
+    free(profile.reads);
+    free(profile.executed);
+    free(profile.leader);
+    free(profile.instruction);
+    emitted_code_dispose(&code);
+}
+
+int main(int argc, char const *argv[]) {
+    long calls = argc > 1 ? atol(argv[1]) : 1000;
+    calls = calls > 0 ? calls : 1;
+
+    LLVMInitializeX86Disassembler();
+    profile_level(LLVMCodeGenLevelNone, "-O0", calls);
+    profile_level(LLVMCodeGenLevelAggressive, "-O3", calls);
+}
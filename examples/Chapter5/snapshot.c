@@ -0,0 +1,95 @@
+/**
+ * Millions of test vectors through the emulated sum, with a CPU snapshot
+ * restored between them.
+ *
+ * The workflow of Chapter 5 creates an engine, maps memory, writes the code
+ * and runs it once. Done per vector, that is what the naive runner below
+ * does. The snapshot runner sets the engine up once: code mapped, stack
+ * mapped with the return address pushed, rsp set. It saves that CPU state
+ * with uc_context_save(), and before every vector restores it with
+ * uc_context_restore(), writes the two arguments and runs. Nothing is
+ * mapped or written to memory again: the context only holds registers,
+ * and sum writes nothing above its frame, so the return address stays in
+ * place.
+ *
+ * The vectors come from a fixed xorshift sequence, and every result is
+ * checked against the C addition. The report gives the vectors per second
+ * of both runners; the naive one runs NAIVE_VECTORS vectors only.
+ *
+ * usage: snapshot [vectors], 1000000 by default
+ */
+
+#include "emulator.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define NAIVE_VECTORS 2000
+
+static void check_result(int32_t a, int32_t b, int64_t rax) {
+    int32_t expected = (int32_t) ((uint32_t) a + (uint32_t) b);
+    if ((int32_t) rax != expected) {
+        fprintf(stderr, "sum(%d, %d) = %d instead of %d\n", a, b, (int32_t) rax, expected);
+        exit(1);
+    }
+}
+
+// An engine per vector: open, map, write, call, close
+static double naive(const EmittedCode *code, uint64_t entry, long vectors) {
+    uint64_t state = XORSHIFT_SEED;
+    double start = now();
+    for (long v = 0; v < vectors; v++) {
+        uint64_t r = xorshift(&state);
+        int64_t args[] = { (int32_t) r, (int32_t) (r >> 32) };
+        uc_engine *uc;
+        int64_t rax;
+        check_uc(emulator_create(code, &uc), "engine");
+        check_uc(emulator_call(uc, entry, args, 2, &rax), "sum");
+        uc_close(uc);
+        check_result(args[0], args[1], rax);
+    }
+    return vectors / (now() - start);
+}
+
+// One engine, its CPU context restored before every vector
+static double snapshot(const EmittedCode *code, uint64_t entry, long vectors) {
+    uc_engine *uc;
+    uc_context *baseline;
+    check_uc(emulator_create(code, &uc), "engine");
+    check_uc(emulator_reset_stack(uc), "stack");
+    check_uc(uc_context_alloc(uc, &baseline), "context");
+    check_uc(uc_context_save(uc, baseline), "save");
+
+    uint64_t state = XORSHIFT_SEED;
+    double start = now();
+    for (long v = 0; v < vectors; v++) {
+        uint64_t r = xorshift(&state);
+        int64_t args[] = { (int32_t) r, (int32_t) (r >> 32) };
+        int64_t rax;
+        check_uc(uc_context_restore(uc, baseline), "restore");
+        check_uc(emulator_set_args(uc, args, 2), "arguments");
+        check_uc(emulator_run(uc, entry, &rax), "sum");
+        check_result(args[0], args[1], rax);
+    }
+    double rate = vectors / (now() - start);
+
+    uc_context_free(baseline);
+    uc_close(uc);
+    return rate;
+}
+
+int main(int argc, char const *argv[]) {
+    long vectors = argc > 1 ? atol(argv[1]) : 1000000;
+
+    EmittedCode code;
+    uint64_t entry;
+    load_sum(&code, &entry);
+
+    double naive_rate = naive(&code, entry, NAIVE_VECTORS);
+    printf("%-26s %9ld vectors: %12.0f vectors/s\n", "engine per vector", (long) NAIVE_VECTORS, naive_rate);
+    double snapshot_rate = snapshot(&code, entry, vectors);
+    printf("%-26s %9ld vectors: %12.0f vectors/s (%.1fx)\n", "context snapshot", vectors, snapshot_rate,
+           snapshot_rate / naive_rate);
+
+    emitted_code_dispose(&code);
+}
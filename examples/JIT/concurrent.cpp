@@ -0,0 +1,427 @@
+/**
+ * Concurrent JIT compilation on a work-stealing thread pool.
+ *
+ * A burst of REQUEST_COUNT compile requests arrives at once. Request i is a
+ * chain of FUNCTIONS_PER_REQUEST functions built like Chapter 1 builds sum:
+ *
+ * int r<i>_f<j>(int x) {
+ *     int v = x;
+ *     v = (v * 31) ^ (v >> 3) ... ; // BODY_STEPS times
+ *     return v + r<i>_f<j+1>(v);    // the last one returns v
+ * }
+ *
+ * CLIENT_THREADS client threads then look up the entry point r<i>_f0 of
+ * every request, each starting at a different request, so that every symbol
+ * is asked for by several threads at once.
+ *
+ * The ORC execution session hands every materialization (the compile of a
+ * module) to its dispatch function. WorkStealingDispatcher runs them on a pool
+ * of workers with one deque each: a worker pops its own jobs LIFO and steals
+ * FIFO from the others when it runs dry. Jobs dispatched from a worker, like
+ * the dependencies discovered while linking r<i>_f<j>, go to its own deque;
+ * jobs dispatched from a client thread are spread round-robin.
+ *
+ * Requests are compiled either as one module per request (per-module jobs)
+ * or as one module per function (per-function jobs), every module in its
+ * own context so that compiles do not serialize on a context lock. A lookup
+ * of a symbol already being compiled waits for that compile instead of
+ * starting another one: the report shows as many compiles as modules,
+ * whatever the number of lookups.
+ */
+
+#include <llvm-c/Core.h>
+#include <llvm-c/Analysis.h>
+#include <llvm-c/Target.h>
+
+#include <llvm/ExecutionEngine/Orc/CompileUtils.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/ExecutionEngine/Orc/TaskDispatch.h>
+#include <llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define REQUEST_COUNT 256
+#define FUNCTIONS_PER_REQUEST 8
+#define BODY_STEPS 16
+#define CLIENT_THREADS 8
+
+using namespace llvm;
+using namespace llvm::orc;
+
+static void check(Error err, const char *what) {
+    if (err) {
+        fprintf(stderr, "%s: %s\n", what, toString(std::move(err)).c_str());
+        exit(1);
+    }
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// ======================================================
+// Work-stealing dispatcher
+// ======================================================
+
+struct PoolMetrics {
+    unsigned long dispatched;
+    unsigned long steals;
+    unsigned long max_depth;
+    double mean_depth;             // queued jobs seen by each dispatch
+    std::vector<unsigned long> executed;
+};
+
+class WorkStealingDispatcher : public TaskDispatcher {
+public:
+    explicit WorkStealingDispatcher(unsigned worker_count);
+    void dispatch(std::unique_ptr<Task> task) override;
+    void shutdown() override;
+    PoolMetrics metrics() const;
+
+private:
+    struct Worker {
+        std::mutex lock;
+        std::deque<std::unique_ptr<Task>> jobs;
+        std::atomic<unsigned long> executed{0};
+    };
+
+    void run(unsigned self);
+    std::unique_ptr<Task> take(unsigned self);
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+    std::mutex idle_lock;
+    std::condition_variable idle;
+    std::condition_variable drained;
+    bool stopping = false;
+    std::atomic<unsigned long> queued{0};
+    std::atomic<unsigned long> outstanding{0};
+    std::atomic<unsigned long> dispatched{0};
+    std::atomic<unsigned long> steals{0};
+    std::atomic<unsigned long> max_depth{0};
+    std::atomic<unsigned long> depth_sum{0};
+    std::atomic<unsigned> next{0};
+
+    // Index of the worker running on this thread, -1 on client threads
+    static thread_local int current;
+};
+
+thread_local int WorkStealingDispatcher::current = -1;
+
+WorkStealingDispatcher::WorkStealingDispatcher(unsigned worker_count) {
+    for (unsigned i = 0; i < worker_count; i++) {
+        workers.push_back(std::make_unique<Worker>());
+    }
+    for (unsigned i = 0; i < worker_count; i++) {
+        threads.emplace_back([this, i]() { run(i); });
+    }
+}
+
+void WorkStealingDispatcher::dispatch(std::unique_ptr<Task> task) {
+    // Once shut down, whatever the session still dispatches runs in place.
+    // shutdown() sets stopping under the idle lock once nothing is
+    // outstanding, so a job counted here keeps the workers running.
+    bool in_place;
+    {
+        std::lock_guard<std::mutex> guard(idle_lock);
+        in_place = stopping;
+        if (!in_place) {
+            outstanding++;
+        }
+    }
+    if (in_place) {
+        task->run();
+        return;
+    }
+    unsigned target = current >= 0 ? (unsigned) current : next++ % workers.size();
+    dispatched++;
+    unsigned long depth = ++queued;
+    depth_sum += depth;
+    unsigned long seen = max_depth.load();
+    while (depth > seen && !max_depth.compare_exchange_weak(seen, depth)) {
+    }
+    {
+        std::lock_guard<std::mutex> guard(workers[target]->lock);
+        workers[target]->jobs.push_back(std::move(task));
+    }
+    // Taking the idle lock orders the push with a worker about to sleep
+    std::lock_guard<std::mutex> guard(idle_lock);
+    idle.notify_one();
+}
+
+// Own deque from the back, then the others from the front
+std::unique_ptr<Task> WorkStealingDispatcher::take(unsigned self) {
+    std::unique_ptr<Task> task;
+    {
+        Worker &own = *workers[self];
+        std::lock_guard<std::mutex> guard(own.lock);
+        if (!own.jobs.empty()) {
+            task = std::move(own.jobs.back());
+            own.jobs.pop_back();
+            return task;
+        }
+    }
+    for (size_t i = 1; i < workers.size(); i++) {
+        Worker &victim = *workers[(self + i) % workers.size()];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.jobs.empty()) {
+            task = std::move(victim.jobs.front());
+            victim.jobs.pop_front();
+            steals++;
+            return task;
+        }
+    }
+    return task;
+}
+
+void WorkStealingDispatcher::run(unsigned self) {
+    current = (int) self;
+    for (;;) {
+        std::unique_ptr<Task> task = take(self);
+        if (!task) {
+            std::unique_lock<std::mutex> guard(idle_lock);
+            idle.wait(guard, [this]() { return stopping || queued.load() > 0; });
+            if (stopping && queued.load() == 0) {
+                return;
+            }
+            continue;
+        }
+        queued--;
+        task->run();
+        task.reset();
+        workers[self]->executed++;
+        if (--outstanding == 0) {
+            std::lock_guard<std::mutex> guard(idle_lock);
+            drained.notify_all();
+        }
+    }
+}
+
+// Waits for the outstanding jobs, then joins the workers
+void WorkStealingDispatcher::shutdown() {
+    {
+        std::unique_lock<std::mutex> guard(idle_lock);
+        drained.wait(guard, [this]() { return outstanding.load() == 0; });
+        stopping = true;
+        idle.notify_all();
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+    threads.clear();
+}
+
+PoolMetrics WorkStealingDispatcher::metrics() const {
+    PoolMetrics m;
+    m.dispatched = dispatched;
+    m.steals = steals;
+    m.max_depth = max_depth;
+    m.mean_depth = dispatched ? (double) depth_sum / dispatched : 0.0;
+    for (const std::unique_ptr<Worker> &worker : workers) {
+        m.executed.push_back(worker->executed);
+    }
+    return m;
+}
+
+// ======================================================
+// Generated requests
+// ======================================================
+
+static void function_name(char *buffer, size_t size, unsigned request, unsigned index) {
+    snprintf(buffer, size, "r%u_f%u", request, index);
+}
+
+// Defines r<request>_f<first> to r<request>_f<last - 1>, the next function
+// of the chain is declared when it lives in another module.
+static ThreadSafeModule build_module(unsigned request, unsigned first, unsigned last) {
+    ThreadSafeContext ts_ctx(std::make_unique<LLVMContext>());
+    LLVMContextRef ctx = wrap(ts_ctx.getContext());
+    char name[32];
+    snprintf(name, sizeof(name), "request_%u_%u", request, first);
+    LLVMModuleRef mod = LLVMModuleCreateWithNameInContext(name, ctx);
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(ctx);
+    LLVMTypeRef fun_type = LLVMFunctionType(i32, &i32, 1, 0);
+    LLVMBuilderRef builder = LLVMCreateBuilderInContext(ctx);
+
+    for (unsigned j = first; j < last; j++) {
+        function_name(name, sizeof(name), request, j);
+        LLVMValueRef fun = LLVMGetNamedFunction(mod, name);
+        if (!fun) {
+            fun = LLVMAddFunction(mod, name, fun_type);
+        }
+        LLVMPositionBuilderAtEnd(builder, LLVMAppendBasicBlockInContext(ctx, fun, "entry"));
+        LLVMValueRef v = LLVMGetParam(fun, 0);
+        for (unsigned s = 0; s < BODY_STEPS; s++) {
+            LLVMValueRef scaled = LLVMBuildMul(builder, v, LLVMConstInt(i32, 31 + request + j + s, 0), "scaled");
+            LLVMValueRef shifted = LLVMBuildAShr(builder, v, LLVMConstInt(i32, 3, 0), "shifted");
+            v = LLVMBuildXor(builder, scaled, shifted, "v");
+        }
+        if (j + 1 < FUNCTIONS_PER_REQUEST) {
+            function_name(name, sizeof(name), request, j + 1);
+            LLVMValueRef callee = LLVMGetNamedFunction(mod, name);
+            if (!callee) {
+                callee = LLVMAddFunction(mod, name, fun_type);
+            }
+            LLVMValueRef called = LLVMBuildCall2(builder, fun_type, callee, &v, 1, "called");
+            v = LLVMBuildAdd(builder, v, called, "v");
+        }
+        LLVMBuildRet(builder, v);
+    }
+    LLVMDisposeBuilder(builder);
+
+    char *error = NULL;
+    if (LLVMVerifyModule(mod, LLVMReturnStatusAction, &error)) {
+        fprintf(stderr, "%s\n", error);
+        exit(1);
+    }
+    LLVMDisposeMessage(error);
+    return ThreadSafeModule(std::unique_ptr<Module>(unwrap(mod)), std::move(ts_ctx));
+}
+
+// ======================================================
+// Burst
+// ======================================================
+
+struct BurstResult {
+    double ms;
+    unsigned long lookups;
+    unsigned long compiles;
+    unsigned modules;
+    int32_t checksum;
+    bool pooled;
+    PoolMetrics pool;
+};
+
+/**
+ * Adds every request to a fresh JIT, then has the client threads look up
+ * all the entry points concurrently. workers == 0 compiles on the thread
+ * that triggers the compile, like a JIT without a pool.
+ */
+static BurstResult run_burst(unsigned workers, bool per_function) {
+    BurstResult result = {};
+
+    // Compiles run on several threads at once: one target machine per compile
+    Expected<std::unique_ptr<LLJIT>> created = LLJITBuilder()
+        .setCompileFunctionCreator([](JITTargetMachineBuilder jtmb) -> Expected<std::unique_ptr<IRCompileLayer::IRCompiler>> {
+            return std::make_unique<ConcurrentIRCompiler>(std::move(jtmb));
+        })
+        .create();
+    check(created.takeError(), "jit creation");
+    std::unique_ptr<LLJIT> jit = std::move(*created);
+
+    std::unique_ptr<WorkStealingDispatcher> pool;
+    if (workers) {
+        pool = std::make_unique<WorkStealingDispatcher>(workers);
+        WorkStealingDispatcher *dispatcher = pool.get();
+        jit->getExecutionSession().setDispatchTask([dispatcher](std::unique_ptr<Task> task) {
+            dispatcher->dispatch(std::move(task));
+        });
+    }
+
+    std::atomic<unsigned long> compiles{0};
+    jit->getIRTransformLayer().setTransform([&compiles](ThreadSafeModule module, MaterializationResponsibility &) {
+        compiles++;
+        return Expected<ThreadSafeModule>(std::move(module));
+    });
+
+    for (unsigned i = 0; i < REQUEST_COUNT; i++) {
+        if (per_function) {
+            for (unsigned j = 0; j < FUNCTIONS_PER_REQUEST; j++) {
+                check(jit->addIRModule(build_module(i, j, j + 1)), "module");
+                result.modules++;
+            }
+        } else {
+            check(jit->addIRModule(build_module(i, 0, FUNCTIONS_PER_REQUEST)), "module");
+            result.modules++;
+        }
+    }
+
+    std::vector<int32_t> checksums(CLIENT_THREADS);
+    std::vector<std::thread> clients;
+    double start = now();
+    for (unsigned c = 0; c < CLIENT_THREADS; c++) {
+        clients.emplace_back([&jit, &checksums, c]() {
+            int32_t checksum = 0;
+            for (unsigned k = 0; k < REQUEST_COUNT; k++) {
+                unsigned request = (k + c * REQUEST_COUNT / CLIENT_THREADS) % REQUEST_COUNT;
+                char name[32];
+                function_name(name, sizeof(name), request, 0);
+                Expected<JITEvaluatedSymbol> symbol = jit->lookup(name);
+                check(symbol.takeError(), name);
+                int32_t (*entry)(int32_t) = (int32_t (*)(int32_t)) (uintptr_t) symbol->getAddress();
+                checksum += entry((int32_t) request);
+            }
+            checksums[c] = checksum;
+        });
+    }
+    for (std::thread &client : clients) {
+        client.join();
+    }
+    result.ms = (now() - start) * 1e3;
+
+    result.lookups = (unsigned long) CLIENT_THREADS * REQUEST_COUNT;
+    result.compiles = compiles;
+    result.checksum = checksums[0];
+    for (unsigned c = 1; c < CLIENT_THREADS; c++) {
+        if (checksums[c] != checksums[0]) {
+            fprintf(stderr, "client %u computed %d instead of %d\n", c, checksums[c], checksums[0]);
+            exit(1);
+        }
+    }
+    // A materialization may still be finishing after its symbols became
+    // ready: the pool is drained before the session goes away.
+    if (pool) {
+        pool->shutdown();
+        result.pooled = true;
+        result.pool = pool->metrics();
+    }
+    jit.reset();
+    return result;
+}
+
+static void report(const char *label, const BurstResult &r, double baseline_ms) {
+    printf("%-28s %9.2f ms (%.2fx)  %lu lookups, %lu compiles for %u modules, checksum %d\n", label, r.ms,
+           baseline_ms / r.ms, r.lookups, r.compiles, r.modules, r.checksum);
+    if (!r.pooled) {
+        return;
+    }
+    printf("%-28s jobs %lu, steals %lu, queue depth max %lu mean %.1f, per worker:", "", r.pool.dispatched,
+           r.pool.steals, r.pool.max_depth, r.pool.mean_depth);
+    for (unsigned long executed : r.pool.executed) {
+        printf(" %lu", executed);
+    }
+    printf("\n");
+}
+
+int main(int argc, char const *argv[]) {
+    unsigned workers = argc > 1 ? (unsigned) atoi(argv[1]) : std::max(1u, std::thread::hardware_concurrency());
+
+    LLVMInitializeNativeTarget();
+    LLVMInitializeNativeAsmPrinter();
+
+    printf("%d requests of %d functions, %d client threads, %u workers\n", REQUEST_COUNT, FUNCTIONS_PER_REQUEST,
+           CLIENT_THREADS, workers);
+    BurstResult in_place = run_burst(0, false);
+    report("per module, calling thread", in_place, in_place.ms);
+    report("per module, pool", run_burst(workers, false), in_place.ms);
+    report("per function, calling thread", run_burst(0, true), in_place.ms);
+    report("per function, pool", run_burst(workers, true), in_place.ms);
+}
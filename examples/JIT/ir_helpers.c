@@ -0,0 +1,12 @@
+#include "ir_helpers.h"
+
+void set_branch_weights(LLVMContextRef ctx, LLVMValueRef branch, unsigned then_weight, unsigned else_weight) {
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(ctx);
+    LLVMMetadataRef weights[] = {
+        LLVMMDStringInContext2(ctx, "branch_weights", 14),
+        LLVMValueAsMetadata(LLVMConstInt(i32, then_weight, 0)),
+        LLVMValueAsMetadata(LLVMConstInt(i32, else_weight, 0)),
+    };
+    LLVMMetadataRef node = LLVMMDNodeInContext2(ctx, weights, 3);
+    LLVMSetMetadata(branch, LLVMGetMDKindIDInContext(ctx, "prof", 4), LLVMMetadataAsValue(ctx, node));
+}
@@ -0,0 +1,14 @@
+/**
+ * IR building helpers shared by the JIT examples.
+ */
+
+#ifndef IR_HELPERS_H
+#define IR_HELPERS_H
+
+#include <llvm-c/Core.h>
+
+// Attaches !prof branch_weights to a conditional branch, the weight of the
+// then successor first
+void set_branch_weights(LLVMContextRef ctx, LLVMValueRef branch, unsigned then_weight, unsigned else_weight);
+
+#endif
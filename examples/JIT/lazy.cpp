@@ -0,0 +1,338 @@
+/**
+ * Lazy, per-function JIT compilation of a large generated module.
+ *
+ * The module holds FUNCTION_COUNT functions with a long tail:
+ *
+ * int f_i(int x) {
+ *     int v = x;
+ *     v = (v * 31) ^ (v >> 3) ... ; // BODY_STEPS times
+ *     if (x < 0)
+ *         v += f_j(v);               // referenced, never called here
+ *     return v;
+ * }
+ *
+ * Every f_i is exposed through an ORC lazy reexport: a compile-on-first-call
+ * stub named f_i in the main JITDylib, aliasing f_i.body. f_i.body is
+ * defined by a materialization unit that, when the stub is first hit,
+ * extracts f_i into its own module (the functions it calls are
+ * declarations resolving to their stubs) and hands it to the LLJIT compile
+ * layer. A function that is never called is therefore never compiled. The
+ * report compares the lazy compile time with compiling the whole module up
+ * front.
+ */
+
+#include <llvm-c/Core.h>
+#include <llvm-c/Analysis.h>
+#include <llvm-c/LLJIT.h>
+#include <llvm-c/Orc.h>
+#include <llvm-c/Target.h>
+#include <llvm-c/TargetMachine.h>
+
+#include <llvm/IR/Function.h>
+#include <llvm/IR/GlobalValue.h>
+#include <llvm/IR/GlobalVariable.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Transforms/Utils/ValueMapper.h>
+
+#include <vector>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define FUNCTION_COUNT 1000
+#define BODY_STEPS 16
+#define CALLED_EVERY 20
+
+struct LazyJIT;
+
+struct LazyFunction {
+    LazyJIT *owner;
+    char name[32];
+    bool compiled;
+    double compile_ms;
+};
+
+struct LazyJIT {
+    LLVMOrcLLJITRef jit;
+    LLVMOrcThreadSafeContextRef ts_ctx;
+    LLVMModuleRef source;
+    LLVMOrcLazyCallThroughManagerRef call_through;
+    LLVMOrcIndirectStubsManagerRef stubs;
+    std::vector<LazyFunction> functions;
+    unsigned compiled;
+    double compile_ms;
+};
+
+static void check(LLVMErrorRef err, const char *what) {
+    if (err) {
+        char *msg = LLVMGetErrorMessage(err);
+        fprintf(stderr, "%s: %s\n", what, msg);
+        LLVMDisposeErrorMessage(msg);
+        exit(1);
+    }
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// ======================================================
+// Generated module
+// ======================================================
+
+static LLVMModuleRef build_module(LLVMContextRef ctx) {
+    LLVMModuleRef mod = LLVMModuleCreateWithNameInContext("my_module", ctx);
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(ctx);
+    LLVMTypeRef fun_type = LLVMFunctionType(i32, &i32, 1, 0);
+    LLVMBuilderRef builder = LLVMCreateBuilderInContext(ctx);
+
+    std::vector<LLVMValueRef> funs(FUNCTION_COUNT);
+    for (unsigned i = 0; i < FUNCTION_COUNT; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "f_%u", i);
+        funs[i] = LLVMAddFunction(mod, name, fun_type);
+    }
+
+    for (unsigned i = 0; i < FUNCTION_COUNT; i++) {
+        LLVMValueRef fun = funs[i];
+        LLVMBasicBlockRef entry = LLVMAppendBasicBlockInContext(ctx, fun, "entry");
+        LLVMBasicBlockRef cold = LLVMAppendBasicBlockInContext(ctx, fun, "cold");
+        LLVMBasicBlockRef exit = LLVMAppendBasicBlockInContext(ctx, fun, "exit");
+        LLVMValueRef x = LLVMGetParam(fun, 0);
+
+        LLVMPositionBuilderAtEnd(builder, entry);
+        LLVMValueRef v = x;
+        for (unsigned s = 0; s < BODY_STEPS; s++) {
+            LLVMValueRef scaled = LLVMBuildMul(builder, v, LLVMConstInt(i32, 31 + i + s, 0), "scaled");
+            LLVMValueRef shifted = LLVMBuildAShr(builder, v, LLVMConstInt(i32, 3, 0), "shifted");
+            v = LLVMBuildXor(builder, scaled, shifted, "v");
+        }
+        LLVMValueRef negative = LLVMBuildICmp(builder, LLVMIntSLT, x, LLVMConstInt(i32, 0, 0), "negative");
+        LLVMBuildCondBr(builder, negative, cold, exit);
+
+        LLVMPositionBuilderAtEnd(builder, cold);
+        LLVMValueRef callee = funs[(i * 7 + 1) % FUNCTION_COUNT];
+        LLVMValueRef called = LLVMBuildCall2(builder, fun_type, callee, &v, 1, "called");
+        LLVMValueRef bumped = LLVMBuildAdd(builder, v, called, "bumped");
+        LLVMBuildBr(builder, exit);
+
+        LLVMPositionBuilderAtEnd(builder, exit);
+        LLVMValueRef result = LLVMBuildPhi(builder, i32, "result");
+        LLVMValueRef values[] = { v, bumped };
+        LLVMBasicBlockRef blocks[] = { entry, cold };
+        LLVMAddIncoming(result, values, blocks, 2);
+        LLVMBuildRet(builder, result);
+    }
+    LLVMDisposeBuilder(builder);
+    return mod;
+}
+
+// ======================================================
+// Lazy compilation
+// ======================================================
+
+// Only fun is cloned with its body, as <name>.body, into a fresh module;
+// the globals it references become declarations that resolve to the lazy
+// stubs. The rest of the source module is not visited, so extracting a
+// function costs its own size rather than the size of the module.
+static void declare_referenced(llvm::Module &part, const llvm::Value *value, llvm::ValueToValueMapTy &vmap) {
+    const llvm::Constant *constant = llvm::dyn_cast<llvm::Constant>(value);
+    if (!constant || vmap.count(constant)) {
+        return;
+    }
+    if (const llvm::Function *callee = llvm::dyn_cast<llvm::Function>(constant)) {
+        vmap[callee] = llvm::Function::Create(callee->getFunctionType(), llvm::GlobalValue::ExternalLinkage,
+                                              callee->getName(), &part);
+    } else if (const llvm::GlobalVariable *global = llvm::dyn_cast<llvm::GlobalVariable>(constant)) {
+        vmap[global] = new llvm::GlobalVariable(part, global->getValueType(), global->isConstant(),
+                                                llvm::GlobalValue::ExternalLinkage, nullptr, global->getName());
+    } else if (!llvm::isa<llvm::GlobalValue>(constant)) {
+        for (const llvm::Use &operand : constant->operands()) {
+            declare_referenced(part, operand.get(), vmap);
+        }
+    }
+}
+
+static LLVMModuleRef extract_function(LLVMModuleRef source, const char *name) {
+    llvm::Module *module = llvm::unwrap(source);
+    llvm::Function *fun = module->getFunction(name);
+    llvm::Module *part = new llvm::Module(module->getModuleIdentifier(), module->getContext());
+    part->setDataLayout(module->getDataLayout());
+    part->setTargetTriple(module->getTargetTriple());
+
+    llvm::Function *body = llvm::Function::Create(fun->getFunctionType(), fun->getLinkage(),
+                                                  std::string(name) + ".body", part);
+    llvm::ValueToValueMapTy vmap;
+    vmap[fun] = body;
+    llvm::Function::arg_iterator arg = body->arg_begin();
+    for (const llvm::Argument &param : fun->args()) {
+        arg->setName(param.getName());
+        vmap[&param] = &*arg++;
+    }
+    for (const llvm::BasicBlock &block : *fun) {
+        for (const llvm::Instruction &instruction : block) {
+            for (const llvm::Use &operand : instruction.operands()) {
+                declare_referenced(*part, operand.get(), vmap);
+            }
+        }
+    }
+    llvm::SmallVector<llvm::ReturnInst *, 4> returns;
+    llvm::CloneFunctionInto(body, fun, vmap, llvm::CloneFunctionChangeType::DifferentModule, returns);
+    return llvm::wrap(part);
+}
+
+static void materialize(void *ctx, LLVMOrcMaterializationResponsibilityRef mr) {
+    LazyFunction *fun = static_cast<LazyFunction *>(ctx);
+    LazyJIT *lazy = fun->owner;
+
+    double start = now();
+    LLVMModuleRef part = extract_function(lazy->source, fun->name);
+    LLVMOrcIRTransformLayerEmit(LLVMOrcLLJITGetIRTransformLayer(lazy->jit), mr,
+                                LLVMOrcCreateNewThreadSafeModule(part, lazy->ts_ctx));
+    fun->compile_ms = (now() - start) * 1e3;
+    fun->compiled = true;
+    lazy->compiled++;
+    lazy->compile_ms += fun->compile_ms;
+}
+
+static void discard(void *ctx, LLVMOrcJITDylibRef dylib, LLVMOrcSymbolStringPoolEntryRef symbol) {
+}
+
+static void destroy(void *ctx) {
+}
+
+static void call_through_error(void) {
+    fprintf(stderr, "lazy compilation failed\n");
+    abort();
+}
+
+/**
+ * Installs a compile-on-first-call stub for every function defined in
+ * source, which must live in ts_ctx and outlive the JIT.
+ */
+static void lazy_init(LazyJIT *lazy, LLVMModuleRef source, LLVMOrcThreadSafeContextRef ts_ctx) {
+    lazy->source = source;
+    lazy->ts_ctx = ts_ctx;
+    lazy->compiled = 0;
+    lazy->compile_ms = 0;
+    check(LLVMOrcCreateLLJIT(&lazy->jit, NULL), "jit creation");
+
+    const char *triple = LLVMOrcLLJITGetTripleString(lazy->jit);
+    LLVMOrcExecutionSessionRef session = LLVMOrcLLJITGetExecutionSession(lazy->jit);
+    check(LLVMOrcCreateLocalLazyCallThroughManager(triple, session, (LLVMOrcJITTargetAddress) (uintptr_t) call_through_error,
+                                                    &lazy->call_through), "call-through manager");
+    lazy->stubs = LLVMOrcCreateLocalIndirectStubsManager(triple);
+
+    for (LLVMValueRef fun = LLVMGetFirstFunction(source); fun; fun = LLVMGetNextFunction(fun)) {
+        if (!LLVMIsDeclaration(fun)) {
+            LazyFunction record = {};
+            record.owner = lazy;
+            snprintf(record.name, sizeof(record.name), "%s", LLVMGetValueName(fun));
+            lazy->functions.push_back(record);
+        }
+    }
+
+    LLVMOrcJITDylibRef dylib = LLVMOrcLLJITGetMainJITDylib(lazy->jit);
+    LLVMJITSymbolFlags flags = { LLVMJITSymbolGenericFlagsExported | LLVMJITSymbolGenericFlagsCallable, 0 };
+    std::vector<LLVMOrcCSymbolAliasMapPair> aliases;
+    for (LazyFunction &fun : lazy->functions) {
+        char body[48];
+        snprintf(body, sizeof(body), "%s.body", fun.name);
+
+        // f_i.body: materialized on demand
+        LLVMOrcCSymbolFlagsMapPair symbol = { LLVMOrcLLJITMangleAndIntern(lazy->jit, body), flags };
+        LLVMOrcMaterializationUnitRef unit = LLVMOrcCreateCustomMaterializationUnit(
+            fun.name, &fun, &symbol, 1, NULL, materialize, discard, destroy);
+        check(LLVMOrcJITDylibDefine(dylib, unit), fun.name);
+
+        // f_i: the call-through stub
+        LLVMOrcCSymbolAliasMapPair alias;
+        alias.Name = LLVMOrcLLJITMangleAndIntern(lazy->jit, fun.name);
+        alias.Entry.Name = LLVMOrcLLJITMangleAndIntern(lazy->jit, body);
+        alias.Entry.Flags = flags;
+        aliases.push_back(alias);
+    }
+    check(LLVMOrcJITDylibDefine(dylib, LLVMOrcLazyReexports(lazy->call_through, lazy->stubs, dylib,
+                                                           aliases.data(), aliases.size())), "lazy reexports");
+}
+
+static void *lazy_lookup(LazyJIT *lazy, const char *name) {
+    LLVMOrcJITTargetAddress addr;
+    check(LLVMOrcLLJITLookup(lazy->jit, &addr, name), name);
+    return (void *) (uintptr_t) addr;
+}
+
+// The stubs and the call-through manager refer to the execution session of
+// the JIT, they go first.
+static void lazy_dispose(LazyJIT *lazy) {
+    LLVMOrcDisposeIndirectStubsManager(lazy->stubs);
+    LLVMOrcDisposeLazyCallThroughManager(lazy->call_through);
+    LLVMOrcDisposeLLJIT(lazy->jit);
+}
+
+int main(int argc, char const *argv[]) {
+    LLVMInitializeNativeTarget();
+    LLVMInitializeNativeAsmPrinter();
+
+    LLVMOrcThreadSafeContextRef ts_ctx = LLVMOrcCreateNewThreadSafeContext();
+    LLVMModuleRef mod = build_module(LLVMOrcThreadSafeContextGetContext(ts_ctx));
+
+    //Analysis
+    char *error = NULL;
+    if (LLVMVerifyModule(mod, LLVMReturnStatusAction, &error)) {
+        fprintf(stderr, "%s\n", error);
+        return 1;
+    }
+    LLVMDisposeMessage(error);
+
+    // Baseline: everything compiled up front
+    LLVMOrcLLJITRef eager;
+    check(LLVMOrcCreateLLJIT(&eager, NULL), "jit creation");
+    double start = now();
+    check(LLVMOrcLLJITAddLLVMIRModule(eager, LLVMOrcLLJITGetMainJITDylib(eager),
+                                      LLVMOrcCreateNewThreadSafeModule(LLVMCloneModule(mod), ts_ctx)), "eager module");
+    LLVMOrcJITTargetAddress eager_addr;
+    check(LLVMOrcLLJITLookup(eager, &eager_addr, "f_0"), "f_0");
+    double eager_ms = (now() - start) * 1e3;
+    int32_t (*eager_f0)(int32_t) = (int32_t (*)(int32_t)) (uintptr_t) eager_addr;
+
+    // Lazy: stubs only, bodies compiled on first call
+    LazyJIT lazy;
+    start = now();
+    lazy_init(&lazy, mod, ts_ctx);
+    double setup_ms = (now() - start) * 1e3;
+
+    int32_t checksum = 0;
+    start = now();
+    for (unsigned i = 0; i < FUNCTION_COUNT; i += CALLED_EVERY) {
+        char name[32];
+        snprintf(name, sizeof(name), "f_%u", i);
+        int32_t (*f)(int32_t) = (int32_t (*)(int32_t)) lazy_lookup(&lazy, name);
+        for (int32_t x = 1; x <= 100; x++) {
+            checksum ^= f(x);
+        }
+    }
+    double lazy_run_ms = (now() - start) * 1e3;
+
+    unsigned never = FUNCTION_COUNT - lazy.compiled;
+    printf("functions: %u, compiled lazily: %u, never compiled: %u\n", FUNCTION_COUNT, lazy.compiled, never);
+    printf("eager compile:  %8.2f ms\n", eager_ms);
+    printf("lazy setup:     %8.2f ms (stubs and materialization units)\n", setup_ms);
+    printf("lazy compiles:  %8.2f ms (%.3f ms per function)\n", lazy.compile_ms,
+           lazy.compiled ? lazy.compile_ms / lazy.compiled : 0.0);
+    printf("time saved:     %8.2f ms (%.1f%%)\n", eager_ms - setup_ms - lazy.compile_ms,
+           100.0 * (eager_ms - setup_ms - lazy.compile_ms) / eager_ms);
+    printf("first calls, compiles included: %.2f ms; f_0(1): eager %d, lazy %d [%d]\n", lazy_run_ms,
+           eager_f0(1), ((int32_t (*)(int32_t)) lazy_lookup(&lazy, "f_0"))(1), checksum & 1);
+
+    lazy_dispose(&lazy);
+    LLVMOrcDisposeLLJIT(eager);
+    LLVMDisposeModule(mod);
+    LLVMOrcDisposeThreadSafeContext(ts_ctx);
+}
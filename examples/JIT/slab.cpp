@@ -0,0 +1,526 @@
+/**
+ * Slab-based executable memory for JIT code, with reuse after unload.
+ *
+ * The default memory manager of the RuntimeDyld linking layer maps fresh
+ * pages for the code, read-only data and read-write data of every object
+ * and changes their permissions once linked: a tiny function costs several
+ * mmap and mprotect calls and at least three pages of address space.
+ *
+ * SlabArena reserves ARENA_SIZE bytes of address space once and carves it
+ * into SLAB_SIZE slabs, mapped on demand. A code slab is a memfd mapped
+ * twice: read-write where the linker writes the code and read-execute
+ * where it runs, so the sections of many objects are packed in the same
+ * pages without ever making a page writable and executable, and without a
+ * single mprotect. SlabMemoryManager, one per object, takes its sections
+ * from the arena, tells RuntimeDyld to relocate the code for its
+ * executable address (notifyObjectLoaded) and gives its ranges back when
+ * the object is removed from the JIT. Read-only data goes with the code,
+ * read-write data in data slabs of the same arena, so that every reference
+ * of the code stays within the +-2 GB of the small code model. Exception
+ * frames are not registered: the generated code does not throw.
+ *
+ * The workload loads and unloads tiny functions, with a counter each:
+ *
+ * long count_i;
+ * int f_i(int x) {
+ *     count_i++;
+ *     return x * (i + 1) + 7;
+ * }
+ *
+ * SLOTS objects are compiled once up front. Each of the LOADS iterations
+ * removes the object of a slot from the JIT if there is one, adds it again
+ * under a new resource tracker and calls it. The time per load and unload,
+ * the memory syscalls and the mappings of the process are compared with
+ * the default memory manager, and the arena reports its utilization and
+ * fragmentation.
+ */
+
+#include <llvm-c/Core.h>
+#include <llvm-c/Analysis.h>
+#include <llvm-c/Target.h>
+#include <llvm-c/TargetMachine.h>
+
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h>
+#include <llvm/ExecutionEngine/RuntimeDyld.h>
+#include <llvm/ExecutionEngine/SectionMemoryManager.h>
+#include <llvm/Support/Memory.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ARENA_SIZE (256UL << 20)
+#define SLAB_SIZE (4UL << 20)
+#define MIN_ALIGN 16
+#define SLOTS 256
+#define LOADS 20000
+
+using namespace llvm;
+using namespace llvm::orc;
+
+static void check(Error err, const char *what) {
+    if (err) {
+        fprintf(stderr, "%s: %s\n", what, toString(std::move(err)).c_str());
+        exit(1);
+    }
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static unsigned mapping_count(void) {
+    unsigned lines = 0;
+    FILE *maps = fopen("/proc/self/maps", "r");
+    if (maps) {
+        int c;
+        while ((c = fgetc(maps)) != EOF) {
+            lines += c == '\n';
+        }
+        fclose(maps);
+    }
+    return lines;
+}
+
+// ======================================================
+// Slab arena
+// ======================================================
+
+struct SlabRange {
+    uint8_t *write;             // where the linker writes
+    uint8_t *exec;              // where the code runs, write for data
+    size_t offset;
+    size_t size;
+    unsigned slab;
+};
+
+struct ArenaStats {
+    unsigned code_slabs;
+    unsigned data_slabs;
+    size_t touched;             // up to the highest range ever handed out
+    size_t used;
+    size_t free;                // below the high-water marks
+    size_t largest_free;        // summed over the slabs
+    unsigned free_ranges;
+    unsigned long syscalls;
+};
+
+class SlabArena {
+public:
+    SlabArena() {
+        void *reserved = mmap(nullptr, ARENA_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (reserved == MAP_FAILED) {
+            perror("arena reservation");
+            exit(1);
+        }
+        base = (uint8_t *) reserved;
+        syscalls = 1;
+    }
+
+    ~SlabArena() {
+        for (Slab &slab : slabs) {
+            if (slab.write != slab.exec) {
+                munmap(slab.write, SLAB_SIZE);
+                close(slab.fd);
+            }
+        }
+        munmap(base, ARENA_SIZE);
+    }
+
+    SlabArena(const SlabArena &) = delete;
+    SlabArena &operator=(const SlabArena &) = delete;
+
+    // First fit in the slabs of the kind, a new slab when none has room
+    SlabRange allocate(bool code, size_t size, unsigned alignment) {
+        std::lock_guard<std::mutex> lock(mutex);
+        size = (size + MIN_ALIGN - 1) & ~(size_t) (MIN_ALIGN - 1);
+        alignment = alignment < MIN_ALIGN ? MIN_ALIGN : alignment;
+        if (size + alignment > SLAB_SIZE) {
+            fprintf(stderr, "section of %zu bytes larger than a slab\n", size);
+            exit(1);
+        }
+        for (unsigned s = 0; s < slabs.size(); s++) {
+            SlabRange range;
+            if (slabs[s].code == code && carve(s, size, alignment, &range)) {
+                return range;
+            }
+        }
+        unsigned s = add_slab(code);
+        SlabRange range;
+        carve(s, size, alignment, &range);
+        return range;
+    }
+
+    // Back to the free ranges of its slab, merged with its neighbours
+    void release(const SlabRange &range) {
+        std::lock_guard<std::mutex> lock(mutex);
+        Slab &slab = slabs[range.slab];
+        used -= range.size;
+        size_t offset = range.offset, size = range.size;
+        auto next = slab.free.lower_bound(offset);
+        if (next != slab.free.end() && offset + size == next->first) {
+            size += next->second;
+            next = slab.free.erase(next);
+        }
+        if (next != slab.free.begin()) {
+            auto previous = std::prev(next);
+            if (previous->first + previous->second == offset) {
+                previous->second += size;
+                return;
+            }
+        }
+        slab.free.emplace(offset, size);
+    }
+
+    ArenaStats stats() {
+        std::lock_guard<std::mutex> lock(mutex);
+        ArenaStats s = {};
+        for (const Slab &slab : slabs) {
+            (slab.code ? s.code_slabs : s.data_slabs)++;
+            s.touched += slab.high_water;
+            size_t largest = 0;
+            for (const auto &range : slab.free) {
+                size_t below = std::min(range.first + range.second, slab.high_water);
+                if (below > range.first) {
+                    s.free += below - range.first;
+                    largest = std::max(largest, below - range.first);
+                    s.free_ranges++;
+                }
+            }
+            s.largest_free += largest;
+        }
+        s.used = used;
+        s.syscalls = syscalls;
+        return s;
+    }
+
+private:
+    struct Slab {
+        bool code;
+        int fd;
+        uint8_t *write;
+        uint8_t *exec;
+        std::map<size_t, size_t> free;  // offset -> size
+        size_t high_water;
+    };
+
+    unsigned add_slab(bool code) {
+        if ((slabs.size() + 1) * SLAB_SIZE > ARENA_SIZE) {
+            fprintf(stderr, "arena exhausted\n");
+            exit(1);
+        }
+        Slab slab;
+        slab.code = code;
+        slab.fd = -1;
+        slab.high_water = 0;
+        slab.exec = base + slabs.size() * SLAB_SIZE;
+        if (code) {
+            slab.fd = memfd_create("jit-code", MFD_CLOEXEC);
+            bool mapped = slab.fd >= 0 && ftruncate(slab.fd, SLAB_SIZE) == 0
+                && mmap(slab.exec, SLAB_SIZE, PROT_READ | PROT_EXEC, MAP_SHARED | MAP_FIXED, slab.fd, 0) != MAP_FAILED;
+            void *write = mapped ? mmap(nullptr, SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, slab.fd, 0) : MAP_FAILED;
+            if (write == MAP_FAILED) {
+                perror("code slab");
+                exit(1);
+            }
+            slab.write = (uint8_t *) write;
+            syscalls += 4;
+        } else {
+            if (mmap(slab.exec, SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+                perror("data slab");
+                exit(1);
+            }
+            slab.write = slab.exec;
+            syscalls += 1;
+        }
+        slab.free.emplace(0, SLAB_SIZE);
+        slabs.push_back(std::move(slab));
+        return slabs.size() - 1;
+    }
+
+    bool carve(unsigned s, size_t size, size_t alignment, SlabRange *range) {
+        Slab &slab = slabs[s];
+        for (auto it = slab.free.begin(); it != slab.free.end(); ++it) {
+            size_t start = it->first, end = it->first + it->second;
+            size_t aligned = (start + alignment - 1) & ~(alignment - 1);
+            if (aligned + size > end) {
+                continue;
+            }
+            slab.free.erase(it);
+            if (aligned > start) {
+                slab.free.emplace(start, aligned - start);
+            }
+            if (aligned + size < end) {
+                slab.free.emplace(aligned + size, end - aligned - size);
+            }
+            range->write = slab.write + aligned;
+            range->exec = slab.exec + aligned;
+            range->offset = aligned;
+            range->size = size;
+            range->slab = s;
+            slab.high_water = std::max(slab.high_water, aligned + size);
+            used += size;
+            return true;
+        }
+        return false;
+    }
+
+    std::mutex mutex;
+    uint8_t *base;
+    std::vector<Slab> slabs;
+    size_t used = 0;
+    unsigned long syscalls;
+};
+
+/**
+ * The sections of one object. RuntimeDyld writes through the write address
+ * of the code and read-only data, notifyObjectLoaded() moves their load
+ * address to the executable view before the relocations are resolved.
+ */
+class SlabMemoryManager : public RuntimeDyld::MemoryManager {
+public:
+    explicit SlabMemoryManager(SlabArena &arena) : arena(arena) {}
+
+    ~SlabMemoryManager() override {
+        for (const SlabRange &range : ranges) {
+            arena.release(range);
+        }
+    }
+
+    uint8_t *allocateCodeSection(uintptr_t size, unsigned alignment, unsigned, StringRef) override {
+        ranges.push_back(arena.allocate(true, size, alignment));
+        return ranges.back().write;
+    }
+
+    uint8_t *allocateDataSection(uintptr_t size, unsigned alignment, unsigned, StringRef, bool read_only) override {
+        ranges.push_back(arena.allocate(read_only, size, alignment));
+        return ranges.back().write;
+    }
+
+    void notifyObjectLoaded(RuntimeDyld &dyld, const object::ObjectFile &) override {
+        for (const SlabRange &range : ranges) {
+            if (range.write != range.exec) {
+                dyld.mapSectionAddress(range.write, (uint64_t) (uintptr_t) range.exec);
+            }
+        }
+    }
+
+    void registerEHFrames(uint8_t *, uint64_t, size_t) override {}
+    void deregisterEHFrames() override {}
+
+    bool finalizeMemory(std::string *) override {
+        // The pages are executable already; no-op on x86-64, needed elsewhere
+        for (const SlabRange &range : ranges) {
+            if (range.write != range.exec) {
+                __builtin___clear_cache((char *) range.exec, (char *) range.exec + range.size);
+            }
+        }
+        return false;
+    }
+
+private:
+    SlabArena &arena;
+    std::vector<SlabRange> ranges;
+};
+
+// ======================================================
+// Default memory manager, with its syscalls counted
+// ======================================================
+
+class CountingMapper : public SectionMemoryManager::MemoryMapper {
+public:
+    sys::MemoryBlock allocateMappedMemory(SectionMemoryManager::AllocationPurpose, size_t bytes,
+                                          const sys::MemoryBlock *const near, unsigned flags,
+                                          std::error_code &ec) override {
+        syscalls++;
+        return sys::Memory::allocateMappedMemory(bytes, near, flags, ec);
+    }
+
+    std::error_code protectMappedMemory(const sys::MemoryBlock &block, unsigned flags) override {
+        syscalls++;
+        return sys::Memory::protectMappedMemory(block, flags);
+    }
+
+    std::error_code releaseMappedMemory(sys::MemoryBlock &block) override {
+        syscalls++;
+        return sys::Memory::releaseMappedMemory(block);
+    }
+
+    std::atomic<unsigned long> syscalls{0};
+};
+
+// ======================================================
+// Objects
+// ======================================================
+
+static std::unique_ptr<MemoryBuffer> compile_slot(LLVMTargetMachineRef tm, unsigned i) {
+    LLVMContextRef ctx = LLVMContextCreate();
+    char name[32];
+    snprintf(name, sizeof(name), "slot_%u", i);
+    LLVMModuleRef mod = LLVMModuleCreateWithNameInContext(name, ctx);
+    LLVMSetTarget(mod, LLVMGetTargetMachineTriple(tm));
+    LLVMTargetDataRef layout = LLVMCreateTargetDataLayout(tm);
+    LLVMSetModuleDataLayout(mod, layout);
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(ctx);
+    LLVMTypeRef i64 = LLVMInt64TypeInContext(ctx);
+
+    snprintf(name, sizeof(name), "count_%u", i);
+    LLVMValueRef count = LLVMAddGlobal(mod, i64, name);
+    LLVMSetInitializer(count, LLVMConstInt(i64, 0, 0));
+
+    snprintf(name, sizeof(name), "f_%u", i);
+    LLVMValueRef fun = LLVMAddFunction(mod, name, LLVMFunctionType(i32, &i32, 1, 0));
+    LLVMBuilderRef builder = LLVMCreateBuilderInContext(ctx);
+    LLVMPositionBuilderAtEnd(builder, LLVMAppendBasicBlockInContext(ctx, fun, "entry"));
+    LLVMValueRef calls = LLVMBuildLoad2(builder, i64, count, "calls");
+    LLVMBuildStore(builder, LLVMBuildAdd(builder, calls, LLVMConstInt(i64, 1, 0), "calls"), count);
+    LLVMValueRef scaled = LLVMBuildMul(builder, LLVMGetParam(fun, 0), LLVMConstInt(i32, i + 1, 0), "scaled");
+    LLVMBuildRet(builder, LLVMBuildAdd(builder, scaled, LLVMConstInt(i32, 7, 0), "tmp"));
+    LLVMDisposeBuilder(builder);
+
+    char *error = NULL;
+    if (LLVMVerifyModule(mod, LLVMReturnStatusAction, &error)) {
+        fprintf(stderr, "%s\n", error);
+        exit(1);
+    }
+    LLVMDisposeMessage(error);
+    LLVMMemoryBufferRef object;
+    if (LLVMTargetMachineEmitToMemoryBuffer(tm, mod, LLVMObjectFile, &error, &object) != 0) {
+        fprintf(stderr, "%s\n", error);
+        exit(1);
+    }
+    std::unique_ptr<MemoryBuffer> buffer = MemoryBuffer::getMemBufferCopy(
+        StringRef(LLVMGetBufferStart(object), LLVMGetBufferSize(object)), name);
+    LLVMDisposeMemoryBuffer(object);
+    LLVMDisposeTargetData(layout);
+    LLVMDisposeModule(mod);
+    LLVMContextDispose(ctx);
+    return buffer;
+}
+
+// ======================================================
+// Load and unload
+// ======================================================
+
+struct RunResult {
+    double us_per_load;
+    unsigned long syscalls;
+    unsigned mappings;
+    ArenaStats live;            // with SLOTS objects loaded
+    ArenaStats unloaded;        // once the JIT is gone
+};
+
+static RunResult run(const std::vector<std::unique_ptr<MemoryBuffer>> &objects, SlabArena *arena) {
+    CountingMapper mapper;
+    Expected<std::unique_ptr<LLJIT>> created = LLJITBuilder()
+        .setObjectLinkingLayerCreator([&](ExecutionSession &es, const Triple &) -> Expected<std::unique_ptr<ObjectLayer>> {
+            return std::make_unique<RTDyldObjectLinkingLayer>(es, [&]() -> std::unique_ptr<RuntimeDyld::MemoryManager> {
+                if (arena) {
+                    return std::make_unique<SlabMemoryManager>(*arena);
+                }
+                return std::make_unique<SectionMemoryManager>(&mapper);
+            });
+        })
+        .create();
+    check(created.takeError(), "jit creation");
+    std::unique_ptr<LLJIT> jit = std::move(*created);
+    JITDylib &main = jit->getMainJITDylib();
+
+    std::vector<ResourceTrackerSP> trackers(SLOTS);
+    unsigned long syscalls_before = arena ? arena->stats().syscalls : 0;
+    double start = now();
+    for (unsigned n = 0; n < LOADS; n++) {
+        unsigned slot = n % SLOTS;
+        if (trackers[slot]) {
+            check(trackers[slot]->remove(), "remove");
+        }
+        trackers[slot] = main.createResourceTracker();
+        check(jit->addObjectFile(trackers[slot], MemoryBuffer::getMemBuffer(objects[slot]->getMemBufferRef(), false)),
+              "add object");
+        char name[32];
+        snprintf(name, sizeof(name), "f_%u", slot);
+        Expected<JITEvaluatedSymbol> symbol = jit->lookup(name);
+        check(symbol.takeError(), "lookup");
+        int (*f)(int) = (int (*)(int)) symbol->getAddress();
+        int x = (int) n;
+        if (f(x) != x * (int) (slot + 1) + 7) {
+            fprintf(stderr, "f_%u(%d) = %d\n", slot, x, f(x));
+            exit(1);
+        }
+    }
+    RunResult result = {};
+    result.us_per_load = (now() - start) * 1e6 / LOADS;
+    result.mappings = mapping_count();
+    result.syscalls = arena ? arena->stats().syscalls - syscalls_before : mapper.syscalls.load();
+    if (arena) {
+        result.live = arena->stats();
+    }
+    // The trackers refer to the session, they go first
+    trackers.clear();
+    jit.reset();
+    if (arena) {
+        result.unloaded = arena->stats();
+    }
+    return result;
+}
+
+static void report(const char *label, const RunResult &r) {
+    printf("%-22s %7.2f us per load+unload, %5.2f memory syscalls per load, %u mappings with %d objects live\n",
+           label, r.us_per_load, (double) r.syscalls / LOADS, r.mappings, SLOTS);
+}
+
+/**
+ * Utilization: bytes in use over the bytes of the slabs touched so far.
+ * Fragmentation: share of the free bytes below the high-water marks that
+ * are not in the largest free range of their slab.
+ */
+static void report_arena(const char *when, const ArenaStats &s) {
+    printf("  %-15s %u code + %u data slabs of %lu kB, %zu of %zu bytes touched in use (%.1f%%),"
+           " %u free ranges, fragmentation %.1f%%\n",
+           when, s.code_slabs, s.data_slabs, SLAB_SIZE >> 10, s.used, s.touched,
+           s.touched ? 100.0 * s.used / s.touched : 0.0, s.free_ranges,
+           s.free ? 100.0 * (1.0 - (double) s.largest_free / s.free) : 0.0);
+}
+
+int main(int argc, char const *argv[]) {
+    LLVMInitializeNativeTarget();
+    LLVMInitializeNativeAsmPrinter();
+
+    char *triple = LLVMGetDefaultTargetTriple();
+    char *error = NULL;
+    LLVMTargetRef target;
+    if (LLVMGetTargetFromTriple(triple, &target, &error) != 0) {
+        fprintf(stderr, "%s\n", error);
+        return 1;
+    }
+    // Position independent: the data is reached relative to the code
+    LLVMTargetMachineRef tm = LLVMCreateTargetMachine(target, triple, "", "", LLVMCodeGenLevelDefault, LLVMRelocPIC, LLVMCodeModelSmall);
+    std::vector<std::unique_ptr<MemoryBuffer>> objects;
+    for (unsigned i = 0; i < SLOTS; i++) {
+        objects.push_back(compile_slot(tm, i));
+    }
+    LLVMDisposeTargetMachine(tm);
+    LLVMDisposeMessage(triple);
+
+    printf("%d loads and unloads of %d tiny objects\n", LOADS, SLOTS);
+    report("SectionMemoryManager", run(objects, nullptr));
+
+    SlabArena arena;
+    RunResult slab = run(objects, &arena);
+    report("SlabMemoryManager", slab);
+    report_arena("objects loaded:", slab.live);
+    report_arena("all unloaded:", slab.unloaded);
+}
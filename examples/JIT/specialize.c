@@ -0,0 +1,417 @@
+/**
+ * Runtime specialization of generated functions on constant arguments.
+ *
+ * The source module holds the generic versions of:
+ *
+ * int sum(int a, int b) {
+ *     return a + b;
+ * }
+ *
+ * int scaled_sum(int *a, long n, int k) {
+ *     int acc = 0;
+ *     for (long i = 0; i < n; i++)
+ *         acc += a[i] * k;
+ *     return acc;
+ * }
+ *
+ * specialize() clones the module, adds a variant taking only the unbound
+ * parameters that calls the original with the bound ones as constants,
+ * lets the optimizer inline and fold it, and JITs the result. Variants are
+ * kept in a bounded LRU cache keyed by function, bound parameters and
+ * bound values; evicted variants are unloaded through their resource
+ * tracker. Every address returned by specialize() pins its variant until
+ * specialize_release(), and a pinned variant is never evicted.
+ */
+
+#include <llvm-c/Core.h>
+#include <llvm-c/Analysis.h>
+#include <llvm-c/Target.h>
+#include <llvm-c/TargetMachine.h>
+#include <llvm-c/LLJIT.h>
+#include <llvm-c/Orc.h>
+#include <llvm-c/Transforms/PassBuilder.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_PARAMS 8
+#define CACHE_CAPACITY 4
+
+typedef struct {
+    char function[64];
+    unsigned bound_mask;            // bit i set when parameter i is bound
+    int64_t values[MAX_PARAMS];     // only meaningful for bound parameters
+    void *address;
+    LLVMOrcResourceTrackerRef tracker;
+    uint64_t last_use;
+    unsigned pins;                  // addresses handed out and not released
+} Variant;
+
+typedef struct {
+    LLVMOrcLLJITRef jit;
+    LLVMOrcThreadSafeContextRef ts_ctx;
+    LLVMModuleRef source;
+    LLVMTargetMachineRef target_machine;
+    Variant variants[CACHE_CAPACITY];
+    unsigned count;
+    uint64_t clock;
+    uint64_t next_id;
+    uint64_t hits, misses, evictions;
+} Specializer;
+
+static void check(LLVMErrorRef err, const char *what) {
+    if (err) {
+        char *msg = LLVMGetErrorMessage(err);
+        fprintf(stderr, "%s: %s\n", what, msg);
+        LLVMDisposeErrorMessage(msg);
+        exit(1);
+    }
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// ======================================================
+// Generic source module
+// ======================================================
+
+static void build_sum(LLVMModuleRef mod, LLVMBuilderRef builder) {
+    LLVMContextRef ctx = LLVMGetModuleContext(mod);
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(ctx);
+    LLVMTypeRef param_types[] = { i32, i32 };
+    LLVMValueRef sum = LLVMAddFunction(mod, "sum", LLVMFunctionType(i32, param_types, 2, 0));
+    LLVMPositionBuilderAtEnd(builder, LLVMAppendBasicBlockInContext(ctx, sum, "entry"));
+    LLVMValueRef tmp = LLVMBuildAdd(builder, LLVMGetParam(sum, 0), LLVMGetParam(sum, 1), "tmp");
+    LLVMBuildRet(builder, tmp);
+}
+
+static void build_scaled_sum(LLVMModuleRef mod, LLVMBuilderRef builder) {
+    LLVMContextRef ctx = LLVMGetModuleContext(mod);
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(ctx);
+    LLVMTypeRef i64 = LLVMInt64TypeInContext(ctx);
+    LLVMTypeRef param_types[] = { LLVMPointerType(i32, 0), i64, i32 };
+    LLVMValueRef fun = LLVMAddFunction(mod, "scaled_sum", LLVMFunctionType(i32, param_types, 3, 0));
+    LLVMValueRef a = LLVMGetParam(fun, 0);
+    LLVMValueRef n = LLVMGetParam(fun, 1);
+    LLVMValueRef k = LLVMGetParam(fun, 2);
+
+    LLVMBasicBlockRef entry = LLVMAppendBasicBlockInContext(ctx, fun, "entry");
+    LLVMBasicBlockRef loop = LLVMAppendBasicBlockInContext(ctx, fun, "loop");
+    LLVMBasicBlockRef exit = LLVMAppendBasicBlockInContext(ctx, fun, "exit");
+
+    LLVMPositionBuilderAtEnd(builder, entry);
+    LLVMValueRef empty = LLVMBuildICmp(builder, LLVMIntSLE, n, LLVMConstInt(i64, 0, 0), "empty");
+    LLVMBuildCondBr(builder, empty, exit, loop);
+
+    LLVMPositionBuilderAtEnd(builder, loop);
+    LLVMValueRef i = LLVMBuildPhi(builder, i64, "i");
+    LLVMValueRef acc = LLVMBuildPhi(builder, i32, "acc");
+    LLVMValueRef ptr = LLVMBuildGEP2(builder, i32, a, &i, 1, "ptr");
+    LLVMValueRef elem = LLVMBuildLoad2(builder, i32, ptr, "elem");
+    LLVMValueRef scaled = LLVMBuildMul(builder, elem, k, "scaled");
+    LLVMValueRef next_acc = LLVMBuildAdd(builder, acc, scaled, "next_acc");
+    LLVMValueRef next_i = LLVMBuildAdd(builder, i, LLVMConstInt(i64, 1, 0), "next_i");
+    LLVMValueRef done = LLVMBuildICmp(builder, LLVMIntEQ, next_i, n, "done");
+    LLVMBuildCondBr(builder, done, exit, loop);
+
+    LLVMValueRef i_values[] = { LLVMConstInt(i64, 0, 0), next_i };
+    LLVMValueRef acc_values[] = { LLVMConstInt(i32, 0, 0), next_acc };
+    LLVMBasicBlockRef incoming[] = { entry, loop };
+    LLVMAddIncoming(i, i_values, incoming, 2);
+    LLVMAddIncoming(acc, acc_values, incoming, 2);
+
+    LLVMPositionBuilderAtEnd(builder, exit);
+    LLVMValueRef result = LLVMBuildPhi(builder, i32, "result");
+    LLVMValueRef result_values[] = { LLVMConstInt(i32, 0, 0), next_acc };
+    LLVMAddIncoming(result, result_values, incoming, 2);
+    LLVMBuildRet(builder, result);
+}
+
+// ======================================================
+// Specialization
+// ======================================================
+
+/**
+ * Builds the specialized variant of function in a clone of the source
+ * module. Only integer parameters can be bound. Returns NULL when the
+ * function does not exist or a bound parameter is not an integer.
+ */
+static LLVMModuleRef build_variant(Specializer *s, const char *function, unsigned bound_mask,
+                                   const int64_t *values, const char *variant_name) {
+    LLVMValueRef original = LLVMGetNamedFunction(s->source, function);
+    if (!original || LLVMIsDeclaration(original)) {
+        return NULL;
+    }
+    LLVMTypeRef fun_type = LLVMGlobalGetValueType(original);
+    unsigned param_count = LLVMCountParamTypes(fun_type);
+    if (param_count > MAX_PARAMS) {
+        return NULL;
+    }
+    LLVMTypeRef param_types[MAX_PARAMS];
+    LLVMGetParamTypes(fun_type, param_types);
+    for (unsigned i = 0; i < param_count; i++) {
+        if ((bound_mask & (1u << i)) && LLVMGetTypeKind(param_types[i]) != LLVMIntegerTypeKind) {
+            return NULL;
+        }
+    }
+
+    LLVMModuleRef mod = LLVMCloneModule(s->source);
+    LLVMContextRef ctx = LLVMGetModuleContext(mod);
+    LLVMValueRef target = LLVMGetNamedFunction(mod, function);
+
+    // Everything but the variant becomes internal, so the optimizer can
+    // inline the original and drop whatever the variant does not use.
+    for (LLVMValueRef fun = LLVMGetFirstFunction(mod); fun; fun = LLVMGetNextFunction(fun)) {
+        if (!LLVMIsDeclaration(fun)) {
+            LLVMSetLinkage(fun, LLVMInternalLinkage);
+        }
+    }
+    unsigned always_inline = LLVMGetEnumAttributeKindForName("alwaysinline", 12);
+    LLVMAddAttributeAtIndex(target, LLVMAttributeFunctionIndex, LLVMCreateEnumAttribute(ctx, always_inline, 0));
+
+    // Variant prototype: the unbound parameters only
+    LLVMTypeRef variant_params[MAX_PARAMS];
+    unsigned variant_count = 0;
+    for (unsigned i = 0; i < param_count; i++) {
+        if (!(bound_mask & (1u << i))) {
+            variant_params[variant_count++] = param_types[i];
+        }
+    }
+    LLVMTypeRef ret_type = LLVMGetReturnType(fun_type);
+    LLVMValueRef variant = LLVMAddFunction(mod, variant_name, LLVMFunctionType(ret_type, variant_params, variant_count, 0));
+
+    // Variant body: forward to the original with the bound constants
+    LLVMBuilderRef builder = LLVMCreateBuilderInContext(ctx);
+    LLVMPositionBuilderAtEnd(builder, LLVMAppendBasicBlockInContext(ctx, variant, "entry"));
+    LLVMValueRef args[MAX_PARAMS];
+    for (unsigned i = 0, next = 0; i < param_count; i++) {
+        args[i] = (bound_mask & (1u << i)) ? LLVMConstInt(param_types[i], (unsigned long long) values[i], 1)
+                                           : LLVMGetParam(variant, next++);
+    }
+    LLVMValueRef call = LLVMBuildCall2(builder, fun_type, target, args, param_count, "");
+    if (LLVMGetTypeKind(ret_type) == LLVMVoidTypeKind) {
+        LLVMBuildRetVoid(builder);
+    } else {
+        LLVMBuildRet(builder, call);
+    }
+    LLVMDisposeBuilder(builder);
+
+    // Inline, fold the constants and clean up
+    LLVMPassBuilderOptionsRef options = LLVMCreatePassBuilderOptions();
+    check(LLVMRunPasses(mod, "default<O3>", s->target_machine, options), "optimization");
+    LLVMDisposePassBuilderOptions(options);
+    return mod;
+}
+
+static int same_key(const Variant *v, const char *function, unsigned bound_mask, const int64_t *values) {
+    if (v->bound_mask != bound_mask || strcmp(v->function, function) != 0) {
+        return 0;
+    }
+    for (unsigned i = 0; i < MAX_PARAMS; i++) {
+        if ((bound_mask & (1u << i)) && v->values[i] != values[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Returns the address of function specialized on the parameters selected
+ * by bound_mask, values[i] being the constant bound to parameter i. The
+ * variant is compiled on the first request and served from the cache
+ * afterwards. The address stays valid until it is given back with
+ * specialize_release(). Returns NULL when the function cannot be
+ * specialized, or when every slot of the cache holds a pinned variant.
+ */
+static void *specialize(Specializer *s, const char *function, unsigned bound_mask, const int64_t *values) {
+    s->clock++;
+    for (unsigned i = 0; i < s->count; i++) {
+        if (same_key(&s->variants[i], function, bound_mask, values)) {
+            s->hits++;
+            s->variants[i].last_use = s->clock;
+            s->variants[i].pins++;
+            return s->variants[i].address;
+        }
+    }
+    s->misses++;
+    if (strlen(function) >= sizeof(s->variants[0].function)) {
+        return NULL;
+    }
+
+    // A free slot, or the least recently used variant nobody holds
+    Variant *slot = NULL;
+    if (s->count < CACHE_CAPACITY) {
+        slot = &s->variants[s->count];
+    } else {
+        for (unsigned i = 0; i < s->count; i++) {
+            Variant *v = &s->variants[i];
+            if (v->pins == 0 && (!slot || v->last_use < slot->last_use)) {
+                slot = v;
+            }
+        }
+        if (!slot) {
+            return NULL;
+        }
+    }
+
+    char variant_name[96];
+    snprintf(variant_name, sizeof(variant_name), "%s__spec%llu", function, (unsigned long long) s->next_id++);
+    LLVMModuleRef mod = build_variant(s, function, bound_mask, values, variant_name);
+    if (!mod) {
+        return NULL;
+    }
+
+    // Make room by unloading the victim
+    if (s->count < CACHE_CAPACITY) {
+        s->count++;
+    } else {
+        check(LLVMOrcResourceTrackerRemove(slot->tracker), "variant unloading");
+        LLVMOrcReleaseResourceTracker(slot->tracker);
+        s->evictions++;
+    }
+
+    LLVMOrcJITDylibRef dylib = LLVMOrcLLJITGetMainJITDylib(s->jit);
+    LLVMOrcResourceTrackerRef tracker = LLVMOrcJITDylibCreateResourceTracker(dylib);
+    check(LLVMOrcLLJITAddLLVMIRModuleWithRT(s->jit, tracker, LLVMOrcCreateNewThreadSafeModule(mod, s->ts_ctx)), "add variant");
+    LLVMOrcJITTargetAddress addr;
+    check(LLVMOrcLLJITLookup(s->jit, &addr, variant_name), variant_name);
+
+    strcpy(slot->function, function);
+    slot->bound_mask = bound_mask;
+    for (unsigned i = 0; i < MAX_PARAMS; i++) {
+        slot->values[i] = (bound_mask & (1u << i)) ? values[i] : 0;
+    }
+    slot->address = (void *) (uintptr_t) addr;
+    slot->tracker = tracker;
+    slot->last_use = s->clock;
+    slot->pins = 1;
+    return slot->address;
+}
+
+// Gives back an address returned by specialize(), which may then unload it
+static void specialize_release(Specializer *s, void *address) {
+    for (unsigned i = 0; i < s->count; i++) {
+        if (s->variants[i].address == address && s->variants[i].pins > 0) {
+            s->variants[i].pins--;
+            return;
+        }
+    }
+}
+
+static void specializer_init(Specializer *s, LLVMModuleRef source, LLVMOrcThreadSafeContextRef ts_ctx) {
+    memset(s, 0, sizeof(*s));
+    s->source = source;
+    s->ts_ctx = ts_ctx;
+    check(LLVMOrcCreateLLJIT(&s->jit, NULL), "jit creation");
+
+    // Host target machine, so that the optimizer sees the real cost model
+    char *triple = LLVMGetDefaultTargetTriple();
+    char *cpu = LLVMGetHostCPUName();
+    char *features = LLVMGetHostCPUFeatures();
+    char *error = NULL;
+    LLVMTargetRef target;
+    if (LLVMGetTargetFromTriple(triple, &target, &error) != 0) {
+        fprintf(stderr, "%s\n", error);
+        exit(1);
+    }
+    s->target_machine = LLVMCreateTargetMachine(target, triple, cpu, features, LLVMCodeGenLevelDefault,
+                                                LLVMRelocDefault, LLVMCodeModelJITDefault);
+    LLVMDisposeMessage(triple);
+    LLVMDisposeMessage(cpu);
+    LLVMDisposeMessage(features);
+}
+
+static void specializer_dispose(Specializer *s) {
+    for (unsigned i = 0; i < s->count; i++) {
+        LLVMOrcReleaseResourceTracker(s->variants[i].tracker);
+    }
+    LLVMOrcDisposeLLJIT(s->jit);
+    LLVMDisposeTargetMachine(s->target_machine);
+}
+
+int main(int argc, char const *argv[]) {
+    long iterations = argc > 1 ? atol(argv[1]) : 2000000;
+
+    LLVMInitializeNativeTarget();
+    LLVMInitializeNativeAsmPrinter();
+
+    // Module creation
+    LLVMOrcThreadSafeContextRef ts_ctx = LLVMOrcCreateNewThreadSafeContext();
+    LLVMContextRef ctx = LLVMOrcThreadSafeContextGetContext(ts_ctx);
+    LLVMModuleRef mod = LLVMModuleCreateWithNameInContext("my_module", ctx);
+    LLVMBuilderRef builder = LLVMCreateBuilderInContext(ctx);
+    build_sum(mod, builder);
+    build_scaled_sum(mod, builder);
+    LLVMDisposeBuilder(builder);
+
+    //Analysis
+    char *error = NULL;
+    if (LLVMVerifyModule(mod, LLVMReturnStatusAction, &error)) {
+        fprintf(stderr, "%s\n", error);
+        return 1;
+    }
+    LLVMDisposeMessage(error);
+
+    Specializer s;
+    specializer_init(&s, mod, ts_ctx);
+
+    // sum(a, 1)
+    int64_t one[MAX_PARAMS] = { 0, 1 };
+    int32_t (*increment)(int32_t) = (int32_t (*)(int32_t)) specialize(&s, "sum", 1u << 1, one);
+    printf("sum(41, 1) specialized: %d\n", increment(41));
+    specialize_release(&s, (void *) increment);
+
+    // scaled_sum(a, n, k), generic and bound on n = 16, k = 3
+    int64_t none[MAX_PARAMS] = { 0 };
+    int64_t n16_k3[MAX_PARAMS] = { 0, 16, 3 };
+    int32_t (*generic)(int32_t *, int64_t, int32_t) =
+        (int32_t (*)(int32_t *, int64_t, int32_t)) specialize(&s, "scaled_sum", 0, none);
+    int32_t (*special)(int32_t *) =
+        (int32_t (*)(int32_t *)) specialize(&s, "scaled_sum", (1u << 1) | (1u << 2), n16_k3);
+
+    int32_t data[16];
+    for (int i = 0; i < 16; i++) {
+        data[i] = i;
+    }
+    printf("scaled_sum(data, 16, 3): generic %d, specialized %d\n", generic(data, 16, 3), special(data));
+
+    // Benchmark
+    volatile int32_t sink = 0;
+    double start = now();
+    for (long i = 0; i < iterations; i++) {
+        sink += generic(data, 16, 3);
+    }
+    double generic_time = now() - start;
+    start = now();
+    for (long i = 0; i < iterations; i++) {
+        sink += special(data);
+    }
+    double special_time = now() - start;
+    printf("generic %.2f ns/call, specialized %.2f ns/call (%.2fx)\n",
+           generic_time * 1e9 / iterations, special_time * 1e9 / iterations, generic_time / special_time);
+    specialize_release(&s, (void *) generic);
+    specialize_release(&s, (void *) special);
+
+    // Cache behaviour: repeated keys hit, more keys than slots evict
+    for (int round = 0; round < 3; round++) {
+        for (int64_t k = 1; k <= CACHE_CAPACITY + 2; k++) {
+            int64_t values[MAX_PARAMS] = { 0, 16, k };
+            for (int repeat = 0; repeat < 2; repeat++) {
+                specialize_release(&s, specialize(&s, "scaled_sum", (1u << 1) | (1u << 2), values));
+            }
+        }
+    }
+    printf("cache: %llu hits, %llu misses, %llu evictions, %u/%d variants resident\n",
+           (unsigned long long) s.hits, (unsigned long long) s.misses,
+           (unsigned long long) s.evictions, s.count, CACHE_CAPACITY);
+
+    specializer_dispose(&s);
+    LLVMDisposeModule(mod);
+    LLVMOrcDisposeThreadSafeContext(ts_ctx);
+}
@@ -0,0 +1,377 @@
+/**
+ * LLVM equivalent of a Pharo SmallInteger primitive such as:
+ *
+ * oop tagged_add(oop a, oop b) {
+ *     if (is_small_integer(a) && is_small_integer(b)) {
+ *         oop result;
+ *         if (!__builtin_add_overflow(a - 1, b, &result))
+ *             return result;
+ *     }
+ *     return tagged_slow_add(a, b);
+ * }
+ *
+ * SmallIntegers use the 64-bit Pharo encoding: the value shifted left by
+ * three bits with the low tag bits set to 001. Keeping one operand shifted
+ * while the operation runs makes the i64 overflow flag of
+ * llvm.s*.with.overflow exactly the 61-bit SmallInteger overflow, so the
+ * result only needs its tag put back. Everything that is not the fast case
+ * goes to an out-of-line, cold slow-path call where the VM would box a
+ * LargeInteger.
+ */
+
+#include "ir_helpers.h"
+
+#include <llvm-c/Core.h>
+#include <llvm-c/Analysis.h>
+#include <llvm-c/Target.h>
+#include <llvm-c/TargetMachine.h>
+#include <llvm-c/LLJIT.h>
+#include <llvm-c/Orc.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef int64_t oop;
+
+#define TAG_BITS 3
+#define TAG_MASK 7
+#define SMALL_INTEGER_TAG 1
+
+#define TAGGED(v) ((oop) (((uint64_t) (v) << TAG_BITS) | SMALL_INTEGER_TAG))
+#define UNTAGGED(o) ((o) >> TAG_BITS)
+
+// Fast path vs slow path ratio recorded in the branch weights
+#define LIKELY_WEIGHT 2000
+#define UNLIKELY_WEIGHT 1
+
+typedef enum { TaggedAdd, TaggedSub, TaggedMul, TaggedOpCount } TaggedOp;
+
+static const char *op_names[] = { "add", "sub", "mul" };
+static const char *overflow_intrinsics[] = {
+    "llvm.sadd.with.overflow", "llvm.ssub.with.overflow", "llvm.smul.with.overflow"
+};
+
+// ======================================================
+// Slow path, called from generated code
+// ======================================================
+
+// Stands in for the LargeInteger boxing done by the VM: the result is kept
+// in a box and the generated code only sees an untagged (pointer) oop.
+static struct { __int128 value; } large_box;
+static uint64_t slow_calls;
+
+static oop slow_path(TaggedOp op, oop a, oop b) {
+    slow_calls++;
+    __int128 x = (a & TAG_MASK) == SMALL_INTEGER_TAG ? UNTAGGED(a) : 0;
+    __int128 y = (b & TAG_MASK) == SMALL_INTEGER_TAG ? UNTAGGED(b) : 0;
+    large_box.value = op == TaggedAdd ? x + y : op == TaggedSub ? x - y : x * y;
+    return (oop) (intptr_t) &large_box;
+}
+
+static oop tagged_slow_add(oop a, oop b) { return slow_path(TaggedAdd, a, b); }
+static oop tagged_slow_sub(oop a, oop b) { return slow_path(TaggedSub, a, b); }
+static oop tagged_slow_mul(oop a, oop b) { return slow_path(TaggedMul, a, b); }
+
+static oop (*slow_functions[])(oop, oop) = { tagged_slow_add, tagged_slow_sub, tagged_slow_mul };
+
+// ======================================================
+// Generic primitive, the baseline of the microbenchmark
+// ======================================================
+
+// What an interpreter does without JIT support: one out-of-line primitive
+// shared by the arithmetic selectors, dispatching on the operation.
+static oop __attribute__((noinline)) generic_primitive(TaggedOp op, oop a, oop b) {
+    if ((a & TAG_MASK) != SMALL_INTEGER_TAG || (b & TAG_MASK) != SMALL_INTEGER_TAG) {
+        return slow_path(op, a, b);
+    }
+    oop result;
+    int overflow;
+    switch (op) {
+    case TaggedAdd: overflow = __builtin_add_overflow(a - SMALL_INTEGER_TAG, b, &result); break;
+    case TaggedSub: overflow = __builtin_sub_overflow(a, b - SMALL_INTEGER_TAG, &result); break;
+    default:
+        overflow = __builtin_mul_overflow(a - SMALL_INTEGER_TAG, UNTAGGED(b), &result);
+        result |= SMALL_INTEGER_TAG;
+        break;
+    }
+    return overflow ? slow_path(op, a, b) : result;
+}
+
+// ======================================================
+// IR generation
+// ======================================================
+
+static LLVMValueRef declare_slow_path(LLVMModuleRef mod, TaggedOp op) {
+    LLVMContextRef ctx = LLVMGetModuleContext(mod);
+    LLVMTypeRef i64 = LLVMInt64TypeInContext(ctx);
+    char name[32];
+    snprintf(name, sizeof(name), "tagged_slow_%s", op_names[op]);
+
+    LLVMValueRef fun = LLVMGetNamedFunction(mod, name);
+    if (fun) {
+        return fun;
+    }
+    LLVMTypeRef param_types[] = { i64, i64 };
+    fun = LLVMAddFunction(mod, name, LLVMFunctionType(i64, param_types, 2, 0));
+    // cold keeps the call and its block out of the hot layout
+    unsigned cold = LLVMGetEnumAttributeKindForName("cold", 4);
+    LLVMAddAttributeAtIndex(fun, LLVMAttributeFunctionIndex, LLVMCreateEnumAttribute(ctx, cold, 0));
+    return fun;
+}
+
+/**
+ * Emits the tagged arithmetic sequence at the builder position and returns
+ * the resulting oop. The builder is left at the end of the merge block, so
+ * other generators can inline the sequence into larger functions.
+ */
+static LLVMValueRef build_tagged_op(LLVMBuilderRef builder, LLVMModuleRef mod, TaggedOp op,
+                                    LLVMValueRef a, LLVMValueRef b) {
+    LLVMContextRef ctx = LLVMGetModuleContext(mod);
+    LLVMTypeRef i64 = LLVMInt64TypeInContext(ctx);
+    LLVMValueRef fun = LLVMGetBasicBlockParent(LLVMGetInsertBlock(builder));
+    LLVMValueRef tag_mask = LLVMConstInt(i64, TAG_MASK, 0);
+    LLVMValueRef tag = LLVMConstInt(i64, SMALL_INTEGER_TAG, 0);
+
+    LLVMBasicBlockRef fast = LLVMAppendBasicBlockInContext(ctx, fun, "fast");
+    LLVMBasicBlockRef slow = LLVMAppendBasicBlockInContext(ctx, fun, "slow");
+    LLVMBasicBlockRef done = LLVMAppendBasicBlockInContext(ctx, fun, "done");
+
+    // Tag check: both operands must be SmallIntegers
+    LLVMValueRef a_tag = LLVMBuildAnd(builder, a, tag_mask, "a_tag");
+    LLVMValueRef b_tag = LLVMBuildAnd(builder, b, tag_mask, "b_tag");
+    LLVMValueRef a_ok = LLVMBuildICmp(builder, LLVMIntEQ, a_tag, tag, "a_ok");
+    LLVMValueRef b_ok = LLVMBuildICmp(builder, LLVMIntEQ, b_tag, tag, "b_ok");
+    LLVMValueRef both_ok = LLVMBuildAnd(builder, a_ok, b_ok, "both_ok");
+    LLVMValueRef check = LLVMBuildCondBr(builder, both_ok, fast, slow);
+    set_branch_weights(ctx, check, LIKELY_WEIGHT, UNLIKELY_WEIGHT);
+
+    // Untag and operate with overflow detection
+    LLVMPositionBuilderAtEnd(builder, fast);
+    LLVMValueRef lhs, rhs;
+    switch (op) {
+    case TaggedAdd:
+        lhs = LLVMBuildSub(builder, a, tag, "a_shifted");
+        rhs = b;
+        break;
+    case TaggedSub:
+        lhs = a;
+        rhs = LLVMBuildSub(builder, b, tag, "b_shifted");
+        break;
+    default:
+        lhs = LLVMBuildSub(builder, a, tag, "a_shifted");
+        rhs = LLVMBuildAShr(builder, b, LLVMConstInt(i64, TAG_BITS, 0), "b_value");
+        break;
+    }
+    const char *intrinsic = overflow_intrinsics[op];
+    unsigned id = LLVMLookupIntrinsicID(intrinsic, strlen(intrinsic));
+    LLVMValueRef overflow_fun = LLVMGetIntrinsicDeclaration(mod, id, &i64, 1);
+    LLVMTypeRef overflow_type = LLVMIntrinsicGetType(ctx, id, &i64, 1);
+    LLVMValueRef args[] = { lhs, rhs };
+    LLVMValueRef pair = LLVMBuildCall2(builder, overflow_type, overflow_fun, args, 2, "pair");
+    LLVMValueRef raw = LLVMBuildExtractValue(builder, pair, 0, "raw");
+    LLVMValueRef overflow = LLVMBuildExtractValue(builder, pair, 1, "overflow");
+    // Retag: only the product lost its tag bits
+    LLVMValueRef fast_result = op == TaggedMul ? LLVMBuildOr(builder, raw, tag, "retagged") : raw;
+    LLVMValueRef no_overflow = LLVMBuildCondBr(builder, overflow, slow, done);
+    set_branch_weights(ctx, no_overflow, UNLIKELY_WEIGHT, LIKELY_WEIGHT);
+
+    // Out-of-line slow path
+    LLVMPositionBuilderAtEnd(builder, slow);
+    LLVMValueRef slow_fun = declare_slow_path(mod, op);
+    LLVMValueRef slow_result = LLVMBuildCall2(builder, LLVMGlobalGetValueType(slow_fun),
+                                              slow_fun, (LLVMValueRef[]) { a, b }, 2, "boxed");
+    LLVMBuildBr(builder, done);
+
+    LLVMPositionBuilderAtEnd(builder, done);
+    LLVMValueRef result = LLVMBuildPhi(builder, i64, "result");
+    LLVMValueRef values[] = { fast_result, slow_result };
+    LLVMBasicBlockRef blocks[] = { fast, slow };
+    LLVMAddIncoming(result, values, blocks, 2);
+    return result;
+}
+
+static void build_tagged_function(LLVMModuleRef mod, LLVMBuilderRef builder, TaggedOp op) {
+    LLVMContextRef ctx = LLVMGetModuleContext(mod);
+    LLVMTypeRef i64 = LLVMInt64TypeInContext(ctx);
+    char name[32];
+    snprintf(name, sizeof(name), "tagged_%s", op_names[op]);
+
+    LLVMTypeRef param_types[] = { i64, i64 };
+    LLVMValueRef fun = LLVMAddFunction(mod, name, LLVMFunctionType(i64, param_types, 2, 0));
+    LLVMPositionBuilderAtEnd(builder, LLVMAppendBasicBlockInContext(ctx, fun, "entry"));
+    LLVMBuildRet(builder, build_tagged_op(builder, mod, op, LLVMGetParam(fun, 0), LLVMGetParam(fun, 1)));
+}
+
+/**
+ * Benchmark loop, xor-reducing op(TAGGED(i & 0xFFFF), TAGGED(7)) over n
+ * iterations. With inline set the tagged sequence is emitted in the loop
+ * body, otherwise every iteration calls the generic primitive.
+ */
+static void build_bench_function(LLVMModuleRef mod, LLVMBuilderRef builder, TaggedOp op, int inline_op) {
+    LLVMContextRef ctx = LLVMGetModuleContext(mod);
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(ctx);
+    LLVMTypeRef i64 = LLVMInt64TypeInContext(ctx);
+    char name[32];
+    snprintf(name, sizeof(name), "bench_%s_%s", inline_op ? "inline" : "primitive", op_names[op]);
+
+    LLVMValueRef fun = LLVMAddFunction(mod, name, LLVMFunctionType(i64, &i64, 1, 0));
+    LLVMValueRef n = LLVMGetParam(fun, 0);
+    LLVMBasicBlockRef entry = LLVMAppendBasicBlockInContext(ctx, fun, "entry");
+    LLVMBasicBlockRef loop = LLVMAppendBasicBlockInContext(ctx, fun, "loop");
+    LLVMBasicBlockRef exit = LLVMAppendBasicBlockInContext(ctx, fun, "exit");
+
+    LLVMPositionBuilderAtEnd(builder, entry);
+    LLVMBuildBr(builder, loop);
+
+    LLVMPositionBuilderAtEnd(builder, loop);
+    LLVMValueRef i = LLVMBuildPhi(builder, i64, "i");
+    LLVMValueRef acc = LLVMBuildPhi(builder, i64, "acc");
+    LLVMValueRef low = LLVMBuildAnd(builder, i, LLVMConstInt(i64, 0xFFFF, 0), "low");
+    LLVMValueRef shifted = LLVMBuildShl(builder, low, LLVMConstInt(i64, TAG_BITS, 0), "shifted");
+    LLVMValueRef a = LLVMBuildOr(builder, shifted, LLVMConstInt(i64, SMALL_INTEGER_TAG, 0), "a");
+    LLVMValueRef b = LLVMConstInt(i64, TAGGED(7), 1);
+    LLVMValueRef r;
+    if (inline_op) {
+        r = build_tagged_op(builder, mod, op, a, b);
+    } else {
+        LLVMValueRef primitive = LLVMGetNamedFunction(mod, "generic_primitive");
+        if (!primitive) {
+            LLVMTypeRef param_types[] = { i32, i64, i64 };
+            primitive = LLVMAddFunction(mod, "generic_primitive", LLVMFunctionType(i64, param_types, 3, 0));
+        }
+        LLVMValueRef args[] = { LLVMConstInt(i32, op, 0), a, b };
+        r = LLVMBuildCall2(builder, LLVMGlobalGetValueType(primitive), primitive, args, 3, "r");
+    }
+    LLVMValueRef next_acc = LLVMBuildXor(builder, acc, r, "next_acc");
+    LLVMValueRef next_i = LLVMBuildAdd(builder, i, LLVMConstInt(i64, 1, 0), "next_i");
+    LLVMValueRef done = LLVMBuildICmp(builder, LLVMIntSGE, next_i, n, "done");
+    LLVMBasicBlockRef latch = LLVMGetInsertBlock(builder);
+    LLVMBuildCondBr(builder, done, exit, loop);
+
+    LLVMValueRef i_values[] = { LLVMConstInt(i64, 0, 0), next_i };
+    LLVMValueRef acc_values[] = { LLVMConstInt(i64, 0, 0), next_acc };
+    LLVMBasicBlockRef incoming[] = { entry, latch };
+    LLVMAddIncoming(i, i_values, incoming, 2);
+    LLVMAddIncoming(acc, acc_values, incoming, 2);
+
+    LLVMPositionBuilderAtEnd(builder, exit);
+    LLVMBuildRet(builder, next_acc);
+}
+
+// ======================================================
+// Benchmark
+// ======================================================
+
+static void check(LLVMErrorRef err, const char *what) {
+    if (err) {
+        char *msg = LLVMGetErrorMessage(err);
+        fprintf(stderr, "%s: %s\n", what, msg);
+        LLVMDisposeErrorMessage(msg);
+        exit(1);
+    }
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char const *argv[]) {
+    long iterations = argc > 1 ? atol(argv[1]) : 50000000;
+
+    LLVMInitializeNativeTarget();
+    LLVMInitializeNativeAsmPrinter();
+
+    // Module creation, in a context the JIT can own
+    LLVMOrcThreadSafeContextRef ts_ctx = LLVMOrcCreateNewThreadSafeContext();
+    LLVMContextRef ctx = LLVMOrcThreadSafeContextGetContext(ts_ctx);
+    LLVMModuleRef mod = LLVMModuleCreateWithNameInContext("tagged", ctx);
+    LLVMBuilderRef builder = LLVMCreateBuilderInContext(ctx);
+    for (int op = 0; op < TaggedOpCount; op++) {
+        build_tagged_function(mod, builder, (TaggedOp) op);
+        build_bench_function(mod, builder, (TaggedOp) op, 1);
+        build_bench_function(mod, builder, (TaggedOp) op, 0);
+    }
+    LLVMDisposeBuilder(builder);
+
+    //Analysis
+    char *error = NULL;
+    if (LLVMVerifyModule(mod, LLVMReturnStatusAction, &error)) {
+        fprintf(stderr, "%s\n", error);
+        return 1;
+    }
+    LLVMDisposeMessage(error);
+
+    // JIT creation, the slow paths resolve to the C functions above
+    LLVMOrcLLJITRef jit;
+    check(LLVMOrcCreateLLJIT(&jit, NULL), "jit creation");
+    LLVMOrcJITDylibRef dylib = LLVMOrcLLJITGetMainJITDylib(jit);
+
+    LLVMJITCSymbolMapPair slow_symbols[TaggedOpCount + 1];
+    for (int op = 0; op < TaggedOpCount; op++) {
+        char name[32];
+        snprintf(name, sizeof(name), "tagged_slow_%s", op_names[op]);
+        slow_symbols[op].Name = LLVMOrcLLJITMangleAndIntern(jit, name);
+        slow_symbols[op].Sym.Address = (LLVMOrcJITTargetAddress) (uintptr_t) slow_functions[op];
+        slow_symbols[op].Sym.Flags.GenericFlags = LLVMJITSymbolGenericFlagsExported | LLVMJITSymbolGenericFlagsCallable;
+        slow_symbols[op].Sym.Flags.TargetFlags = 0;
+    }
+    slow_symbols[TaggedOpCount].Name = LLVMOrcLLJITMangleAndIntern(jit, "generic_primitive");
+    slow_symbols[TaggedOpCount].Sym.Address = (LLVMOrcJITTargetAddress) (uintptr_t) generic_primitive;
+    slow_symbols[TaggedOpCount].Sym.Flags = slow_symbols[0].Sym.Flags;
+    check(LLVMOrcJITDylibDefine(dylib, LLVMOrcAbsoluteSymbols(slow_symbols, TaggedOpCount + 1)), "runtime symbols");
+    check(LLVMOrcLLJITAddLLVMIRModule(jit, dylib, LLVMOrcCreateNewThreadSafeModule(mod, ts_ctx)), "add module");
+    LLVMOrcDisposeThreadSafeContext(ts_ctx);
+
+    oop (*jitted[TaggedOpCount])(oop, oop);
+    for (int op = 0; op < TaggedOpCount; op++) {
+        char name[32];
+        LLVMOrcJITTargetAddress addr;
+        snprintf(name, sizeof(name), "tagged_%s", op_names[op]);
+        check(LLVMOrcLLJITLookup(jit, &addr, name), name);
+        jitted[op] = (oop (*)(oop, oop)) (uintptr_t) addr;
+    }
+
+    // Sanity checks, including the overflow and non-SmallInteger cases
+    const int64_t max_small = ((int64_t) 1 << 60) - 1;
+    for (int op = 0; op < TaggedOpCount; op++) {
+        oop fast = jitted[op](TAGGED(1234), TAGGED(-56));
+        oop expected = generic_primitive((TaggedOp) op, TAGGED(1234), TAGGED(-56));
+        uint64_t before = slow_calls;
+        jitted[op](TAGGED(max_small), TAGGED(op == TaggedSub ? -max_small : max_small));
+        jitted[op](TAGGED(1), 0x1000 /* a pointer, not a SmallInteger */);
+        printf("tagged_%s: %lld (expected %lld), slow path taken %llu/2 times\n",
+               op_names[op], (long long) UNTAGGED(fast), (long long) UNTAGGED(expected),
+               (unsigned long long) (slow_calls - before));
+    }
+
+    // Microbenchmark: generated fast path vs generic primitive call
+    for (int op = 0; op < TaggedOpCount; op++) {
+        char name[32];
+        LLVMOrcJITTargetAddress addr;
+        snprintf(name, sizeof(name), "bench_inline_%s", op_names[op]);
+        check(LLVMOrcLLJITLookup(jit, &addr, name), name);
+        int64_t (*bench_inline)(int64_t) = (int64_t (*)(int64_t)) (uintptr_t) addr;
+        snprintf(name, sizeof(name), "bench_primitive_%s", op_names[op]);
+        check(LLVMOrcLLJITLookup(jit, &addr, name), name);
+        int64_t (*bench_primitive)(int64_t) = (int64_t (*)(int64_t)) (uintptr_t) addr;
+
+        double start = now();
+        int64_t inline_acc = bench_inline(iterations);
+        double inline_time = now() - start;
+
+        start = now();
+        int64_t primitive_acc = bench_primitive(iterations);
+        double primitive_time = now() - start;
+
+        printf("%s: generated %.2f ns/op, generic primitive %.2f ns/op (%.2fx)%s\n",
+               op_names[op], inline_time * 1e9 / iterations, primitive_time * 1e9 / iterations,
+               primitive_time / inline_time, inline_acc == primitive_acc ? "" : " MISMATCH");
+    }
+
+    LLVMOrcDisposeLLJIT(jit);
+}
@@ -0,0 +1,468 @@
+/**
+ * Tiered compilation with background recompilation.
+ *
+ * Every function F of the source module is reached through an entry stub
+ * named F, generated next to the tier-0 code:
+ *
+ * int F(int a, int b) {
+ *     if (atomic_fetch_add(&F_count, 1) == threshold - 1)
+ *         tier_up_request(&F_record);
+ *     return atomic_load(&F_entry)(a, b);
+ * }
+ *
+ * Tier 0 compiles the unoptimized bodies at LLVMCodeGenLevelNone so they
+ * are usable immediately. A function whose counter reaches the threshold
+ * is queued for a background thread, which recompiles it with the O3
+ * pipeline at LLVMCodeGenLevelAggressive in a second JIT and publishes the
+ * new body with an atomic store to F_entry. Callers keep running the
+ * tier-0 body until then and never wait for the compile.
+ *
+ * All the tier-2 work happens on the background thread, which is the only
+ * user of the source module context once tier 0 is compiled.
+ */
+
+#include "ir_helpers.h"
+
+#include <llvm-c/Core.h>
+#include <llvm-c/Analysis.h>
+#include <llvm-c/LLJIT.h>
+#include <llvm-c/Orc.h>
+#include <llvm-c/Target.h>
+#include <llvm-c/TargetMachine.h>
+#include <llvm-c/Transforms/PassBuilder.h>
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_FUNCTIONS 64
+
+typedef enum { TierBaseline, TierQueued, TierOptimized } Tier;
+
+typedef struct TieredRuntime TieredRuntime;
+
+typedef struct {
+    char name[64];
+    _Atomic uint64_t count;     // incremented by the entry stub
+    _Atomic uintptr_t entry;    // body the stub calls, swapped on tier-up
+    _Atomic int tier;
+    double tier_up_ms;          // background compile time, once tier is TierOptimized
+    TieredRuntime *runtime;
+} TieredFunction;
+
+typedef struct {
+    uint64_t threshold;                 // calls before a function is queued
+    LLVMCodeGenOptLevel top_level;      // code generation level of tier 2
+    const char *top_pipeline;           // IR pipeline of tier 2
+} TieredOptions;
+
+struct TieredRuntime {
+    TieredOptions options;
+    LLVMOrcThreadSafeContextRef ts_ctx;
+    LLVMModuleRef source;
+    LLVMOrcLLJITRef tier0;
+    LLVMOrcLLJITRef tier2;
+    TieredFunction functions[MAX_FUNCTIONS];
+    unsigned count;
+
+    pthread_t worker;
+    sem_t work;
+    _Atomic int stopping;
+
+    // Tier transitions
+    _Atomic uint64_t tier_up_requests;
+    _Atomic uint64_t tier2_compiles;
+    _Atomic uint64_t swaps;
+};
+
+static void check(LLVMErrorRef err, const char *what) {
+    if (err) {
+        char *msg = LLVMGetErrorMessage(err);
+        fprintf(stderr, "%s: %s\n", what, msg);
+        LLVMDisposeErrorMessage(msg);
+        exit(1);
+    }
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// ======================================================
+// Tier-up requests, called from the entry stubs
+// ======================================================
+
+static void tier_up_request(TieredFunction *fun) {
+    int expected = TierBaseline;
+    if (atomic_compare_exchange_strong(&fun->tier, &expected, TierQueued)) {
+        atomic_fetch_add(&fun->runtime->tier_up_requests, 1);
+        sem_post(&fun->runtime->work);
+    }
+}
+
+// ======================================================
+// Tier 0: entry stubs and unoptimized bodies
+// ======================================================
+
+static LLVMOrcLLJITRef create_jit(LLVMCodeGenOptLevel level) {
+    char *triple = LLVMGetDefaultTargetTriple();
+    char *error = NULL;
+    LLVMTargetRef target;
+    if (LLVMGetTargetFromTriple(triple, &target, &error) != 0) {
+        fprintf(stderr, "%s\n", error);
+        exit(1);
+    }
+    LLVMTargetMachineRef tm = LLVMCreateTargetMachine(target, triple, "", "", level, LLVMRelocDefault, LLVMCodeModelJITDefault);
+    LLVMDisposeMessage(triple);
+
+    LLVMOrcLLJITBuilderRef builder = LLVMOrcCreateLLJITBuilder();
+    LLVMOrcLLJITBuilderSetJITTargetMachineBuilder(builder, LLVMOrcJITTargetMachineBuilderCreateFromTargetMachine(tm));
+    LLVMOrcLLJITRef jit;
+    check(LLVMOrcCreateLLJIT(&jit, builder), "jit creation");
+    return jit;
+}
+
+static void define_absolute(LLVMOrcLLJITRef jit, const char *name, void *address, int callable) {
+    LLVMJITCSymbolMapPair symbol;
+    symbol.Name = LLVMOrcLLJITMangleAndIntern(jit, name);
+    symbol.Sym.Address = (LLVMOrcJITTargetAddress) (uintptr_t) address;
+    symbol.Sym.Flags.GenericFlags = LLVMJITSymbolGenericFlagsExported | (callable ? LLVMJITSymbolGenericFlagsCallable : 0);
+    symbol.Sym.Flags.TargetFlags = 0;
+    check(LLVMOrcJITDylibDefine(LLVMOrcLLJITGetMainJITDylib(jit), LLVMOrcAbsoluteSymbols(&symbol, 1)), name);
+}
+
+static void build_stub(TieredRuntime *rt, LLVMModuleRef mod, LLVMBuilderRef builder, LLVMValueRef body, unsigned id) {
+    LLVMContextRef ctx = LLVMGetModuleContext(mod);
+    LLVMTypeRef i64 = LLVMInt64TypeInContext(ctx);
+    LLVMTypeRef fun_type = LLVMGlobalGetValueType(body);
+    LLVMTypeRef fun_ptr = LLVMPointerType(fun_type, 0);
+    TieredFunction *fun = &rt->functions[id];
+    char name[96];
+
+    snprintf(name, sizeof(name), "%s.count", fun->name);
+    LLVMValueRef count = LLVMAddGlobal(mod, i64, name);
+    snprintf(name, sizeof(name), "%s.entry", fun->name);
+    LLVMValueRef entry_slot = LLVMAddGlobal(mod, fun_ptr, name);
+
+    LLVMValueRef request = LLVMGetNamedFunction(mod, "tier_up_request");
+    if (!request) {
+        LLVMTypeRef void_type = LLVMVoidTypeInContext(ctx);
+        request = LLVMAddFunction(mod, "tier_up_request", LLVMFunctionType(void_type, &i64, 1, 0));
+        unsigned cold = LLVMGetEnumAttributeKindForName("cold", 4);
+        LLVMAddAttributeAtIndex(request, LLVMAttributeFunctionIndex, LLVMCreateEnumAttribute(ctx, cold, 0));
+    }
+
+    LLVMValueRef stub = LLVMAddFunction(mod, fun->name, fun_type);
+    LLVMBasicBlockRef entry = LLVMAppendBasicBlockInContext(ctx, stub, "entry");
+    LLVMBasicBlockRef tier_up = LLVMAppendBasicBlockInContext(ctx, stub, "tier_up");
+    LLVMBasicBlockRef dispatch = LLVMAppendBasicBlockInContext(ctx, stub, "dispatch");
+
+    // Count the call, request a tier-up exactly once at the threshold
+    LLVMPositionBuilderAtEnd(builder, entry);
+    LLVMValueRef calls = LLVMBuildAtomicRMW(builder, LLVMAtomicRMWBinOpAdd, count, LLVMConstInt(i64, 1, 0),
+                                            LLVMAtomicOrderingMonotonic, 0);
+    LLVMValueRef hot = LLVMBuildICmp(builder, LLVMIntEQ, calls, LLVMConstInt(i64, rt->options.threshold - 1, 0), "hot");
+    set_branch_weights(ctx, LLVMBuildCondBr(builder, hot, tier_up, dispatch), 1, 2000);
+
+    LLVMPositionBuilderAtEnd(builder, tier_up);
+    LLVMValueRef record = LLVMConstInt(i64, (uintptr_t) fun, 0);
+    LLVMBuildCall2(builder, LLVMGlobalGetValueType(request), request, &record, 1, "");
+    LLVMBuildBr(builder, dispatch);
+
+    // Forward the arguments to the current body
+    LLVMPositionBuilderAtEnd(builder, dispatch);
+    LLVMValueRef target = LLVMBuildLoad2(builder, fun_ptr, entry_slot, "target");
+    LLVMSetOrdering(target, LLVMAtomicOrderingAcquire);
+    LLVMSetAlignment(target, sizeof(void *));
+    unsigned arg_count = LLVMCountParams(stub);
+    LLVMValueRef *args = malloc(sizeof(LLVMValueRef) * (arg_count ? arg_count : 1));
+    LLVMGetParams(stub, args);
+    LLVMValueRef call = LLVMBuildCall2(builder, fun_type, target, args, arg_count, "");
+    LLVMSetTailCall(call, 1);
+    free(args);
+    if (LLVMGetTypeKind(LLVMGetReturnType(fun_type)) == LLVMVoidTypeKind) {
+        LLVMBuildRetVoid(builder);
+    } else {
+        LLVMBuildRet(builder, call);
+    }
+}
+
+static void compile_tier0(TieredRuntime *rt) {
+    LLVMModuleRef mod = LLVMCloneModule(rt->source);
+    LLVMContextRef ctx = LLVMGetModuleContext(mod);
+    LLVMBuilderRef builder = LLVMCreateBuilderInContext(ctx);
+
+    // Bodies become F.t0, calls between them go through the stubs
+    LLVMValueRef bodies[MAX_FUNCTIONS];
+    for (LLVMValueRef fun = LLVMGetFirstFunction(mod); fun; fun = LLVMGetNextFunction(fun)) {
+        if (LLVMIsDeclaration(fun) || rt->count == MAX_FUNCTIONS) {
+            continue;
+        }
+        TieredFunction *record = &rt->functions[rt->count];
+        snprintf(record->name, sizeof(record->name), "%s", LLVMGetValueName(fun));
+        record->runtime = rt;
+        bodies[rt->count++] = fun;
+    }
+    for (unsigned i = 0; i < rt->count; i++) {
+        char name[96];
+        snprintf(name, sizeof(name), "%s.t0", rt->functions[i].name);
+        LLVMSetValueName2(bodies[i], name, strlen(name));
+        build_stub(rt, mod, builder, bodies[i], i);
+        LLVMReplaceAllUsesWith(bodies[i], LLVMGetNamedFunction(mod, rt->functions[i].name));
+    }
+    LLVMDisposeBuilder(builder);
+
+    char *error = NULL;
+    if (LLVMVerifyModule(mod, LLVMReturnStatusAction, &error)) {
+        fprintf(stderr, "%s\n", error);
+        exit(1);
+    }
+    LLVMDisposeMessage(error);
+
+    // Runtime state the stubs reference
+    define_absolute(rt->tier0, "tier_up_request", (void *) tier_up_request, 1);
+    for (unsigned i = 0; i < rt->count; i++) {
+        char name[96];
+        snprintf(name, sizeof(name), "%s.count", rt->functions[i].name);
+        define_absolute(rt->tier0, name, &rt->functions[i].count, 0);
+        snprintf(name, sizeof(name), "%s.entry", rt->functions[i].name);
+        define_absolute(rt->tier0, name, &rt->functions[i].entry, 0);
+    }
+    check(LLVMOrcLLJITAddLLVMIRModule(rt->tier0, LLVMOrcLLJITGetMainJITDylib(rt->tier0),
+                                      LLVMOrcCreateNewThreadSafeModule(mod, rt->ts_ctx)), "tier 0");
+
+    for (unsigned i = 0; i < rt->count; i++) {
+        char name[96];
+        LLVMOrcJITTargetAddress addr;
+        snprintf(name, sizeof(name), "%s.t0", rt->functions[i].name);
+        check(LLVMOrcLLJITLookup(rt->tier0, &addr, name), name);
+        atomic_store(&rt->functions[i].entry, (uintptr_t) addr);
+    }
+}
+
+// ======================================================
+// Tier 2: background recompilation
+// ======================================================
+
+static void compile_tier2(TieredRuntime *rt, TieredFunction *fun) {
+    double start = now();
+
+    // The hot function stays external as F.t2, its callees are internal
+    // copies so the optimizer can inline them.
+    LLVMModuleRef mod = LLVMCloneModule(rt->source);
+    for (LLVMValueRef f = LLVMGetFirstFunction(mod); f; f = LLVMGetNextFunction(f)) {
+        if (!LLVMIsDeclaration(f)) {
+            LLVMSetLinkage(f, LLVMInternalLinkage);
+        }
+    }
+    LLVMValueRef hot = LLVMGetNamedFunction(mod, fun->name);
+    char name[96];
+    snprintf(name, sizeof(name), "%s.t2", fun->name);
+    LLVMSetValueName2(hot, name, strlen(name));
+    LLVMSetLinkage(hot, LLVMExternalLinkage);
+
+    LLVMPassBuilderOptionsRef options = LLVMCreatePassBuilderOptions();
+    check(LLVMRunPasses(mod, rt->options.top_pipeline, NULL, options), "tier 2 optimization");
+    LLVMDisposePassBuilderOptions(options);
+
+    check(LLVMOrcLLJITAddLLVMIRModule(rt->tier2, LLVMOrcLLJITGetMainJITDylib(rt->tier2),
+                                      LLVMOrcCreateNewThreadSafeModule(mod, rt->ts_ctx)), "tier 2");
+    LLVMOrcJITTargetAddress addr;
+    check(LLVMOrcLLJITLookup(rt->tier2, &addr, name), name);
+    atomic_fetch_add(&rt->tier2_compiles, 1);
+
+    // Publish: callers pick the new body on their next call. tier_up_ms is
+    // written before the tier, so whoever sees TierOptimized can read it.
+    fun->tier_up_ms = (now() - start) * 1e3;
+    atomic_store_explicit(&fun->entry, (uintptr_t) addr, memory_order_release);
+    atomic_store(&fun->tier, TierOptimized);
+    atomic_fetch_add(&rt->swaps, 1);
+}
+
+static void *tier_up_worker(void *arg) {
+    TieredRuntime *rt = arg;
+    for (;;) {
+        sem_wait(&rt->work);
+        if (atomic_load(&rt->stopping)) {
+            return NULL;
+        }
+        for (unsigned i = 0; i < rt->count; i++) {
+            if (atomic_load(&rt->functions[i].tier) == TierQueued) {
+                compile_tier2(rt, &rt->functions[i]);
+            }
+        }
+    }
+}
+
+// ======================================================
+// Runtime
+// ======================================================
+
+/**
+ * Takes ownership of source, which must live in ts_ctx. Compiles tier 0
+ * and starts the background compiler; every function of source can then
+ * be looked up with tiered_lookup.
+ */
+static void tiered_init(TieredRuntime *rt, LLVMModuleRef source, LLVMOrcThreadSafeContextRef ts_ctx,
+                        const TieredOptions *options) {
+    memset(rt, 0, sizeof(*rt));
+    rt->options = *options;
+    rt->source = source;
+    rt->ts_ctx = ts_ctx;
+    rt->tier0 = create_jit(LLVMCodeGenLevelNone);
+    rt->tier2 = create_jit(options->top_level);
+    sem_init(&rt->work, 0, 0);
+    compile_tier0(rt);
+    pthread_create(&rt->worker, NULL, tier_up_worker, rt);
+}
+
+static void *tiered_lookup(TieredRuntime *rt, const char *name) {
+    LLVMOrcJITTargetAddress addr;
+    LLVMErrorRef err = LLVMOrcLLJITLookup(rt->tier0, &addr, name);
+    if (err) {
+        LLVMConsumeError(err);
+        return NULL;
+    }
+    return (void *) (uintptr_t) addr;
+}
+
+static TieredFunction *tiered_function(TieredRuntime *rt, const char *name) {
+    for (unsigned i = 0; i < rt->count; i++) {
+        if (strcmp(rt->functions[i].name, name) == 0) {
+            return &rt->functions[i];
+        }
+    }
+    return NULL;
+}
+
+static void tiered_dispose(TieredRuntime *rt) {
+    atomic_store(&rt->stopping, 1);
+    sem_post(&rt->work);
+    pthread_join(rt->worker, NULL);
+    sem_destroy(&rt->work);
+    LLVMOrcDisposeLLJIT(rt->tier2);
+    LLVMOrcDisposeLLJIT(rt->tier0);
+    LLVMDisposeModule(rt->source);
+}
+
+static const char *tier_names[] = { "baseline", "queued", "optimized" };
+
+// ======================================================
+// Example
+// ======================================================
+
+/**
+ * int sum(int a, int b)  { return a + b; }
+ * int mix(int x, int n)  { int acc = 0;
+ *                          for (int i = 0; i < n; i++)
+ *                              acc = sum(acc * 31, x ^ i);
+ *                          return acc; }
+ */
+static LLVMModuleRef build_source(LLVMContextRef ctx) {
+    LLVMModuleRef mod = LLVMModuleCreateWithNameInContext("my_module", ctx);
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(ctx);
+    LLVMTypeRef param_types[] = { i32, i32 };
+    LLVMTypeRef fun_type = LLVMFunctionType(i32, param_types, 2, 0);
+    LLVMBuilderRef builder = LLVMCreateBuilderInContext(ctx);
+
+    LLVMValueRef sum = LLVMAddFunction(mod, "sum", fun_type);
+    LLVMPositionBuilderAtEnd(builder, LLVMAppendBasicBlockInContext(ctx, sum, "entry"));
+    LLVMBuildRet(builder, LLVMBuildAdd(builder, LLVMGetParam(sum, 0), LLVMGetParam(sum, 1), "tmp"));
+
+    LLVMValueRef mix = LLVMAddFunction(mod, "mix", fun_type);
+    LLVMBasicBlockRef entry = LLVMAppendBasicBlockInContext(ctx, mix, "entry");
+    LLVMBasicBlockRef loop = LLVMAppendBasicBlockInContext(ctx, mix, "loop");
+    LLVMBasicBlockRef exit = LLVMAppendBasicBlockInContext(ctx, mix, "exit");
+    LLVMValueRef x = LLVMGetParam(mix, 0);
+    LLVMValueRef n = LLVMGetParam(mix, 1);
+    LLVMValueRef zero = LLVMConstInt(i32, 0, 0);
+
+    LLVMPositionBuilderAtEnd(builder, entry);
+    LLVMBuildCondBr(builder, LLVMBuildICmp(builder, LLVMIntSLE, n, zero, "empty"), exit, loop);
+
+    LLVMPositionBuilderAtEnd(builder, loop);
+    LLVMValueRef i = LLVMBuildPhi(builder, i32, "i");
+    LLVMValueRef acc = LLVMBuildPhi(builder, i32, "acc");
+    LLVMValueRef args[] = {
+        LLVMBuildMul(builder, acc, LLVMConstInt(i32, 31, 0), "scaled"),
+        LLVMBuildXor(builder, x, i, "mixed"),
+    };
+    LLVMValueRef next_acc = LLVMBuildCall2(builder, fun_type, sum, args, 2, "next_acc");
+    LLVMValueRef next_i = LLVMBuildAdd(builder, i, LLVMConstInt(i32, 1, 0), "next_i");
+    LLVMBuildCondBr(builder, LLVMBuildICmp(builder, LLVMIntEQ, next_i, n, "done"), exit, loop);
+    LLVMAddIncoming(i, (LLVMValueRef[]) { zero, next_i }, (LLVMBasicBlockRef[]) { entry, loop }, 2);
+    LLVMAddIncoming(acc, (LLVMValueRef[]) { zero, next_acc }, (LLVMBasicBlockRef[]) { entry, loop }, 2);
+
+    LLVMPositionBuilderAtEnd(builder, exit);
+    LLVMValueRef result = LLVMBuildPhi(builder, i32, "result");
+    LLVMAddIncoming(result, (LLVMValueRef[]) { zero, next_acc }, (LLVMBasicBlockRef[]) { entry, loop }, 2);
+    LLVMBuildRet(builder, result);
+
+    LLVMDisposeBuilder(builder);
+    return mod;
+}
+
+int main(int argc, char const *argv[]) {
+    TieredOptions options = {
+        .threshold = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000,
+        .top_level = LLVMCodeGenLevelAggressive,
+        .top_pipeline = "default<O3>",
+    };
+    long calls = argc > 2 ? atol(argv[2]) : 200000;
+    if (options.threshold == 0) {
+        options.threshold = 1;
+    }
+
+    LLVMInitializeNativeTarget();
+    LLVMInitializeNativeAsmPrinter();
+
+    LLVMOrcThreadSafeContextRef ts_ctx = LLVMOrcCreateNewThreadSafeContext();
+    LLVMModuleRef source = build_source(LLVMOrcThreadSafeContextGetContext(ts_ctx));
+
+    double start = now();
+    TieredRuntime rt;
+    tiered_init(&rt, source, ts_ctx, &options);
+    int32_t (*mix)(int32_t, int32_t) = (int32_t (*)(int32_t, int32_t)) tiered_lookup(&rt, "mix");
+    printf("tier 0 ready in %.2f ms\n", (now() - start) * 1e3);
+    TieredFunction *mix_record = tiered_function(&rt, "mix");
+    TieredFunction *sum_record = tiered_function(&rt, "sum");
+
+    // Call mix continuously and watch the per-call time drop after tier-up
+    long window = calls / 20 ? calls / 20 : 1;
+    int32_t sink = 0;
+    start = now();
+    for (long c = 0; c < calls; c++) {
+        sink ^= mix((int32_t) c, 64);
+        if ((c + 1) % window == 0) {
+            double elapsed = now() - start;
+            printf("calls %8ld: %7.1f ns/call, mix %s, sum %s\n", c + 1, elapsed * 1e9 / window,
+                   tier_names[atomic_load(&mix_record->tier)], tier_names[atomic_load(&sum_record->tier)]);
+            start = now();
+        }
+    }
+
+    printf("tier-up requests %llu, tier-2 compiles %llu, entry swaps %llu [%d]\n",
+           (unsigned long long) atomic_load(&rt.tier_up_requests),
+           (unsigned long long) atomic_load(&rt.tier2_compiles),
+           (unsigned long long) atomic_load(&rt.swaps), sink & 1);
+    for (unsigned i = 0; i < rt.count; i++) {
+        // The worker may still be compiling: only an optimized function has its time
+        int tier = atomic_load(&rt.functions[i].tier);
+        printf("  %s: %llu calls through the stub, %s", rt.functions[i].name,
+               (unsigned long long) atomic_load(&rt.functions[i].count), tier_names[tier]);
+        if (tier == TierOptimized) {
+            printf(", tier-up compile %.2f ms", rt.functions[i].tier_up_ms);
+        }
+        printf("\n");
+    }
+
+    tiered_dispose(&rt);
+    LLVMOrcDisposeThreadSafeContext(ts_ctx);
+}